@@ -101,7 +101,9 @@ func (b *Bitcask) GetRecord(key string) *Record {
 	var ret_ver C.int
 	c_key := C.CString(key)
 	defer C.free(unsafe.Pointer(c_key))
-	dr := C.bc_get(b.bc, c_key, &ret_pos, &ret_ver)
+	var hk C.HKey
+	C.hk_init(&hk, c_key, C.int(len(key)))
+	dr := C.bc_get(b.bc, &hk, &ret_pos, &ret_ver)
 	if dr == nil {
 		return nil
 	}
@@ -130,7 +132,9 @@ func (b *Bitcask) Set(key string, value []byte, flag, version int32) error {
 	defer C.free(unsafe.Pointer(ckey))
 	cv := C.CString(string(value))
 	defer C.free(unsafe.Pointer(cv))
-	if !(0 != (C.bc_set(b.bc, ckey, cv, C.size_t(len(value)),
+	var hk C.HKey
+	C.hk_init(&hk, ckey, C.int(len(key)))
+	if !(0 != (C.bc_set(b.bc, &hk, cv, C.size_t(len(value)),
 		C.int(flag), C.int(version)))) {
 		return errors.New("set failed")
 	}
@@ -0,0 +1,74 @@
+package btest
+
+// #cgo CFLAGS:  -I ../src -I ../third-party/zlog-1.2/
+// #cgo LDFLAGS: -L ../third-party/zlog-1.2/ -lzlog -L .  -lbeansdb
+// #include <stdlib.h>
+// #include "dict.h"
+// #include "fnv1a.h"
+import "C"
+import (
+	"encoding/binary"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"unsafe"
+)
+
+type DictTrainer struct {
+	t *C.DictTrainer
+}
+
+// load the dictionaries of dir, as a bitcask does when opened
+func OpenDict(dir string) *DictTrainer {
+	p := C.CString(dir)
+	defer C.free(unsafe.Pointer(p))
+	return &DictTrainer{t: C.dict_open(p, C.bool(true))}
+}
+
+func (dt *DictTrainer) Close() {
+	C.dict_close(dt.t)
+	dt.t = nil
+}
+
+func (dt *DictTrainer) HasCurrent() bool {
+	return C.dict_current(dt.t) != nil
+}
+
+// compress src with the current dictionary into at most size bytes
+func (dt *DictTrainer) Compress(src []byte, size int) ([]byte, bool) {
+	dst := (*C.char)(C.malloc(C.size_t(size)))
+	defer C.free(unsafe.Pointer(dst))
+	p := C.CBytes(src)
+	defer C.free(p)
+	n := C.dict_compress(C.dict_current(dt.t), (*C.char)(p), C.int(len(src)), dst, C.int(size))
+	if n < 0 {
+		return nil, false
+	}
+	return C.GoBytes(unsafe.Pointer(dst), n), true
+}
+
+func DictDecompress(src []byte) ([]byte, bool) {
+	p := C.CBytes(src)
+	defer C.free(p)
+	var size C.uint
+	v := C.dict_decompress((*C.char)(p), C.int(len(src)), &size)
+	if v == nil {
+		return nil, false
+	}
+	defer C.free(unsafe.Pointer(v))
+	return C.GoBytes(unsafe.Pointer(v), C.int(size)), true
+}
+
+// save content as dir/NNN.dict, as the trainer does
+func WriteDict(dir string, version int, content []byte) error {
+	if err := os.MkdirAll(dir, 0750); err != nil {
+		return err
+	}
+	p := C.CBytes(content)
+	defer C.free(p)
+	buf := make([]byte, 8+len(content))
+	binary.LittleEndian.PutUint32(buf, uint32(C.fnv1a((*C.char)(p), C.int(len(content)))))
+	binary.LittleEndian.PutUint32(buf[4:], uint32(len(content)))
+	copy(buf[8:], content)
+	return ioutil.WriteFile(fmt.Sprintf("%s/%03d.dict", dir, version), buf, 0640)
+}
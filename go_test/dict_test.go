@@ -0,0 +1,108 @@
+package btest
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"math/rand"
+	"os"
+	"testing"
+)
+
+func dictContent(seed string) []byte {
+	var b bytes.Buffer
+	for i := 0; b.Len() < 4096; i++ {
+		fmt.Fprintf(&b, "{\"%s\":%d,\"name\":\"user-%d\",\"tags\":[\"a%d\"]}", seed, i*7919, i, i%13)
+	}
+	return b.Bytes()[:4096]
+}
+
+func randomBytes(n int) []byte {
+	b := make([]byte, n)
+	rand.New(rand.NewSource(1)).Read(b)
+	return b
+}
+
+type dictCase struct {
+	name  string
+	value []byte
+	size  int  // the room to compress into
+	ok    bool // compressed into it
+	max   int  // at most so many bytes, if ok
+}
+
+func dictCases(content []byte) []dictCase {
+	mixed := append(append([]byte("head-"), content[100:400]...), randomBytes(50)...)
+	return []dictCase{
+		{"dictionary only", content[1000:1200], 200, true, 16},
+		{"whole dictionary", content, 4096, true, 64},
+		{"max length run", bytes.Repeat([]byte{'a'}, 4096), 4096, true, 32},
+		{"mixed", mixed, len(mixed), true, 200},
+		{"incompressible", randomBytes(1000), 1000, false, 0},
+		{"incompressible with room", randomBytes(1000), 1100, true, 1100},
+		{"long literals", randomBytes(300), 400, true, 400},
+		{"too large", randomBytes(4097), 8192, false, 0},
+	}
+}
+
+func testDictRoundTrip(t *testing.T, dt *DictTrainer, cases []dictCase) map[string][]byte {
+	encoded := make(map[string][]byte)
+	for _, c := range cases {
+		enc, ok := dt.Compress(c.value, c.size)
+		if ok != c.ok {
+			t.Errorf("%s: compressed %v, expected %v", c.name, ok, c.ok)
+			continue
+		}
+		if !ok {
+			continue
+		}
+		if len(enc) > c.max {
+			t.Errorf("%s: %d bytes compressed into %d, expected at most %d", c.name, len(c.value), len(enc), c.max)
+		}
+		dec, ok := DictDecompress(enc)
+		if !ok || !bytes.Equal(dec, c.value) {
+			t.Errorf("%s: round trip failed", c.name)
+		}
+		encoded[c.name] = enc
+	}
+	return encoded
+}
+
+func TestDictCodec(t *testing.T) {
+	dir, _ := ioutil.TempDir("", "dict")
+	defer os.RemoveAll(dir)
+	content := dictContent("v1")
+	if err := WriteDict(dir, 1, content); err != nil {
+		t.Fatal(err)
+	}
+
+	dt := OpenDict(dir)
+	if !dt.HasCurrent() {
+		t.Fatal("001.dict not loaded")
+	}
+	encoded := testDictRoundTrip(t, dt, dictCases(content))
+	dt.Close()
+
+	// no open bitcask has it any more
+	if _, ok := DictDecompress(encoded["dictionary only"]); ok {
+		t.Error("decoded with a released dictionary")
+	}
+
+	// reloaded with a newer version, the old records stay readable
+	content2 := dictContent("v2")
+	if err := WriteDict(dir, 2, content2); err != nil {
+		t.Fatal(err)
+	}
+	dt = OpenDict(dir)
+	defer dt.Close()
+	for name, enc := range encoded {
+		if _, ok := DictDecompress(enc); !ok {
+			t.Errorf("%s: not decoded after reload", name)
+		}
+	}
+	testDictRoundTrip(t, dt, dictCases(content2))
+	enc, _ := dt.Compress(content2[500:700], 200)
+	if len(enc) > 16 {
+		t.Errorf("version 2 is not the current one, %d bytes", len(enc))
+	}
+}
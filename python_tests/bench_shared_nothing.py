@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+# coding:utf-8
+#
+# Compare the default model (all threads share every bitcask) with the
+# shared-nothing one (-O) at 8/16/32 cores:
+#
+#   python bench_shared_nothing.py [seconds] [cores ...]
+#
+# The server is pinned to the first N cores with taskset and runs N
+# threads, the clients are pinned to the remaining ones when there are
+# any left, else they float over all of them.
+
+from __future__ import print_function
+
+import multiprocessing
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+from os.path import dirname, abspath
+
+PORT = 7950
+TOP_DIR = dirname(dirname(abspath(__file__)))
+BEANSDB = os.path.join(TOP_DIR, "src/beansdb")
+CONF = os.path.join(dirname(abspath(__file__)), "test_nolog.conf")
+
+
+def recv_until(s, buf, end):
+    while not buf.endswith(end):
+        d = s.recv(65536)
+        if not d:
+            raise IOError("closed")
+        buf += d
+    return buf
+
+
+def client(idx, seconds, queue, cpus):
+    if cpus:
+        subprocess.check_call(["taskset", "-p", "-c", cpus, str(os.getpid())],
+                              stdout=open(os.devnull, "w"))
+    s = socket.create_connection(("127.0.0.1", PORT))
+    value = os.urandom(100)
+    ops, i = 0, 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        key = ("bench_%d_%d" % (idx, i % 10000)).encode()
+        if i % 10 == 0:
+            s.sendall(b"set " + key + b" 0 0 100\r\n" + value + b"\r\n")
+            recv_until(s, b"", b"\r\n")
+        else:
+            s.sendall(b"get " + key + b"\r\n")
+            recv_until(s, b"", b"END\r\n")
+        ops += 1
+        i += 1
+    s.close()
+    queue.put(ops)
+
+
+def run(cores, shared_nothing, seconds):
+    home = tempfile.mkdtemp(prefix="beansdb_bench_")
+    ncpu = multiprocessing.cpu_count()
+    client_cpus = "%d-%d" % (cores, ncpu - 1) if cores < ncpu else None
+    cmd = ["taskset", "-c", "0-%d" % (min(cores, ncpu) - 1),
+           BEANSDB, "-p", str(PORT), "-H", home, "-T", "2", "-t", str(cores), "-L", CONF]
+    if shared_nothing:
+        cmd.append("-O")
+    if os.getuid() == 0:
+        cmd += ["-u", "root"]
+    p = subprocess.Popen(cmd, close_fds=True)
+    try:
+        for _ in range(600):
+            try:
+                socket.create_connection(("127.0.0.1", PORT)).close()
+                break
+            except socket.error:
+                time.sleep(0.1)
+        else:
+            raise Exception("cannot start %s" % " ".join(cmd))
+        queue = multiprocessing.Queue()
+        clients = [multiprocessing.Process(target=client, args=(i, seconds, queue, client_cpus))
+                   for i in range(cores * 2)]
+        for c in clients:
+            c.start()
+        total = sum(queue.get() for c in clients)
+        for c in clients:
+            c.join()
+        return total / float(seconds)
+    finally:
+        p.terminate()
+        p.wait()
+        shutil.rmtree(home)
+
+
+def main():
+    seconds = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+    cores = [int(n) for n in sys.argv[2:]] or [8, 16, 32]
+    print("%6s %14s %14s %8s" % ("cores", "shared ops/s", "-O ops/s", "ratio"))
+    for n in cores:
+        shared = run(n, False, seconds)
+        owned = run(n, True, seconds)
+        print("%6d %14.0f %14.0f %8.2f" % (n, shared, owned, owned / shared))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import glob
+import hashlib
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+import telnetlib
+
+
+class TestBlobDedup(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+        self.backend1.cmd += " -D 16"
+
+    def _gc(self):
+        t = telnetlib.Telnet("127.0.0.1", self.backend1.port)
+        t.write('flush_all 0\n')
+        t.read_until('OK')
+        while True:
+            t.write('optimize_stat\n')
+            status = t.read_until('\n').strip("\r\n")
+            if status.find('running') < 0:
+                break
+            time.sleep(0.5)
+        t.write('quit\n')
+        t.close()
+        self.assertEqual(status, 'success')
+
+    def _blob(self, data):
+        h = hashlib.sha256(data).hexdigest()
+        return glob.glob(os.path.join(self.backend1.db_home, '*', 'blob', h[:2], h))
+
+    def test_refs_and_sweep(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        dup = os.urandom(100 * 1024)
+        uniq = os.urandom(50 * 1024)
+        # in the same bitcask, so share one blob
+        keys = [k for k in self.backend1.generate_key(prefix='dup', count=64, sector=0)]
+        self.assert_(store.set_raw(keys[0], dup, flag=0))
+        self.assert_(store.set_raw(keys[1], dup, flag=0))
+        self.assert_(store.set_raw(keys[2], uniq, flag=0))
+        self.assertEqual(len(self._blob(dup)), 1)
+        self.assertEqual(len(self._blob(uniq)), 1)
+        self.assertEqual(self.backend1.stat()['dedup_hits'], '1')
+
+        self.assert_(store.delete(keys[0]))
+        self.assert_(store.delete(keys[2]))
+        print "stop beansdb to rotate data file"
+        self.backend1.stop()
+        self.backend1.start()
+        self._gc()
+        self.assertEqual(store.get_raw(keys[1]), (dup, 0))
+        self.assertEqual(len(self._blob(dup)), 1)
+        self.assertEqual(self._blob(uniq), [])
+
+        print "kill beansdb, so the blobs are counted again"
+        self.backend1.popen.kill()
+        self.backend1.popen.wait()
+        self.backend1.popen = None
+        blob_dir = os.path.dirname(os.path.dirname(self._blob(dup)[0]))
+        orphan = os.path.join(blob_dir, 'ab', 'ab' * 32)
+        if not os.path.exists(os.path.dirname(orphan)):
+            os.makedirs(os.path.dirname(orphan))
+        open(orphan, 'w').write('orphan')
+        self.backend1.start()
+        self.assertEqual(store.get_raw(keys[1]), (dup, 0))
+        self.assertEqual(store.get(keys[0]), None)
+        self.assert_(not os.path.exists(orphan))
+        self.assertEqual(self.backend1.stat()['dedup_refs'], '1')
+        self.backend1.stop()
+
+    def test_broken_blob(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        flipped = os.urandom(100 * 1024)
+        truncated = os.urandom(100 * 1024)
+        self.assert_(store.set_raw('flipped', flipped, flag=0))
+        self.assert_(store.set_raw('truncated', truncated, flag=0))
+        self.assertEqual(store.get_raw('flipped'), (flipped, 0))
+        self.backend1.stop()
+
+        path = self._blob(flipped)[0]
+        data = open(path, 'rb').read()
+        open(path, 'wb').write(data[:5000] + chr(ord(data[5000]) ^ 1) + data[5001:])
+        path = self._blob(truncated)[0]
+        open(path, 'r+b').truncate(50 * 1024)
+        print "broken blobs are not returned"
+        self.backend1.start()
+        self.assertEqual(store.get('flipped'), None)
+        self.assertEqual(store.get('truncated'), None)
+        self.backend1.stop()
+
+    def test_off_fast_tier(self):
+        fast = os.path.join(self.data_base_path, 'fast')
+        if not os.path.exists(fast):
+            os.makedirs(fast)
+        self.backend1.cmd = self.backend1.cmd.replace(
+            "-H %s" % (self.backend1.db_home), "-F 5 -H %s,%s@fast" % (self.backend1.db_home, fast))
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        values = [os.urandom(100 * 1024) for i in xrange(8)]
+        for i, v in enumerate(values):
+            self.assert_(store.set_raw('blob%d' % i, v, flag=0))
+        for i, v in enumerate(values):
+            self.assertEqual(store.get_raw('blob%d' % i), (v, 0))
+            path = self._blob(v)[0]
+            self.assert_(not os.path.realpath(path).startswith(fast))
+        self.backend1.stop()
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+import memcache
+
+
+class TestCompressClass(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+
+    def _compress_stats(self):
+        mc = memcache.Client(["127.0.0.1:%s" % (self.backend1.port)])
+        return mc.get_stats('compress')[0][1]
+
+    def test_flags_apart(self):
+        """ 0x1 and 0x40 shared a class when the flags were hashed """
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        for i in xrange(100):
+            self.assert_(store.set_raw('random%d' % i, os.urandom(5000), flag=0x1))
+        text = 'compressible text ' * 300
+        for i in xrange(40):
+            self.assert_(store.set_raw('text%d' % i, text, flag=0x40))
+        stats = self._compress_stats()
+        self.assertEqual(stats['1_4096:wins'], '0')
+        self.assert_(int(stats['1_4096:skips']) > 0)
+        self.assertEqual(stats['40_4096:wins'], '40')
+        self.assertEqual(stats['40_4096:skips'], '0')
+        for i in xrange(40):
+            self.assertEqual(store.get_raw('text%d' % i), (text, 0x40))
+
+    def test_overflow(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        text = 'compressible text ' * 300
+        for i in xrange(70):
+            self.assert_(store.set_raw('flag%d' % i, text, flag=(i + 1) << 8))
+        stats = self._compress_stats()
+        self.assert_(int(stats['other_4096:tries']) > 0)
+        self.assertEqual(stats['compress_wins'], '70')
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+
+STREAM_CHUNK_SIZE = 256 * 1024
+
+
+class TestFrozenGet(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+
+    def _streams(self):
+        return int(self.backend1.stat()['get_streams'])
+
+    def test_mapped_and_streamed(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        values = {}
+        for i in xrange(100):
+            values['small%d' % i] = os.urandom(100 + i * 10)
+            values['text%d' % i] = "hello world %d " % i * 100
+        for i in xrange(4):
+            values['large%d' % i] = os.urandom(STREAM_CHUNK_SIZE + i * 100 * 1024)
+        values['edge'] = os.urandom(STREAM_CHUNK_SIZE)
+        values['below'] = os.urandom(STREAM_CHUNK_SIZE - 1)
+        for k, v in values.items():
+            self.assert_(store.set_raw(k, v, flag=0))
+        self.assert_(store.set_raw('deleted', 'deleted', flag=0))
+        self.assert_(store.delete('deleted'))
+
+        print "the values returned by a server writing"
+        self.backend1.stop()
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        expected = dict((k, store.get_raw(k)) for k in values)
+        for k, v in values.items():
+            self.assertEqual(expected[k], (v, 0))
+        self.backend1.stop()
+
+        time.sleep(1)
+        before = time.strftime("%Y-%m-%d-%H:%M:%S", time.localtime())
+        time.sleep(1)
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        self.assert_(store.set_raw('late', 'late', flag=0))
+        self.backend1.stop()
+
+        print "the same values from a -m server, mapped and streamed"
+        self.backend1.cmd += " -m %s" % (before)
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        streams = self._streams()
+        for k in values:
+            self.assertEqual(store.get_raw(k), expected[k])
+        large = [k for k in values if len(values[k]) >= STREAM_CHUNK_SIZE]
+        self.assertEqual(self._streams(), streams + len(large))
+        result = store.get_multi(values.keys() + ['deleted', 'late'])
+        self.assertEqual(sorted(result.keys()), sorted(values.keys()))
+        for k, v in values.items():
+            self.assertEqual(result[k], v)
+        self.assertEqual(store.get('deleted'), None)
+        self.assertEqual(store.get('late'), None)
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
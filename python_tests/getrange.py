@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import socket
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+
+
+class TestGetRange(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+        self.backend1.cmd += " -D 16"
+
+    def _getrange(self, key, start, length):
+        """ return (value, flag, total length), None if not found """
+        s = socket.create_connection(("127.0.0.1", self.backend1.port))
+        f = s.makefile()
+        s.sendall("getrange %s %d %d\r\n" % (key, start, length))
+        line = f.readline().strip("\r\n")
+        result = None
+        if line.startswith("VALUE "):
+            _, k, flag, n, total = line.split()
+            self.assertEqual(k, key)
+            result = (f.read(int(n) + 2)[:-2], int(flag), int(total))
+            line = f.readline().strip("\r\n")
+        self.assertEqual(line, "END")
+        s.close()
+        return result
+
+    def _check(self, key, data):
+        n = len(data)
+        self.assertEqual(self._getrange(key, 0, 100), (data[:100], 0, n))
+        self.assertEqual(self._getrange(key, 1000, 4096), (data[1000:5096], 0, n))
+        self.assertEqual(self._getrange(key, n - 10, 100), (data[-10:], 0, n))
+        self.assertEqual(self._getrange(key, n, 10), ("", 0, n))
+        self.assertEqual(self._getrange(key, n + 1, 10), ("", 0, n))
+        self.assertEqual(self._getrange(key, 7, 0), (data[7:], 0, n))
+
+    def test_getrange(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        text = "".join("hello world %d " % i for i in xrange(10000))
+        blob = os.urandom(100 * 1024)
+        plain = os.urandom(10 * 1024)
+        values = {'text': text, 'dup1': blob, 'dup2': blob, 'plain': plain}
+        for k, v in values.items():
+            self.assert_(store.set_raw(k, v, flag=0))
+        self.assert_(store.set_raw('deleted', plain, flag=0))
+        self.assert_(store.delete('deleted'))
+        self.assertEqual(self.backend1.stat()['dedup_hits'], '1')
+
+        def check_all():
+            for k, v in values.items():
+                self._check(k, v)
+            self.assertEqual(self._getrange('deleted', 0, 10), None)
+            self.assertEqual(self._getrange('missing', 0, 10), None)
+
+        print "in the write buffer"
+        check_all()
+        print "in the data file"
+        self.backend1.stop()
+        self.backend1.start()
+        check_all()
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
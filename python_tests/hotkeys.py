@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import threading
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+import memcache
+
+MAX_KEY_LEN = 250
+
+
+class TestHotKeys(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+        self.backend1.cmd += " -K 1 -t 4"
+
+    def _hotkeys(self, top):
+        mc = memcache.Client(["127.0.0.1:%s" % (self.backend1.port)])
+        return mc.get_stats('hotkeys %d' % (top))[0][1]
+
+    def test_long_keys(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        keys = ['%03d' % i + 'k' * (MAX_KEY_LEN - 3) for i in xrange(100)]
+        value = os.urandom(1024 * 1024)
+        for k in keys:
+            self.assert_(store.set_raw(k, value, flag=0))
+
+        def reader(part):
+            s = MCStore(self.backend1_addr)
+            for i in xrange(20):
+                for k in part:
+                    s.get_raw(k)
+        threads = [threading.Thread(target=reader, args=(keys[i::4],)) for i in xrange(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        for top in (1, 10, 100):
+            stats = self._hotkeys(top)
+            hot = [v for k, v in stats.items() if k.endswith('_key')]
+            self.assert_(0 < len(hot) <= top)
+            for k in hot:
+                self.assert_(k in keys)
+        print "the server is still alive"
+        self.assertEqual(store.get_raw(keys[0]), (value, 0))
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
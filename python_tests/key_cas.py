@@ -0,0 +1,129 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import telnetlib
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+
+
+class TestKeyCas(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+
+    def _gets(self, key):
+        """ return (value, flag, version), None if not found """
+        t = telnetlib.Telnet("127.0.0.1", self.backend1.port)
+        t.write('gets %s\r\n' % (key))
+        line = t.read_until('\r\n').strip("\r\n")
+        result = None
+        if line.startswith('VALUE '):
+            _, k, flag, n, cas = line.split()
+            value = t.read_until('\r\n')
+            while len(value) < int(n) + 2:
+                value += t.read_until('\r\n')
+            result = (value[:-2], int(flag), int(cas))
+            line = t.read_until('\r\n').strip("\r\n")
+        self.assertEqual(line, 'END')
+        t.close()
+        return result
+
+    def _cas(self, key, value, cas, flag=0):
+        t = telnetlib.Telnet("127.0.0.1", self.backend1.port)
+        t.write('cas %s %d 0 %d %d\r\n%s\r\n' % (key, flag, len(value), cas, value))
+        result = t.read_until('\r\n').strip("\r\n")
+        t.close()
+        return result
+
+    def _cmd(self, line, value=None):
+        t = telnetlib.Telnet("127.0.0.1", self.backend1.port)
+        t.write(line + '\r\n')
+        if value is not None:
+            t.write(value + '\r\n')
+        result = t.read_until('\r\n').strip("\r\n")
+        t.close()
+        return result
+
+    def _get_version(self, store, key):
+        meta = store.get("?" + key)
+        if meta:
+            return int(meta.split()[0])
+
+    def test_cas(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        key = "key1"
+        self.assert_(store.set_raw(key, "aaa", flag=3))
+        self.assertEqual(self._gets(key), ("aaa", 3, 1))
+        store.set_raw(key, "bbb", rev=3, flag=3)
+        self.assertEqual(self._gets(key), ("bbb", 3, 3))
+
+        self.assertEqual(self._cas(key, "ccc", 3, flag=4), "STORED")
+        self.assertEqual(self._gets(key), ("ccc", 4, 4))
+        self.assertEqual(self._get_version(store, key), 4)
+        print "a stale version"
+        self.assertEqual(self._cas(key, "ddd", 3), "EXISTS")
+        self.assertEqual(self._gets(key), ("ccc", 4, 4))
+
+        print "a missing key"
+        self.assertEqual(self._gets("key2"), None)
+        self.assertEqual(self._cas("key2", "eee", 1), "NOT_FOUND")
+        self.assertEqual(store.get("key2"), None)
+        self.assert_(store.delete(key))
+        self.assertEqual(self._cas(key, "fff", 4), "NOT_FOUND")
+        self.assertEqual(self._gets(key), None)
+
+    def test_cas_before(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        key = "key1"
+        self.assert_(store.set_raw(key, "aaa", flag=0))
+        self.backend1.stop()
+
+        print "serve the data written before now, read-only"
+        time.sleep(1)
+        before = time.strftime("%Y-%m-%d-%H:%M:%S", time.localtime())
+        self.backend1.cmd += " -m %s" % (before)
+        self.backend1.start()
+        self.assertEqual(self._gets(key), ("aaa", 0, 1))
+        self.assertEqual(self._cas(key, "bbb", 1), "NOT_STORED")
+        self.assertEqual(self._gets(key), ("aaa", 0, 1))
+
+    def test_incr_append_errors(self):
+        """ a failed incr was replied as 0 """
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        self.assertEqual(self._cmd('incr n 5'), '5')
+        self.assertEqual(self._cmd('incr n 3'), '8')
+        self.assert_(store.set_raw('s', 'abc', flag=0))
+        self.assertEqual(self._cmd('incr s 1'),
+                'CLIENT_ERROR cannot increment or decrement non-numeric value')
+        self.assertEqual(self._cmd('append a 0 0 3', 'xyz'), 'STORED')
+        self.assertEqual(self._cmd('append s 0 0 3', 'xyz'), 'NOT_STORED')
+        self.backend1.stop()
+
+        print "nothing is written by a read-only server"
+        time.sleep(1)
+        before = time.strftime("%Y-%m-%d-%H:%M:%S", time.localtime())
+        self.backend1.cmd += " -m %s" % (before)
+        self.backend1.start()
+        self.assertEqual(self._cmd('incr n 1'), 'SERVER_ERROR incr failed')
+        self.assertEqual(self._cmd('append a 0 0 3', 'xyz'), 'NOT_STORED')
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
@@ -0,0 +1,62 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import shutil
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+import memcache
+
+
+class TestStatsDisks(TestBeansdbBase):
+    """ the stats are per physical disk: set BEANSDB_TEST_DISKS to
+        directories on many disks (e.g. tmpfs mounts) to have them all """
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+        disks = os.environ.get('BEANSDB_TEST_DISKS')
+        if disks:
+            self.paths = [os.path.join(d, 'beansdb_57901') for d in disks.split(',')]
+        else:
+            self.paths = [os.path.join(self.data_base_path, 'disk%d' % i) for i in range(32)]
+        for p in self.paths:
+            if os.path.exists(p):
+                shutil.rmtree(p)
+            os.makedirs(p)
+        self.backend1.cmd = self.backend1.cmd.replace(
+            "-H %s" % (self.backend1.db_home), "-H %s" % (",".join(self.paths)))
+
+    def test_many_paths(self):
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        for i in xrange(100):
+            self.assert_(store.set('key%d' % i, 'v' * 1000))
+        mc = memcache.Client(["127.0.0.1:%s" % (self.backend1.port)])
+        for i in xrange(3):
+            stats = mc.get_stats('disks')[0][1]
+            disks = [k for k in stats if k.endswith('_path')]
+            self.assert_(len(disks) >= 1)
+            self.assertEqual(len(stats), 12 * len(disks))
+        if os.environ.get('BEANSDB_TEST_DISKS'):
+            self.assertEqual(len(disks), len(self.paths))
+        self.assertEqual(store.get('key1'), 'v' * 1000)
+
+    def tearDown(self):
+        self.backend1.stop()
+        for p in self.paths:
+            if os.path.exists(p):
+                shutil.rmtree(p)
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+# coding:utf-8
+
+import os
+import sys
+import time
+import socket
+from base import BeansdbInstance, TestBeansdbBase, MCStore
+import unittest
+import memcache
+
+STREAM_CHUNK_SIZE = 256 * 1024
+
+
+class TestStreamGet(TestBeansdbBase):
+
+    proxy_addr = 'localhost:7905'
+    backend1_addr = 'localhost:57901'
+
+    def setUp(self):
+        self._clear_dir()
+        self._init_dir()
+        self.backend1 = BeansdbInstance(self.data_base_path, 57901)
+        self.values = {
+            'big': os.urandom(40 * STREAM_CHUNK_SIZE + 17),
+            'edge': os.urandom(STREAM_CHUNK_SIZE),
+            'below': os.urandom(STREAM_CHUNK_SIZE - 1),
+            'small': 'hello',
+        }
+
+    def _streams(self):
+        return int(self.backend1.stat()['get_streams'])
+
+    def _conn_mem(self):
+        mc = memcache.Client(["127.0.0.1:%s" % (self.backend1.port)])
+        return int(mc.get_stats('memory')[0][1]['mem_conn_freelist'])
+
+    def _start(self):
+        """ values are streamed from the data files, not the write buffer """
+        self.backend1.start()
+        store = MCStore(self.backend1_addr)
+        for k, v in self.values.items():
+            self.assert_(store.set_raw(k, v, flag=0))
+        self.backend1.stop()
+        self.backend1.start()
+        return MCStore(self.backend1_addr)
+
+    def test_threshold(self):
+        store = self._start()
+        streams = self._streams()
+        self.assertEqual(store.get_raw('big'), (self.values['big'], 0))
+        self.assertEqual(self._streams(), streams + 1)
+        self.assertEqual(store.get_raw('edge'), (self.values['edge'], 0))
+        self.assertEqual(self._streams(), streams + 2)
+        self.assertEqual(store.get_raw('below'), (self.values['below'], 0))
+        self.assertEqual(store.get_raw('small'), ('hello', 0))
+        self.assertEqual(self._streams(), streams + 2)
+
+    def test_multi_get(self):
+        store = self._start()
+        streams = self._streams()
+        keys = ['small', 'big', 'missing', 'below', 'edge']
+        result = store.get_multi(keys)
+        self.assertEqual(sorted(result.keys()), sorted(self.values.keys()))
+        for k, v in self.values.items():
+            self.assertEqual(result[k], v)
+        self.assertEqual(self._streams(), streams + 2)
+
+    def test_disconnect(self):
+        store = self._start()
+        mem = self._conn_mem()
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        s.connect(("127.0.0.1", self.backend1.port))
+        s.sendall("get big edge\r\n")
+        head = "VALUE big 0 %d\r\n" % len(self.values['big'])
+        got = ""
+        while len(got) < len(head) + 1000:
+            got += s.recv(4096)
+        self.assertEqual(got[:len(head) + 1000], head + self.values['big'][:1000])
+        time.sleep(0.5)
+        print "the stalled connection holds the buffers of streaming"
+        self.assert_(self._conn_mem() - mem >= STREAM_CHUNK_SIZE)
+        s.close()
+        time.sleep(0.5)
+        self.assert_(self._conn_mem() - mem < STREAM_CHUNK_SIZE)
+        self.assertEqual(store.get_raw('big'), (self.values['big'], 0))
+        self.assertEqual(store.get_raw('edge'), (self.values['edge'], 0))
+
+    def tearDown(self):
+        self.backend1.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
+
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4 :
@@ -75,6 +75,8 @@ static int aeApiPoll(EventLoop *eventLoop, struct timeval *tvp)
             {
                 eventLoop->fired[numevents] = j;
                 numevents++;
+                /* the rest is still ready in next select() */
+                if (numevents == eventLoop->setsize) break;
             }
         }
     }
@@ -0,0 +1,286 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "affinity.h"
+#include "util.h"
+#include "log.h"
+
+#define NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+
+static const char *class_names[AFF_CLASSES] = {"worker", "scan", "flush", "gc"};
+
+static bool enabled = false;
+static cpu_set_t allowed;               /* of the process when started */
+static cpu_set_t class_cpus[AFF_CLASSES];
+static int *worker_cpus = NULL;         /* the CPUs of workers, in order */
+static int nworker_cpus = 0;
+static cpu_set_t node_cpus[AFF_MAX_NODES];
+static int nnodes = 1;
+
+static __thread int curr_class = -1;    /* -1: inherited from the creator */
+
+/* parse "0-3,8,10-11" into set, return false if malformed */
+static bool parse_cpulist(const char *s, cpu_set_t *set, bool allow_nodes)
+{
+    CPU_ZERO(set);
+    while (*s != '\0')
+    {
+        char *end;
+        if (allow_nodes && strncmp(s, "node", 4) == 0)
+        {
+            long node = strtol(s + 4, &end, 10);
+            if (end == s + 4 || node < 0 || node >= nnodes)
+                return false;
+            CPU_OR(set, set, &node_cpus[node]);
+        }
+        else
+        {
+            long lo = strtol(s, &end, 10), hi = lo;
+            if (end == s || lo < 0 || lo >= CPU_SETSIZE)
+                return false;
+            if (*end == '-')
+            {
+                s = end + 1;
+                hi = strtol(s, &end, 10);
+                if (end == s || hi < lo || hi >= CPU_SETSIZE)
+                    return false;
+            }
+            for (; lo <= hi; lo++)
+                CPU_SET(lo, set);
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0' && *end != '\n')
+            return false;
+        else
+            break;
+        s = end;
+    }
+    return true;
+}
+
+static void load_nodes(void)
+{
+    char path[64], line[4096];
+    int i;
+    for (i = 0; i < AFF_MAX_NODES; i++)
+    {
+        safe_snprintf(path, sizeof(path), NODE_PATH, i);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            break;
+        bool ok = fgets(line, sizeof(line), f) != NULL && parse_cpulist(line, &node_cpus[i], false);
+        fclose(f);
+        if (!ok)
+            break;
+    }
+    nnodes = i;
+    if (nnodes == 0)
+    {
+        nnodes = 1;
+        node_cpus[0] = allowed;
+    }
+}
+
+static int cpu_node(int cpu)
+{
+    int i;
+    for (i = 0; i < nnodes; i++)
+    {
+        if (CPU_ISSET(cpu, &node_cpus[i]))
+            return i;
+    }
+    return 0;
+}
+
+static void apply(const cpu_set_t *set)
+{
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) != 0)
+        log_warn("sched_setaffinity failed: %s", strerror(errno));
+}
+
+/*
+ * spec is "<class>=<cpulist>[:<class>=<cpulist>...]", a cpulist may name
+ * whole nodes as "node<N>". Return false if it is malformed or names
+ * CPUs the process may not run on.
+ */
+bool aff_init(const char *spec)
+{
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+    {
+        log_fatal("sched_getaffinity failed: %s", strerror(errno));
+        return false;
+    }
+    load_nodes();
+    if (spec == NULL)
+        return true;
+
+    char *buf = strdup(spec), *save = NULL, *item;
+    bool ok = true;
+    for (item = strtok_r(buf, ":", &save); item != NULL && ok; item = strtok_r(NULL, ":", &save))
+    {
+        char *eq = strchr(item, '=');
+        int cls;
+        ok = false;
+        if (eq == NULL)
+            break;
+        *eq = '\0';
+        for (cls = 0; cls < AFF_CLASSES; cls++)
+        {
+            if (strcmp(item, class_names[cls]) == 0)
+                break;
+        }
+        if (cls == AFF_CLASSES)
+        {
+            log_fatal("unknown thread class in -a: %s", item);
+            break;
+        }
+        if (!parse_cpulist(eq + 1, &class_cpus[cls], true) || CPU_COUNT(&class_cpus[cls]) == 0)
+        {
+            log_fatal("bad cpu list for %s in -a: %s", item, eq + 1);
+            break;
+        }
+        cpu_set_t out;
+        CPU_XOR(&out, &class_cpus[cls], &allowed);
+        CPU_AND(&out, &out, &class_cpus[cls]);
+        if (CPU_COUNT(&out) > 0)
+        {
+            log_fatal("cpu list for %s in -a has CPUs not allowed to run on", item);
+            break;
+        }
+        ok = enabled = true;
+    }
+    free(buf);
+    if (!ok)
+        return false;
+
+    // the CPUs of workers are ordered by node, so that the workers
+    // sharing a node have adjacent ids
+    cpu_set_t *ws = &class_cpus[AFF_WORKER];
+    int node, cpu;
+    worker_cpus = (int*)safe_malloc(sizeof(int) * (CPU_COUNT(ws) + 1));
+    for (node = 0; node < nnodes; node++)
+    {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, ws) && cpu_node(cpu) == node)
+                worker_cpus[nworker_cpus++] = cpu;
+        }
+    }
+    return true;
+}
+
+bool aff_enabled(void)
+{
+    return enabled;
+}
+
+int aff_nodes(void)
+{
+    return nnodes;
+}
+
+void aff_set_class(int cls, int index)
+{
+    if (!enabled || cls < 0 || cls >= AFF_CLASSES || cls == curr_class)
+        return;
+    curr_class = cls;
+    if (cls == AFF_WORKER && nworker_cpus > 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpus[index % nworker_cpus], &set);
+        apply(&set);
+    }
+    else if (CPU_COUNT(&class_cpus[cls]) > 0)
+    {
+        apply(&class_cpus[cls]);
+    }
+    else
+    {
+        apply(&allowed);
+    }
+}
+
+void aff_bind_node(int cls, int node)
+{
+    if (!enabled || node < 0 || node >= nnodes)
+        return;
+    cpu_set_t set;
+    const cpu_set_t *base = CPU_COUNT(&class_cpus[cls]) > 0 ? &class_cpus[cls] : &allowed;
+    CPU_AND(&set, base, &node_cpus[node]);
+    if (CPU_COUNT(&set) == 0)
+        CPU_AND(&set, &allowed, &node_cpus[node]);
+    if (CPU_COUNT(&set) == 0)
+        return;
+    curr_class = -1;
+    apply(&set);
+}
+
+int aff_worker_node(int index)
+{
+    if (nworker_cpus == 0)
+        return -1;
+    return cpu_node(worker_cpus[index % nworker_cpus]);
+}
+
+static int format_cpulist(char *buf, int size, const cpu_set_t *set)
+{
+    int n = 0, cpu, lo = -1;
+    buf[0] = '\0';
+    for (cpu = 0; cpu <= CPU_SETSIZE; cpu++)
+    {
+        bool on = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+        if (on && lo < 0)
+            lo = cpu;
+        if (!on && lo >= 0)
+        {
+            if (cpu - 1 == lo)
+                n += safe_snprintf(buf + n, size - n, "%s%d", n > 0 ? "," : "", lo);
+            else
+                n += safe_snprintf(buf + n, size - n, "%s%d-%d", n > 0 ? "," : "", lo, cpu - 1);
+            lo = -1;
+        }
+    }
+    return n;
+}
+
+int aff_stat(char *buf, int size)
+{
+    char list[1024];
+    int i, n = 0;
+    n += safe_snprintf(buf + n, size - n, "STAT numa_nodes %d\r\n", nnodes);
+    for (i = 0; i < nnodes; i++)
+    {
+        format_cpulist(list, sizeof(list), &node_cpus[i]);
+        n += safe_snprintf(buf + n, size - n, "STAT node%d:cpus %s\r\n", i, list);
+    }
+    for (i = 0; i < AFF_CLASSES; i++)
+    {
+        if (CPU_COUNT(&class_cpus[i]) == 0)
+            safe_snprintf(list, sizeof(list), "any");
+        else
+            format_cpulist(list, sizeof(list), &class_cpus[i]);
+        n += safe_snprintf(buf + n, size - n, "STAT %s:cpus %s\r\n", class_names[i], list);
+    }
+    return n;
+}
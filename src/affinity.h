@@ -0,0 +1,50 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include "common.h"
+
+/*
+ * CPU affinity: every class of threads can be pinned to a list of CPUs
+ * with -a, e.g. "worker=0-7,16-23:scan=node0:flush=8:gc=9-15". A worker
+ * gets one CPU of its list (round robin by worker id), the other threads
+ * share the whole list of their class. Classes not given float freely.
+ *
+ * Memory follows the first touch: with -O and pinned workers, a bitcask
+ * is scanned on the NUMA node of the worker owning it, so its tree is
+ * allocated there.
+ */
+
+#define AFF_WORKER   0   /* event loops */
+#define AFF_SCAN     1   /* scanning and closing the bitcasks */
+#define AFF_FLUSH    2   /* the flush thread */
+#define AFF_GC       3   /* building hints, optimizing and migrating */
+#define AFF_CLASSES  4
+
+#define AFF_MAX_NODES 16
+
+bool aff_init(const char *spec);
+bool aff_enabled(void);
+int  aff_nodes(void);
+
+/* pin the calling thread, index picks the CPU of a worker */
+void aff_set_class(int cls, int index);
+/* restrict the calling thread to the CPUs of node, until the next aff_set_class() */
+void aff_bind_node(int cls, int node);
+/* node of the CPU of a pinned worker, -1 if workers are not pinned */
+int  aff_worker_node(int index);
+
+int  aff_stat(char *buf, int size);
+
+#endif
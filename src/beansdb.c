@@ -15,6 +15,14 @@
 
 #include "beansdb.h"
 #include "hstore.h"
+#include "memgov.h"
+#include "ioclass.h"
+#include "taskpool.h"
+#include "diskmgr.h"
+#include "hotkeys.h"
+#include "record.h"
+#include "blob.h"
+#include "scan.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -62,8 +70,11 @@
  */
 static int new_socket(struct addrinfo *ai);
 static int server_socket(const int port, const bool is_udp);
+static int server_socket_unix(const char *path);
+static int maximize_sndbuf(const int sfd);
 static int try_read_command(conn *c);
 static int try_read_network(conn *c);
+static int try_read_udp(conn *c);
 
 /* stats */
 static void stats_reset(void);
@@ -90,18 +101,57 @@ int    stopme = 0;
 
 /** file scope variables **/
 static int stub_fd = 0;
+static listener_stats listeners[MAX_LISTENERS];
+static int nlisteners = 0;
 
 #define TRANSMIT_COMPLETE   0
 #define TRANSMIT_INCOMPLETE 1
 #define TRANSMIT_SOFT_ERROR 2
 #define TRANSMIT_HARD_ERROR 3
 
+#define STATS_BUF_SIZE 4096
+#define MIGRATE_PERIOD 60   /* seconds between two passes of the tier mover */
+
+/* admission control of storage commands */
+static int max_inflight = 0;
+static int inflight_ops = 0;
+
+/*
+ * Shed a storage command early if the connection waited too long to get
+ * a worker, or too many storage operations are blocking the disks.
+ * Cheap commands (stats, version, ...) are never checked.
+ */
+static bool storage_admit(conn *c)
+{
+    if ((settings.max_queue_wait > 0 && c->queue_wait > settings.max_queue_wait)
+            || (max_inflight > 0 && inflight_ops >= max_inflight))
+    {
+        STATS_LOCK();
+        stats.busy_rejects++;
+        STATS_UNLOCK();
+        return false;
+    }
+    return true;
+}
+
+static inline void storage_begin(void)
+{
+    __sync_add_and_fetch(&inflight_ops, 1);
+}
+
+static inline void storage_end(void)
+{
+    __sync_sub_and_fetch(&inflight_ops, 1);
+}
+
 static void stats_init(void)
 {
     stats.curr_conns = stats.total_conns = stats.conn_structs = 0;
     stats.get_cmds = stats.set_cmds = stats.delete_cmds = 0;
-    stats.slow_cmds = stats.get_hits = stats.get_misses = 0;
+    stats.slow_cmds = stats.get_hits = stats.get_misses = stats.get_streams = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.busy_rejects = 0;
+    stats.udp_requests = stats.udp_drops = 0;
 
     /* make the time we started always be 2 seconds before we really
        did, so time(0) - time.started is never zero.  if so, things
@@ -115,8 +165,10 @@ static void stats_reset(void)
     STATS_LOCK();
     stats.total_conns = 0;
     stats.get_cmds = stats.set_cmds = stats.delete_cmds = 0;
-    stats.slow_cmds = stats.get_hits = stats.get_misses = 0;
+    stats.slow_cmds = stats.get_hits = stats.get_misses = stats.get_streams = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.busy_rejects = 0;
+    stats.udp_requests = stats.udp_drops = 0;
     STATS_UNLOCK();
 }
 
@@ -148,9 +200,21 @@ static int add_msghdr(conn *c)
 
     msg->msg_iov = &c->iov[c->iovused];
 
+    if (c->udp && c->request_addr_size > 0)
+    {
+        msg->msg_name = &c->request_addr;
+        msg->msg_namelen = c->request_addr_size;
+    }
+
     c->msgbytes = 0;
     c->msgused++;
 
+    if (c->udp)
+    {
+        /* Leave room for the UDP header, which we'll fill in later. */
+        return add_iov(c, NULL, UDP_HEADER_SIZE);
+    }
+
     return 0;
 }
 
@@ -162,13 +226,29 @@ static int add_msghdr(conn *c)
 static conn **freeconns;
 static int freetotal;
 static int freecurr;
+static int mg_conns = -1;
+
+/* the buffers of streaming, held by a connection while it streams */
+#define STREAM_BUFS_SIZE (sizeof(conn_stream) * MAX_CONN_STREAMS + STREAM_CHUNK_SIZE)
+
+/* memory held by a idle connection */
+static inline size_t conn_footprint(conn *c)
+{
+    return sizeof(conn) + c->rsize + c->wsize + sizeof(item *) * c->isize
+           + sizeof(struct iovec) * c->iovsize + sizeof(struct msghdr) * c->msgsize;
+}
 
+static size_t conn_shrink_freelist(size_t goal, void *arg)
+{
+    return conn_trim_freelist(goal);
+}
 
 static void conn_init(void)
 {
     freetotal = 200;
     freecurr = 0;
     freeconns = (conn **)safe_malloc(sizeof(conn *) * freetotal);
+    mg_conns = mg_register("conn_freelist", MG_PRIO_CACHE, conn_shrink_freelist, NULL);
     return;
 }
 
@@ -183,6 +263,7 @@ conn *do_conn_from_freelist()
     if (freecurr > 0)
     {
         c = freeconns[--freecurr];
+        mg_charge(mg_conns, -(int64_t)conn_footprint(c));
     }
     else
     {
@@ -201,6 +282,7 @@ bool do_conn_add_to_freelist(conn *c)
     if (freecurr < freetotal)
     {
         freeconns[freecurr++] = c;
+        mg_charge(mg_conns, conn_footprint(c));
         return false;
     }
     else
@@ -212,12 +294,34 @@ bool do_conn_add_to_freelist(conn *c)
             freetotal *= 2;
             freeconns = new_freeconns;
             freeconns[freecurr++] = c;
+            mg_charge(mg_conns, conn_footprint(c));
             return false;
         }
     }
     return true;
 }
 
+/*
+ * Frees connections in the freelist until goal bytes released. Should call
+ * this using conn_trim_freelist() for thread safety.
+ */
+size_t do_conn_trim_freelist(size_t goal)
+{
+    size_t released = 0;
+    while (freecurr > 0 && released < goal)
+    {
+        conn *c = freeconns[--freecurr];
+        size_t size = conn_footprint(c);
+        mg_charge(mg_conns, -(int64_t)size);
+        released += size;
+        conn_free(c);
+        STATS_LOCK();
+        stats.conn_structs--;
+        STATS_UNLOCK();
+    }
+    return released;
+}
+
 static void conn_getnameinfo(conn *c)
 {
     struct sockaddr_storage addr;
@@ -227,6 +331,11 @@ static void conn_getnameinfo(conn *c)
         log_debug("getpeername error %s", strerror(errno));
         return;
     }
+    if (addr.ss_family == AF_UNIX)
+    {
+        c->remote = strdup("unix");
+        return;
+    }
     char host[NI_MAXHOST], serv[NI_MAXSERV];
     if (0 != getnameinfo((struct sockaddr*)&addr, addrlen,  host, sizeof(host),
                 serv, sizeof(serv), NI_NUMERICSERV))
@@ -235,7 +344,8 @@ static void conn_getnameinfo(conn *c)
     sprintf(c->remote, "%s:%s", host, serv); //safe
 
 }
-conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
+conn *conn_new(const int sfd, const int init_state, const int read_buffer_size,
+               const bool is_udp, listener_stats *listener)
 {
     conn *c = conn_from_freelist();
 
@@ -249,6 +359,7 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
         c->ilist = 0;
         c->iov = 0;
         c->msglist = 0;
+        c->hdrbuf = 0;
 
         c->rsize = read_buffer_size;
         c->wsize = DATA_BUFFER_SIZE;
@@ -286,11 +397,11 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
     c->state = init_state;
     c->rlbytes = 0;
     c->rbytes = c->wbytes = 0;
-    c->wcurr = c->wbuf;
     c->rcurr = c->rbuf;
     c->ritem = NULL;
     c->icurr = c->ilist;
     c->ileft = 0;
+    c->nstreams = c->scurr = 0;
     c->iovused = 0;
     c->msgcurr = 0;
     c->msgused = 0;
@@ -299,9 +410,16 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
     c->write_and_free = 0;
     c->item = NULL;
     c->noreply = false;
+    c->raw_compressed = false;
 
+    c->udp = is_udp;
+    c->request_addr_size = 0;
+    c->listener = listener;
     c->remote = NULL;
-    if (init_state == conn_read)
+    c->queue_wait = 0;
+    memset(c->node_calls, 0, sizeof(c->node_calls));
+    c->ncalls = 0;
+    if (init_state == conn_read && !is_udp)
         conn_getnameinfo(c);
 
     update_event(c, AE_READABLE);
@@ -315,14 +433,35 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
         return NULL;
     }
 
-    STATS_LOCK();
-    stats.curr_conns++;
-    stats.total_conns++;
-    STATS_UNLOCK();
+    if (init_state == conn_read && !is_udp)
+    {
+        STATS_LOCK();
+        stats.curr_conns++;
+        stats.total_conns++;
+        listener->curr_conns++;
+        listener->total_conns++;
+        STATS_UNLOCK();
+    }
 
     return c;
 }
 
+/*
+ * Closes the values not streamed yet, and frees the buffers of streaming.
+ */
+static void conn_release_streams(conn *c)
+{
+    for (; c->scurr < c->nstreams; c->scurr++)
+        close_record_stream(c->streams[c->scurr].rs);
+    c->nstreams = c->scurr = 0;
+    if (c->sbuf != NULL)
+        mg_charge(mg_conns, -(int64_t)STREAM_BUFS_SIZE);
+    free(c->streams);
+    c->streams = NULL;
+    free(c->sbuf);
+    c->sbuf = NULL;
+}
+
 static void conn_cleanup(conn *c)
 {
     assert(c != NULL);
@@ -340,6 +479,7 @@ static void conn_cleanup(conn *c)
             item_free(*(c->icurr));
         }
     }
+    conn_release_streams(c);
 
     if (c->write_and_free)
     {
@@ -365,6 +505,8 @@ void conn_free(conn *c)
             free(c->ilist);
         if (c->iov)
             free(c->iov);
+        if (c->hdrbuf)
+            free(c->hdrbuf);
         free(c);
     }
 }
@@ -392,6 +534,7 @@ void conn_close(conn *c)
 
     STATS_LOCK();
     stats.curr_conns--;
+    c->listener->curr_conns--;
     STATS_UNLOCK();
 
     return;
@@ -410,6 +553,13 @@ static void conn_shrink(conn *c)
 {
     assert(c != NULL);
 
+    if (c->udp)
+        return;
+
+    /* the pending replies still point into these buffers */
+    if (c->iovused > 0)
+        return;
+
     if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE)
     {
         char *newbuf;
@@ -534,10 +684,10 @@ static int add_iov(conn *c, const void *buf, int len)
         m = &c->msglist[c->msgused - 1];
 
         /*
-         * Limit the first payloads of TCP replies, to
-         * MAX_PAYLOAD_SIZE bytes.
+         * Limit UDP packets to MAX_PAYLOAD_SIZE bytes, TCP replies are
+         * sent in as few sendmsg calls as possible.
          */
-        limit_to_mtu = (1 == c->msgused);
+        limit_to_mtu = c->udp;
 
         /* We may need to start a new msghdr if this one is full. */
         if (m->msg_iovlen == IOV_MAX ||
@@ -595,23 +745,142 @@ static void out_string(conn *c, const char *str)
     }
 
     len = strlen(str);
-    if (len + 2 > (unsigned int)(c->wsize))
+    if (len + 2 > (unsigned int)(c->wsize - c->wbytes))
     {
         /* ought to be always enough. just fail for simplicity */
         str = "SERVER_ERROR output line too long";
         len = strlen(str);
     }
 
-    safe_memcpy(c->wbuf, c->wsize, str, len);
-    safe_memcpy(c->wbuf + len, c->wsize - len, "\r\n", 2);
-    c->wbytes = len + 2;
-    c->wcurr = c->wbuf;
+    /* append to the replies of previous pipelined commands, if any */
+    char *line = c->wbuf + c->wbytes;
+    safe_memcpy(line, c->wsize - c->wbytes, str, len);
+    safe_memcpy(line + len, c->wsize - c->wbytes - len, "\r\n", 2);
+    if ((c->msgused == 0 && add_msghdr(c) != 0) || add_iov(c, line, len + 2) != 0)
+    {
+        if (settings.verbose > 0)
+            log_error("Couldn't build response");
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    c->wbytes += len + 2;
 
     conn_set_state(c, conn_write);
     c->write_and_go = conn_read;
     return;
 }
 
+/*
+ * Replies are collected in the msglist while more complete commands are
+ * waiting in the read buffer, so a pipelining client gets one sendmsg for
+ * the whole batch instead of one write per command.
+ */
+static bool conn_coalesce_output(conn *c)
+{
+    if (c->udp || c->write_and_go != conn_read || c->write_and_free)
+        return false;
+    if (c->msgused != 1 || c->msgbytes >= MAX_COALESCE_SIZE
+            || c->wsize - c->wbytes < OUTPUT_LINE_RESERVE)
+        return false;
+    return c->rbytes > 0 && memchr(c->rcurr, '\n', c->rbytes) != NULL;
+}
+
+/*
+ * Releases everything referenced by the replies which have been sent.
+ */
+static void conn_release_output(conn *c)
+{
+    while (c->ileft > 0)
+    {
+        item_free(*(c->icurr));
+        c->icurr++;
+        c->ileft--;
+    }
+    c->icurr = c->ilist;
+    conn_release_streams(c);
+    if (c->write_and_free)
+    {
+        free(c->write_and_free);
+        c->write_and_free = 0;
+    }
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    c->wbytes = 0;
+}
+
+/*
+ * Adds a value to send from the disk a chunk at a time: its chunks go in a
+ * msghdr of their own, refilled by conn_next_chunk() once sent.
+ *
+ * Returns 0 on success, -1 on out-of-memory, rs is closed anyway.
+ */
+static int conn_add_stream(conn *c, const char *key, RecordStream *rs, unsigned int vlen, uint32_t flag)
+{
+    if (c->sbuf == NULL)
+    {
+        c->streams = (conn_stream*)try_malloc(sizeof(conn_stream) * MAX_CONN_STREAMS);
+        c->sbuf = (char*)try_malloc(STREAM_CHUNK_SIZE);
+        if (c->streams == NULL || c->sbuf == NULL)
+        {
+            free(c->streams);
+            free(c->sbuf);
+            c->streams = NULL;
+            c->sbuf = NULL;
+            close_record_stream(rs);
+            return -1;
+        }
+        mg_charge(mg_conns, STREAM_BUFS_SIZE);
+    }
+
+    conn_stream *s = &c->streams[c->nstreams];
+    int len = safe_snprintf(s->line, sizeof(s->line), "VALUE %s %d %u\r\n", key, (int)flag, vlen);
+    if (add_iov(c, s->line, len) != 0 || add_msghdr(c) != 0 || add_iov(c, NULL, 0) != 0)
+    {
+        close_record_stream(rs);
+        return -1;
+    }
+    s->rs = rs;
+    s->msg = c->msgused - 1;
+    s->iov = c->iovused - 1;
+    c->nstreams++;
+    return add_msghdr(c) != 0 || add_iov(c, "\r\n", 2) != 0 ? -1 : 0;
+}
+
+/*
+ * Reads the next chunk of the value being streamed into its msghdr once
+ * the last one has been sent, or moves on to the next value at its end.
+ *
+ * Returns 0 on success, -1 if the value can not be read or is corrupted.
+ */
+static int conn_next_chunk(conn *c)
+{
+    conn_stream *s = &c->streams[c->scurr];
+    struct msghdr *m = &c->msglist[c->msgcurr];
+    struct iovec *v = &c->iov[s->iov];
+    if (m->msg_iovlen > 0 && v->iov_len > 0)
+        return 0;
+
+    int n = read_record_stream(s->rs, c->sbuf, STREAM_CHUNK_SIZE);
+    if (n < 0)
+    {
+        log_error("stream failed, abort the reply: %.*s", (int)strcspn(s->line, "\r"), s->line);
+        return -1;
+    }
+    if (n == 0)
+    {
+        close_record_stream(s->rs);
+        c->scurr++;
+        m->msg_iovlen = 0;
+        return 0;
+    }
+    v->iov_base = c->sbuf;
+    v->iov_len = n;
+    m->msg_iov = v;
+    m->msg_iovlen = 1;
+    return 0;
+}
+
 /*
  * we get here after reading the value in set/add/replace commands. The command
  * has been stored in c->item_comm, and the item is ready in c->item.
@@ -642,6 +911,8 @@ static void complete_nread(conn *c)
             out_string(c, "EXISTS");
         else if(ret == 3)
             out_string(c, "NOT_FOUND");
+        else if(ret == 4)
+            out_string(c, "SERVER_ERROR too many conflicts");
         else
             out_string(c, "NOT_STORED");
     }
@@ -656,28 +927,76 @@ static void complete_nread(conn *c)
  *
  * Returns true if the item was stored.
  */
-int store_item(item *it, int comm)
+struct store_args
 {
-    char *key = ITEM_key(it);
+    HKey hk;
+    item *it;
+    int comm;
+    int ret;
+};
 
-    switch (comm)
+static void do_store_item(void *arg)
+{
+    struct store_args *a = (struct store_args*)arg;
+    item *it = a->it;
+    switch (a->comm)
     {
     case NREAD_SET:
-        return hs_set(store, key, ITEM_data(it), (size_t)(it->nbytes - 2), it->flag, it->ver);
+        a->ret = hs_set(store, &a->hk, ITEM_data(it), (size_t)(it->nbytes - 2), it->flag, it->ver);
+        break;
     case NREAD_APPEND:
-        return hs_append(store, key, ITEM_data(it), it->nbytes - 2);
+        a->ret = hs_append(store, &a->hk, ITEM_data(it), it->nbytes - 2);
+        break;
+    case NREAD_CAS:
+        a->ret = hs_cas(store, &a->hk, ITEM_data(it), it->nbytes - 2, it->flag, it->ver);
+        break;
     }
-    return 0;
+}
+
+int store_item(item *it, int comm)
+{
+    struct store_args a;
+    hk_init(&a.hk, ITEM_key(it), it->nkey);
+    a.it = it;
+    a.comm = comm;
+    a.ret = 0;
+    storage_begin();
+    mt_storage_run(&a.hk, do_store_item, &a);
+    storage_end();
+    hot_record(&a.hk, hs_index(store, &a.hk), it->nbytes - 2);
+    return a.ret;
+}
+
+struct delta_args
+{
+    HKey hk;
+    int64_t delta;
+    int64_t value;
+    int ret;
+};
+
+static void do_add_delta(void *arg)
+{
+    struct delta_args *a = (struct delta_args*)arg;
+    a->ret = hs_incr(store, &a->hk, a->delta, &a->value);
 }
 
 /*
- * adds a delta value to a numeric item.
+ * adds a delta value to a numeric item, the new value is put in buf if
+ * it is stored (1), see hs_incr() for the others.
  */
 int add_delta(char* key, size_t nkey, int64_t delta, char *buf)
 {
-    uint64_t value = hs_incr(store, key, delta);
-    safe_snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)value);
-    return 0;
+    struct delta_args a;
+    hk_init(&a.hk, key, nkey);
+    a.delta = delta;
+    a.value = 0;
+    storage_begin();
+    mt_storage_run(&a.hk, do_add_delta, &a);
+    storage_end();
+    if (a.ret == 1)
+        safe_snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)a.value);
+    return a.ret;
 }
 
 typedef struct token_s
@@ -716,30 +1035,20 @@ static size_t tokenize_command(char *command, token_t *tokens, const size_t max_
 
     assert(command != NULL && tokens != NULL && max_tokens > 1);
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e)
+    for (s = e = command; ntokens < max_tokens - 1; s = e = e + 1)
     {
-        if (*e == ' ')
+        /* jump to the next separator, a whole token at a time */
+        e = scan_separator(s);
+        char sep = *e;
+        if (s != e)
         {
-            if (s != e)
-            {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-            }
-            s = e + 1;
+            tokens[ntokens].value = s;
+            tokens[ntokens].length = e - s;
+            ntokens++;
+            *e = '\0';
         }
-        else if (*e == '\0')
-        {
-            if (s != e)
-            {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-            }
-
+        if (sep == '\0')
             break; /* string end */
-        }
     }
 
     /*
@@ -756,16 +1065,15 @@ static size_t tokenize_command(char *command, token_t *tokens, const size_t max_
 /* set up a connection to write a buffer then free it, used for stats */
 static void write_and_free(conn *c, char *buf, int bytes)
 {
-    if (buf)
+    if (buf && add_iov(c, buf, bytes) == 0)
     {
         c->write_and_free = buf;
-        c->wcurr = buf;
-        c->wbytes = bytes;
         conn_set_state(c, conn_write);
         c->write_and_go = conn_read;
     }
     else
     {
+        free(buf);
         out_string(c, "SERVER_ERROR out of memory writing stats");
     }
 }
@@ -823,7 +1131,12 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens)
 
     if (ntokens == 2 && strcmp(command, "stats") == 0)
     {
-        char temp[1024];
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
         pid_t pid = getpid();
         uint64_t total = 0, curr = 0, avail_space, total_space;
         total = hs_count(store, &curr);
@@ -836,36 +1149,48 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens)
 #endif /* !WIN32 */
 
         STATS_LOCK();
-        pos += safe_snprintf(pos,  temp + 1024 - pos, "STAT pid %ld\r\n", (long)pid);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT uptime %"PRIuS"\r\n", now - stats.started);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT time %"PRIuS"\r\n", now);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT version " VERSION "\r\n");
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT pointer_size %"PRIuS"\r\n", 8 * sizeof(void *));
+        pos += safe_snprintf(pos,  temp + STATS_BUF_SIZE - pos, "STAT pid %ld\r\n", (long)pid);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT uptime %"PRIuS"\r\n", now - stats.started);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT time %"PRIuS"\r\n", now);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT version " VERSION "\r\n");
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT pointer_size %"PRIuS"\r\n", 8 * sizeof(void *));
 #ifndef WIN32
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT rusage_user %ld.%06ld\r\n", usage.ru_utime.tv_sec, usage.ru_utime.tv_usec);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT rusage_system %ld.%06ld\r\n", usage.ru_stime.tv_sec, usage.ru_stime.tv_usec);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT rusage_user %ld.%06ld\r\n", usage.ru_utime.tv_sec, usage.ru_utime.tv_usec);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT rusage_system %ld.%06ld\r\n", usage.ru_stime.tv_sec, usage.ru_stime.tv_usec);
 #endif /* !WIN32 */
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT rusage_maxrss %"PRIu64"\r\n", get_maxrss() / 1024);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT item_buf_size %"PRIuS"\r\n", settings.item_buf_size);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT curr_connections %"PRIu32"\r\n", stats.curr_conns - 1); /* ignore listening conn */
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT total_connections %"PRIu32"\r\n", stats.total_conns);
-        pos += safe_snprintf(pos, temp + 1024 - pos,  "STAT connection_structures %"PRIu32"\r\n", stats.conn_structs);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT cmd_get %"PRIu64"\r\n", stats.get_cmds);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT cmd_set %"PRIu64"\r\n", stats.set_cmds);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT cmd_delete %"PRIu64"\r\n", stats.delete_cmds);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT slow_cmd %"PRIu64"\r\n", stats.slow_cmds);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT get_hits %"PRIu64"\r\n", stats.get_hits);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT get_misses %"PRIu64"\r\n", stats.get_misses);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT curr_items %"PRIu64"\r\n", curr);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT total_items %"PRIu64"\r\n", total);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT avail_space %"PRIu64"\r\n", avail_space);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT total_space %"PRIu64"\r\n", total_space);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT bytes_read %"PRIu64"\r\n", stats.bytes_read);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT bytes_written %"PRIu64"\r\n", stats.bytes_written);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "STAT threads %d\r\n", settings.num_threads);
-        pos += safe_snprintf(pos, temp + 1024 - pos, "END");
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT rusage_maxrss %"PRIu64"\r\n", get_maxrss() / 1024);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT item_buf_size %"PRIuS"\r\n", settings.item_buf_size);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT curr_connections %"PRIu32"\r\n", stats.curr_conns);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT total_connections %"PRIu32"\r\n", stats.total_conns);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos,  "STAT connection_structures %"PRIu32"\r\n", stats.conn_structs);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT cmd_get %"PRIu64"\r\n", stats.get_cmds);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT cmd_set %"PRIu64"\r\n", stats.set_cmds);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT cmd_delete %"PRIu64"\r\n", stats.delete_cmds);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT slow_cmd %"PRIu64"\r\n", stats.slow_cmds);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT get_hits %"PRIu64"\r\n", stats.get_hits);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT get_misses %"PRIu64"\r\n", stats.get_misses);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT get_streams %"PRIu64"\r\n", stats.get_streams);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT curr_items %"PRIu64"\r\n", curr);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT total_items %"PRIu64"\r\n", total);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT avail_space %"PRIu64"\r\n", avail_space);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT total_space %"PRIu64"\r\n", total_space);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT bytes_read %"PRIu64"\r\n", stats.bytes_read);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT bytes_written %"PRIu64"\r\n", stats.bytes_written);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT threads %d\r\n", settings.num_threads);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT inflight_ops %d\r\n", inflight_ops);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT forwarded_calls %"PRIu64"\r\n", mt_forwarded_calls());
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT steered_conns %"PRIu64"\r\n", mt_steered_conns());
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT busy_rejects %"PRIu64"\r\n", stats.busy_rejects);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT udp_requests %"PRIu64"\r\n", stats.udp_requests);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT udp_drops %"PRIu64"\r\n", stats.udp_drops);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT mem_limit %"PRIu64"\r\n", settings.max_memory);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT mem_used %"PRIu64"\r\n", mg_used());
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "STAT tasks_queued %d\r\n", tp_queued());
+        pos += compress_stat(pos, temp + STATS_BUF_SIZE - pos, false);
+        pos += blob_stat(pos, temp + STATS_BUF_SIZE - pos);
+        pos += safe_snprintf(pos, temp + STATS_BUF_SIZE - pos, "END\r\n");
         STATS_UNLOCK();
-        out_string(c, temp);
+        write_and_free(c, temp, pos - temp);
         return;
     }
 
@@ -878,22 +1203,160 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens)
         return;
     }
 
+    if (strcmp(subcommand, "listeners") == 0)
+    {
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int i, len = 0;
+        STATS_LOCK();
+        for (i = 0; i < nlisteners; i++)
+        {
+            listener_stats *ls = &listeners[i];
+            len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "STAT %s:curr_connections %"PRIu32"\r\n", ls->name, ls->curr_conns);
+            len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "STAT %s:total_connections %"PRIu32"\r\n", ls->name, ls->total_conns);
+            len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "STAT %s:bytes_read %"PRIu64"\r\n", ls->name, ls->bytes_read);
+            len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "STAT %s:bytes_written %"PRIu64"\r\n", ls->name, ls->bytes_written);
+        }
+        STATS_UNLOCK();
+        len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "io") == 0)
+    {
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = io_stat(temp, STATS_BUF_SIZE);
+        len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "affinity") == 0)
+    {
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = aff_stat(temp, STATS_BUF_SIZE);
+        len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "memory") == 0)
+    {
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = mg_stat(temp, STATS_BUF_SIZE);
+        len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "tasks") == 0)
+    {
+        char *temp = (char*)try_malloc(STATS_BUF_SIZE);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = tp_stat(temp, STATS_BUF_SIZE);
+        len += safe_snprintf(temp + len, STATS_BUF_SIZE - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "hotkeys") == 0)
+    {
+        int top = ntokens > 3 ? atoi(tokens[2].value) : 10;
+        if (top <= 0 || top > 100)
+        {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        int size = HOT_STAT_SIZE * top + 128;
+        char *temp = (char*)try_malloc(size);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = hot_stat(temp, size - 8, top);
+        len += safe_snprintf(temp + len, size - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "compress") == 0)
+    {
+        int size = STATS_BUF_SIZE * 16;
+        char *temp = (char*)try_malloc(size);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = compress_stat(temp, size - 8, true);
+        len += safe_snprintf(temp + len, size - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
+    if (strcmp(subcommand, "disks") == 0)
+    {
+        int size = mgr_load_stat_size() + 64;
+        char *temp = (char*)try_malloc(size);
+        if (temp == NULL)
+        {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return;
+        }
+        int len = mgr_load_stat(temp, size - 8);
+        len += safe_snprintf(temp + len, size - len, "END\r\n");
+        write_and_free(c, temp, len);
+        return;
+    }
+
     out_string(c, "ERROR");
 }
 
 /* ntokens is overwritten here... shrug.. */
-static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
+static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas)
 {
     char *key;
     size_t nkey;
-    int i = 0;
+    int i = c->ileft;   /* items of pending replies are kept before ours */
     item *it = NULL;
     token_t *key_token = &tokens[KEY_TOKEN];
     int stats_get_cmds   = 0;
     int stats_get_hits   = 0;
     int stats_get_misses = 0;
+    int stats_get_streams = 0;
     assert(c != NULL);
 
+    if (!storage_admit(c))
+    {
+        out_string(c, "SERVER_ERROR busy");
+        return;
+    }
+
     do
     {
         while(key_token->length != 0)
@@ -908,16 +1371,33 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
                 stats.get_cmds   += stats_get_cmds;
                 stats.get_hits   += stats_get_hits;
                 stats.get_misses += stats_get_misses;
+                stats.get_streams += stats_get_streams;
                 STATS_UNLOCK();
+                c->icurr = c->ilist;
+                c->ileft = i;
                 out_string(c, "CLIENT_ERROR bad command line format");
                 return;
             }
 
             stats_get_cmds++;
 
-            it = item_get(key, nkey);
+            RecordStream *rs = NULL;
+            unsigned int vlen = 0;
+            uint32_t flag = 0;
+            bool can_stream = !c->udp && !return_cas && c->nstreams < MAX_CONN_STREAMS;
+            storage_begin();
+            it = item_get_stream(key, nkey, c->raw_compressed, return_cas,
+                    can_stream ? &rs : NULL, &vlen, &flag);
+            storage_end();
 
-            if (it)
+            if (rs)
+            {
+                if (conn_add_stream(c, key, rs, vlen, flag) != 0)
+                    break;
+                stats_get_hits++;
+                stats_get_streams++;
+            }
+            else if (it)
             {
                 if (i >= c->isize)
                 {
@@ -998,19 +1478,95 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
     }
     else
     {
-        conn_set_state(c, conn_mwrite);
-        c->msgcurr = 0;
+        conn_set_state(c, conn_write);
+        c->write_and_go = conn_read;
     }
 
     STATS_LOCK();
     stats.get_cmds   += stats_get_cmds;
     stats.get_hits   += stats_get_hits;
     stats.get_misses += stats_get_misses;
+    stats.get_streams += stats_get_streams;
     STATS_UNLOCK();
 
     return;
 }
 
+/* getrange <key> <offset> <length>: a slice of one value */
+static void process_getrange_command(conn *c, token_t *tokens, const size_t ntokens)
+{
+    long from, len;
+    item *it = NULL;
+    assert(c != NULL);
+
+    if (tokens[KEY_TOKEN].length > MAX_KEY_LEN
+            || !safe_strtol(tokens[2].value, 10, &from) || from < 0 || from > UINT32_MAX
+            || !safe_strtol(tokens[3].value, 10, &len) || len < 0 || len > MAX_VALUE_LEN)
+    {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (!storage_admit(c))
+    {
+        out_string(c, "SERVER_ERROR busy");
+        return;
+    }
+
+    storage_begin();
+    it = item_get_range(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length, from, len);
+    storage_end();
+
+    STATS_LOCK();
+    stats.get_cmds++;
+    if (it)
+        stats.get_hits++;
+    else
+        stats.get_misses++;
+    STATS_UNLOCK();
+
+    int i = c->ileft;   /* items of pending replies are kept before ours */
+    if (it && i >= c->isize)
+    {
+        item **new_list = (item**)try_realloc(c->ilist, sizeof(item *) * c->isize * 2);
+        if (new_list)
+        {
+            c->isize *= 2;
+            c->ilist = new_list;
+        }
+        else
+        {
+            item_free(it);
+            out_string(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+    }
+    if (it)
+    {
+        if (add_iov(c, "VALUE ", 6) != 0 ||
+                add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+                add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+        {
+            item_free(it);
+            out_string(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+        c->ilist[i++] = it;
+    }
+    c->icurr = c->ilist;
+    c->ileft = i;
+
+    if (add_iov(c, "END\r\n", 5) != 0)
+    {
+        out_string(c, "SERVER_ERROR out of memory writing get response");
+    }
+    else
+    {
+        conn_set_state(c, conn_write);
+        c->write_and_go = conn_read;
+    }
+}
+
 static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm)
 {
     char *key;
@@ -1018,6 +1574,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     int flags;
     time_t exptime;
     int vlen;
+    long cas = 0;
     item *it = NULL;
 
     assert(c != NULL);
@@ -1040,16 +1597,34 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     vlen = strtol(tokens[4].value, NULL, 10);
 
     if(errno == ERANGE || ((flags == 0 || exptime == 0) && errno == EINVAL)
-            || vlen < 0)
+            || vlen < 0
+            || (comm == NREAD_CAS && (!safe_strtol(tokens[5].value, 10, &cas) || cas <= 0 || cas > INT32_MAX)))
     {
         out_string(c, "CLIENT_ERROR bad command line format");
         log_warn("CLIENT_ERROR %s %s %s %s %s", tokens[0].value, tokens[1].value, tokens[2].value, tokens[3].value, tokens[4].value);
         return;
     }
 
+    /* the stored value would be read as compressed with a dictionary or in a blob */
+    if (flags & (DICT_FLAG | DEDUP_FLAG))
+    {
+        out_string(c, "CLIENT_ERROR bad flags");
+        log_warn("CLIENT_ERROR flags %x of %s reserved", flags, key);
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+        return;
+    }
+
+    if (!storage_admit(c))
+    {
+        out_string(c, "SERVER_ERROR busy");
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+        return;
+    }
+
+    /* large values are not from the freelist, refused over the memory budget */
     it = item_alloc1(key, nkey, flags, vlen + 2);
-    it->ver = exptime;
-    it->flag = flags;
 
     if (it == NULL)
     {
@@ -1059,6 +1634,8 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         c->sbytes = vlen + 2;
         return;
     }
+    it->ver = comm == NREAD_CAS ? cas : exptime; // the version to check for cas
+    it->flag = flags;
 
     c->item = it;
     c->ritem = ITEM_data(it);
@@ -1116,21 +1693,42 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         return;
     }
 
+    if (!storage_admit(c))
+    {
+        out_string(c, "SERVER_ERROR busy");
+        return;
+    }
+
     switch(add_delta(key, nkey, delta, temp))
     {
-    case 0:
+    case 1:
         out_string(c, temp);
         break;
-//    case NON_NUMERIC:
-//        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
-//        break;
-//    case EOM:
-//        out_string(c, "SERVER_ERROR out of memory");
-//        break;
+    case 4:
+        out_string(c, "SERVER_ERROR too many conflicts");
+        break;
+    case 5:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR incr failed");
+        break;
     }
 }
 
 
+struct delete_args
+{
+    HKey hk;
+    bool deleted;
+};
+
+static void do_delete(void *arg)
+{
+    struct delete_args *a = (struct delete_args*)arg;
+    a->deleted = hs_delete(store, &a->hk);
+}
+
 static void process_delete_command(conn *c, token_t *tokens, const size_t ntokens)
 {
     char *key;
@@ -1153,7 +1751,18 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
-    out_string(c, hs_delete(store, key)?"DELETED":"NOT_FOUND");
+    if (!storage_admit(c))
+    {
+        out_string(c, "SERVER_ERROR busy");
+        return;
+    }
+
+    struct delete_args a;
+    hk_init(&a.hk, key, nkey);
+    storage_begin();
+    mt_storage_run(&a.hk, do_delete, &a);
+    storage_end();
+    out_string(c, a.deleted ? "DELETED" : "NOT_FOUND");
 }
 
 static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens)
@@ -1171,9 +1780,28 @@ static void process_verbosity_command(conn *c, token_t *tokens, const size_t nto
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
-    settings.verbose = level > MAX_VERBOSITY_LEVEL ? MAX_VERBOSITY_LEVEL : level;
+    settings.verbose = level > MAX_VERBOSITY_LEVEL ? MAX_VERBOSITY_LEVEL : level;
+    out_string(c, "OK");
+    return;
+}
+
+/*
+ * "compressed on" makes the gets of this connection return the values the
+ * server compressed as they are stored, with COMPRESS_FLAG set in the
+ * flags, so the client decompresses them (or keeps them compressed).
+ */
+static void process_compressed_command(conn *c, token_t *tokens)
+{
+    if (strcmp(tokens[1].value, "on") == 0)
+        c->raw_compressed = true;
+    else if (strcmp(tokens[1].value, "off") == 0)
+        c->raw_compressed = false;
+    else
+    {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
     out_string(c, "OK");
-    return;
 }
 
 static void process_command(conn *c, char *command)
@@ -1193,13 +1821,17 @@ static void process_command(conn *c, char *command)
      * directly into it, then continue in nread_complete().
      */
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0)
+    if (c->udp || c->iovused == 0)
     {
-        out_string(c, "SERVER_ERROR out of memory preparing response");
-        return;
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        c->wbytes = 0;
+        if (add_msghdr(c) != 0)
+        {
+            out_string(c, "SERVER_ERROR out of memory preparing response");
+            return;
+        }
     }
 
     clock_gettime(CLOCK_MONOTONIC, &start);
@@ -1207,11 +1839,29 @@ static void process_command(conn *c, char *command)
     strncpy(command0, command, MAX_KEY_LEN*2);
 
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    if (c->udp && !(ntokens >= 3 && strcmp(tokens[COMMAND_TOKEN].value, "get") == 0))
+    {
+        out_string(c, "CLIENT_ERROR only get is supported over UDP");
+        return;
+    }
+
     if (ntokens >= 3 &&
             (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) )
     {
 
-        process_get_command(c, tokens, ntokens);
+        process_get_command(c, tokens, ntokens, false);
+
+    }
+    else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0))
+    {
+
+        process_get_command(c, tokens, ntokens, true);
+
+    }
+    else if (ntokens == 5 && (strcmp(tokens[COMMAND_TOKEN].value, "getrange") == 0))
+    {
+
+        process_getrange_command(c, tokens, ntokens);
 
     }
     else if ((ntokens == 6 || ntokens == 7) &&
@@ -1222,6 +1872,12 @@ static void process_command(conn *c, char *command)
 
         process_update_command(c, tokens, ntokens, comm);
 
+    }
+    else if ((ntokens == 7 || ntokens == 8) && (strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0))
+    {
+
+        process_update_command(c, tokens, ntokens, NREAD_CAS);
+
     }
     else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0))
     {
@@ -1258,6 +1914,12 @@ static void process_command(conn *c, char *command)
 
         process_verbosity_command(c, tokens, ntokens);
 
+    }
+    else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "compressed") == 0))
+    {
+
+        process_compressed_command(c, tokens);
+
     }
     else if (ntokens == 2 &&  (strcmp(tokens[COMMAND_TOKEN].value, "optimize_stat") == 0))
     {
@@ -1363,12 +2025,62 @@ static int try_read_command(conn *c)
 
     c->rbytes -= (cont - c->rcurr);
     c->rcurr = cont;
+    /* one command per UDP request, the rest may be data of a rejected set */
+    if (c->udp)
+        c->rbytes = 0;
 
     assert(c->rcurr <= (c->rbuf + c->rsize));
 
     return 1;
 }
 
+/*
+ * read a UDP request, with the frame header stripped.
+ * return 0 if there's nothing to read.
+ */
+static int try_read_udp(conn *c)
+{
+    int res;
+
+    assert(c != NULL);
+
+    while (1)
+    {
+        c->request_addr_size = sizeof(c->request_addr);
+        res = recvfrom(c->sfd, c->rbuf, c->rsize, 0,
+                       (struct sockaddr *)&c->request_addr, &c->request_addr_size);
+        if (res < 0)
+            return 0;
+
+        STATS_LOCK();
+        stats.bytes_read += res;
+        c->listener->bytes_read += res;
+        stats.udp_requests++;
+        STATS_UNLOCK();
+
+        unsigned char *buf = (unsigned char *)c->rbuf;
+        /* Drop short packets and multi-packet requests */
+        if (res <= UDP_HEADER_SIZE || buf[4] != 0 || buf[5] != 1)
+        {
+            STATS_LOCK();
+            stats.udp_drops++;
+            STATS_UNLOCK();
+            continue;
+        }
+
+        /* Beginning of UDP packet is the request ID; save it. */
+        c->request_id = buf[0] * 256 + buf[1];
+
+        /* Don't care about any of the rest of the header. */
+        res -= UDP_HEADER_SIZE;
+        memmove(c->rbuf, c->rbuf + UDP_HEADER_SIZE, res);
+
+        c->rbytes = res;
+        c->rcurr = c->rbuf;
+        return 1;
+    }
+}
+
 /*
  * read from network as much as we can, handle buffer overflow and connection
  * close.
@@ -1415,6 +2127,7 @@ static int try_read_network(conn *c)
         {
             STATS_LOCK();
             stats.bytes_read += res;
+            c->listener->bytes_read += res;
             STATS_UNLOCK();
             gotdata = 1;
             c->rbytes += res;
@@ -1450,6 +2163,44 @@ static bool update_event(conn *c, const int new_flags)
     return true;
 }
 
+/*
+ * Constructs a set of UDP headers and attaches them to the outgoing messages.
+ */
+static int build_udp_headers(conn *c)
+{
+    int i;
+    unsigned char *hdr;
+
+    assert(c != NULL);
+
+    if (c->msgused > c->hdrsize)
+    {
+        void *new_hdrbuf = try_realloc(c->hdrbuf, c->msgused * 2 * UDP_HEADER_SIZE);
+        if (!new_hdrbuf)
+            return -1;
+        c->hdrbuf = (unsigned char *)new_hdrbuf;
+        c->hdrsize = c->msgused * 2;
+    }
+
+    hdr = c->hdrbuf;
+    for (i = 0; i < c->msgused; i++)
+    {
+        c->msglist[i].msg_iov[0].iov_base = (void*)hdr;
+        c->msglist[i].msg_iov[0].iov_len = UDP_HEADER_SIZE;
+        *hdr++ = c->request_id / 256;
+        *hdr++ = c->request_id % 256;
+        *hdr++ = i / 256;
+        *hdr++ = i % 256;
+        *hdr++ = c->msgused / 256;
+        *hdr++ = c->msgused % 256;
+        *hdr++ = 0;
+        *hdr++ = 0;
+        assert((void *) hdr == (caddr_t)c->msglist[i].msg_iov[0].iov_base + UDP_HEADER_SIZE);
+    }
+
+    return 0;
+}
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -1463,9 +2214,17 @@ static int transmit(conn *c)
 {
     assert(c != NULL);
 
-    if (c->msgcurr < c->msgused &&
-            c->msglist[c->msgcurr].msg_iovlen == 0)
+    while (c->msgcurr < c->msgused)
     {
+        /* the msg of a streamed value is refilled until its end */
+        if (c->scurr < c->nstreams && c->streams[c->scurr].msg == c->msgcurr
+                && conn_next_chunk(c) != 0)
+        {
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        if (c->msglist[c->msgcurr].msg_iovlen > 0)
+            break;
         /* Finished writing the current msg; advance to the next. */
         c->msgcurr++;
     }
@@ -1479,6 +2238,7 @@ static int transmit(conn *c)
         {
             STATS_LOCK();
             stats.bytes_written += res;
+            c->listener->bytes_written += res;
             STATS_UNLOCK();
 
             /* We've written some of the data. Remove the completed
@@ -1509,7 +2269,17 @@ static int transmit(conn *c)
         if (settings.verbose > 0)
             log_debug("Failed to write, and not due to blocking: %s", strerror(errno));
 
-        conn_set_state(c, conn_closing);
+        if (c->udp)
+        {
+            /* drop the reply, the socket is shared by all the clients */
+            STATS_LOCK();
+            stats.udp_drops++;
+            STATS_UNLOCK();
+            conn_cleanup(c);
+            conn_set_state(c, conn_read);
+        }
+        else
+            conn_set_state(c, conn_closing);
         return TRANSMIT_HARD_ERROR;
     }
     else
@@ -1576,7 +2346,9 @@ int drive_machine(conn *c)
                 close(sfd);
                 break;
             }
-            if (NULL == conn_new(sfd, conn_read, DATA_BUFFER_SIZE))
+            if (c->listener->sndbuf > 0)
+                setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&c->listener->sndbuf, sizeof(int));
+            if (NULL == conn_new(sfd, conn_read, DATA_BUFFER_SIZE, false, c->listener))
             {
                 if (settings.verbose > 0)
                 {
@@ -1591,7 +2363,14 @@ int drive_machine(conn *c)
             {
                 continue;
             }
-            if (try_read_network(c) != 0)
+            /* no more complete commands, send the collected replies */
+            if (!c->udp && c->iovused > 0)
+            {
+                conn_set_state(c, conn_mwrite);
+                c->write_and_go = conn_read;
+                break;
+            }
+            if ((c->udp ? try_read_udp(c) : try_read_network(c)) != 0)
             {
                 continue;
             }
@@ -1625,6 +2404,7 @@ int drive_machine(conn *c)
             {
                 STATS_LOCK();
                 stats.bytes_read += res;
+                c->listener->bytes_read += res;
                 STATS_UNLOCK();
                 c->ritem += res;
                 c->rlbytes -= res;
@@ -1671,6 +2451,7 @@ int drive_machine(conn *c)
             {
                 STATS_LOCK();
                 stats.bytes_read += res;
+                c->listener->bytes_read += res;
                 STATS_UNLOCK();
                 c->sbytes -= res;
                 break;
@@ -1694,20 +2475,23 @@ int drive_machine(conn *c)
 
         case conn_write:
             /*
-             * We want to write out a simple response. If we haven't already,
-             * assemble it into a msgbuf list (this will be a single-entry
-             * list for TCP or a two-entry list for UDP).
+             * The replies are already in the msglist. Hold them back while
+             * more pipelined commands are waiting, conn_read sends them
+             * once the read buffer drains.
              */
-            if (c->iovused == 0)
+            if (conn_coalesce_output(c))
             {
-                if (add_iov(c, c->wcurr, c->wbytes) != 0)
-                {
-                    if (settings.verbose > 0)
-                        log_error("Couldn't build response");
-                    conn_set_state(c, conn_closing);
-                    break;
-                }
+                conn_set_state(c, conn_read);
+                break;
+            }
+            if (c->udp && build_udp_headers(c) != 0)
+            {
+                if (settings.verbose > 0)
+                    log_error("Failed to build UDP headers");
+                conn_set_state(c, conn_closing);
+                break;
             }
+            conn_set_state(c, conn_mwrite);
 
         /* fall through... */
 
@@ -1715,32 +2499,8 @@ int drive_machine(conn *c)
             switch (transmit(c))
             {
             case TRANSMIT_COMPLETE:
-                if (c->state == conn_mwrite)
-                {
-                    while (c->ileft > 0)
-                    {
-                        item *it = *(c->icurr);
-                        item_free(it);
-                        c->icurr++;
-                        c->ileft--;
-                    }
-                    conn_set_state(c, conn_read);
-                }
-                else if (c->state == conn_write)
-                {
-                    if (c->write_and_free)
-                    {
-                        free(c->write_and_free);
-                        c->write_and_free = 0;
-                    }
-                    conn_set_state(c, c->write_and_go);
-                }
-                else
-                {
-                    if (settings.verbose > 0)
-                        log_error("Unexpected state %d", c->state);
-                    conn_set_state(c, conn_closing);
-                }
+                conn_release_output(c);
+                conn_set_state(c, c->write_and_go);
                 break;
 
             case TRANSMIT_INCOMPLETE:
@@ -1754,6 +2514,12 @@ int drive_machine(conn *c)
             break;
 
         case conn_closing:
+            if (c->udp)
+            {
+                conn_cleanup(c);
+                conn_set_state(c, conn_read);
+                break;
+            }
             conn_close(c);
             return 0;
         }
@@ -1762,6 +2528,61 @@ int drive_machine(conn *c)
     return 1;
 }
 
+static listener_stats *new_listener(const char *fmt, const char *name, int port)
+{
+    if (nlisteners == MAX_LISTENERS)
+    {
+        log_error("too many listeners");
+        exit(EXIT_FAILURE);
+    }
+    listener_stats *ls = &listeners[nlisteners++];
+    memset(ls, 0, sizeof(listener_stats));
+    safe_snprintf(ls->name, sizeof(ls->name), fmt, name, port);
+    return ls;
+}
+
+/*
+ * Sets a socket's send buffer size to the maximum allowed by the system,
+ * returns the size, 0 if unknown.
+ */
+static int maximize_sndbuf(const int sfd)
+{
+    socklen_t intsize = sizeof(int);
+    int last_good = 0;
+    int min, max, avg;
+    int old_size;
+
+    /* Start with the default size. */
+    if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&old_size, &intsize) != 0)
+    {
+        if (settings.verbose > 0)
+            log_error("getsockopt(SO_SNDBUF): %s", strerror(errno));
+        return 0;
+    }
+
+    /* Binary-search for the real maximum. */
+    min = old_size;
+    max = MAX_SENDBUF_SIZE;
+
+    while (min <= max)
+    {
+        avg = ((unsigned int)(min + max)) / 2;
+        if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&avg, intsize) == 0)
+        {
+            last_good = avg;
+            min = avg + 1;
+        }
+        else
+        {
+            max = avg - 1;
+        }
+    }
+
+    if (settings.verbose > 1)
+        log_debug("<%d send buffer was %d, now %d", sfd, old_size, last_good);
+    return last_good;
+}
+
 static int new_socket(struct addrinfo *ai)
 {
     int sfd;
@@ -1783,6 +2604,46 @@ static int new_socket(struct addrinfo *ai)
     return sfd;
 }
 
+/*
+ * Open UDP sockets on a address, one per worker thread. They share the
+ * port with SO_REUSEPORT, and the kernel spreads the requests over them.
+ */
+static int server_udp_sockets(struct addrinfo *ai, listener_stats *listener)
+{
+    int i, sfd, flags = 1;
+    int nsock = 1;
+#ifdef SO_REUSEPORT
+    nsock = settings.num_threads;
+#endif
+
+    for (i = 0; i < nsock; i++)
+    {
+        if ((sfd = new_socket(ai)) == -1)
+            return 1;
+
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
+        maximize_sndbuf(sfd);
+
+        if (bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1)
+        {
+            if (errno != EADDRINUSE)
+                log_error("bind(): %s", strerror(errno));
+            close(sfd);
+            return 1;
+        }
+
+        if (conn_new(sfd, conn_read, UDP_READ_BUFFER_SIZE, true, listener) == NULL)
+        {
+            log_error("failed to create udp connection");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+
 static int server_socket(const int port, const bool is_udp)
 {
     int sfd;
@@ -1803,8 +2664,16 @@ static int server_socket(const int port, const bool is_udp)
     memset(&hints, 0, sizeof (hints));
     hints.ai_flags = AI_PASSIVE|AI_ADDRCONFIG;
     hints.ai_family = AF_UNSPEC;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_socktype = SOCK_STREAM;
+    if (is_udp)
+    {
+        hints.ai_protocol = IPPROTO_UDP;
+        hints.ai_socktype = SOCK_DGRAM;
+    }
+    else
+    {
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_socktype = SOCK_STREAM;
+    }
 
     safe_snprintf(port_buf, NI_MAXSERV, "%d", port);
     error= getaddrinfo(settings.inter, port_buf, &hints, &ai);
@@ -1818,9 +2687,18 @@ static int server_socket(const int port, const bool is_udp)
         return 1;
     }
 
+    listener_stats *listener = new_listener(is_udp ? "udp:%s%d" : "tcp:%s%d",
+            settings.inter ? settings.inter : "", port);
     for (next= ai; next; next= next->ai_next)
     {
         conn *listen_conn_add;
+        if (is_udp)
+        {
+            if (server_udp_sockets(next, listener) == 0)
+                success++;
+            continue;
+        }
+
         if ((sfd = new_socket(next)) == -1)
         {
             freeaddrinfo(ai);
@@ -1856,7 +2734,7 @@ static int server_socket(const int port, const bool is_udp)
             }
         }
 
-        if (!(listen_conn_add = conn_new(sfd, conn_listening, 1)))
+        if (!(listen_conn_add = conn_new(sfd, conn_listening, 1, false, listener)))
         {
             log_error("failed to create listening connection");
             exit(EXIT_FAILURE);
@@ -1869,10 +2747,80 @@ static int server_socket(const int port, const bool is_udp)
     return success == 0;
 }
 
+static int server_socket_unix(const char *path)
+{
+    int sfd;
+    struct linger ling = {0, 0};
+    struct sockaddr_un addr;
+    struct stat tstat;
+    int flags =1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        log_error("unix socket path too long: %s", path);
+        return 1;
+    }
+
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        log_error("socket(): %s", strerror(errno));
+        return 1;
+    }
+    if ((flags = fcntl(sfd, F_GETFL, 0)) < 0 ||
+            fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        log_error("setting O_NONBLOCK: %s", strerror(errno));
+        close(sfd);
+        return 1;
+    }
+
+    /*
+     * Clean up a previous socket file if we left it around
+     */
+    if (lstat(path, &tstat) == 0)
+    {
+        if (S_ISSOCK(tstat.st_mode))
+            unlink(path);
+    }
+
+    flags = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        log_error("bind(%s): %s", path, strerror(errno));
+        close(sfd);
+        return 1;
+    }
+    if (listen(sfd, 1024) == -1)
+    {
+        log_error("listen(): %s", strerror(errno));
+        close(sfd);
+        return 1;
+    }
+
+    /* search the maximum once, accepted connections do not inherit it */
+    listener_stats *listener = new_listener("unix:%s", path, 0);
+    listener->sndbuf = maximize_sndbuf(sfd);
+    if (conn_new(sfd, conn_listening, 1, false, listener) == NULL)
+    {
+        log_error("failed to create listening connection");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
 static void usage(void)
 {
     printf(PACKAGE " " VERSION "\n");
-    printf("-p <num>      TCP port number to listen on (default: 7900)\n"
+    printf("-p <num>      TCP port number to listen on (default: 7900), 0 to disable TCP\n"
+           "-U <num>      UDP port number to listen on, only for get (default: 0, off)\n"
+           "-x <file>     unix socket path to listen on, for local clients (default: off)\n"
            "-l <ip_addr>  interface to listen on, default is INDRR_ANY\n"
            "-d            run as a daemon\n"
            "-P <file>     save PID in <file>, only used with -d option\n"
@@ -1881,7 +2829,8 @@ static void usage(void)
            "-u <username> assume identity of <username> (only when run as root)\n"
            "-c <num>      max simultaneous connections, default is 1024\n"
            "-t <num>      number of threads to use (include scanning), default is 16\n"
-           "-H <dir>      home of database, default is 'testdb', multi-dir(splitted by ,:)\n"
+           "-H <dir>      home of database, default is 'testdb', multi-dir(splitted by ,:),\n"
+           "              a dir ending with @fast gets the new and the hot data files\n"
            "-T <num>      log of the number of db files(base 16), default is 1(16^1=16)\n"
            "-s <num>      slow command time limit, in ms, default is 100ms\n"
            "-f <num>      flush period(in secs) , default is 600 secs\n"
@@ -1893,6 +2842,18 @@ static void usage(void)
            "-i            print license info\n"
            "-F <num>      max size of a data file(in MB), default and at most 4000(MB), at least 5(MB)\n"
            "-C            check file sizes in startup using buckets.txt for each bitcask if it exists\n"
+           "-M <num>      memory limit for buffers and indexes(in MB), default is 0 (unlimited)\n"
+           "-Q <num>      max ready connections queued per thread, default is 0 (unlimited)\n"
+           "-W <num>      reply busy to storage commands queued longer than it, in ms, default is 0 (never)\n"
+           "-I <num>      max in-flight storage operations per disk, default is 0 (unlimited)\n"
+           "-R <num>      throttle flush and optimization when reads are slower than it, in ms, default is 0 (never)\n"
+           "-B <num>      max hint files built at the same time, default is 2\n"
+           "-O            route storage calls: every thread runs those of its slice of the db files, and forwards\n"
+           "              the others to their owners, the files keep their locks\n"
+           "-K <num>      track one in <num> gets and sets for 'stats hotkeys', default is 16, 0 to disable\n"
+           "-D <num>      store values of at least <num> KB once per db file by content, default is 0 (never)\n"
+           "-a <list>     pin threads to CPUs, as <class>=<cpus>[:...], classes are worker, scan, flush and gc,\n"
+           "              cpus like 0-7,16-23 or node0, default is no pinning\n"
           );
 
     return;
@@ -2022,10 +2983,22 @@ static void sig_handler(const int sig)
 
 void* do_flush(void *args)
 {
+    time_t last_migrate = time(NULL);
+    io_set_class(IO_FLUSH);
+    aff_set_class(AFF_FLUSH, 0);
     while (!daemon_quit)
     {
         hs_flush(store, (unsigned int)settings.flush_limit, settings.flush_period);
-        sleep(1);
+        mg_reclaim();
+        if (time(NULL) - last_migrate >= MIGRATE_PERIOD)
+        {
+            hs_migrate(store);
+            last_migrate = time(NULL);
+        }
+        // a second, in steps, so that quitting is not held up
+        int i;
+        for (i = 0; i < 10 && !daemon_quit; i++)
+            usleep(100000);
     }
     log_notice("flush thread exit.");
     return NULL;
@@ -2051,6 +3024,8 @@ int main (int argc, char **argv)
     struct sigaction sa;
     struct rlimit rlim;
     bool invalid_arg = false;
+    int dedup_kb = 0;
+    char *affinity = NULL;
 
     char buf[] = "2000-01-01-00:00:00";
     char fmt[] = "%Y-%m-%d-%H:%M:%S";
@@ -2063,7 +3038,7 @@ int main (int argc, char **argv)
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "p:c:hivl:dru:P:L:t:b:H:T:m:s:f:n:SF:CA")) != -1)
+    while ((c = getopt(argc, argv, "p:c:hivl:dru:P:L:t:b:H:T:m:s:f:n:SF:CAM:Q:W:I:R:U:x:B:OK:D:a:")) != -1)
     {
         switch (c)
         {
@@ -2142,6 +3117,42 @@ int main (int argc, char **argv)
         case 'C':
             settings.check_file_size = true;
             break;
+        case 'M':
+            settings.max_memory = (uint64_t) atoll(optarg) << 20;
+            break;
+        case 'Q':
+            settings.max_pending = atoi(optarg);
+            break;
+        case 'W':
+            settings.max_queue_wait = atoi(optarg) / 1000.0;
+            break;
+        case 'I':
+            settings.max_inflight = atoi(optarg);
+            break;
+        case 'R':
+            settings.io_read_latency = atoi(optarg);
+            break;
+        case 'U':
+            settings.udpport = atoi(optarg);
+            break;
+        case 'x':
+            settings.socketpath = optarg;
+            break;
+        case 'O':
+            settings.shared_nothing = true;
+            break;
+        case 'B':
+            settings.bg_threads = atoi(optarg);
+            break;
+        case 'K':
+            settings.hot_sample = atoi(optarg);
+            break;
+        case 'D':
+            dedup_kb = atoi(optarg);
+            break;
+        case 'a':
+            affinity = optarg;
+            break;
         default:
             invalid_arg = true;
         }
@@ -2187,6 +3198,26 @@ int main (int argc, char **argv)
         log_fatal("Number of threads must be greater than 0");
         exit(EXIT_FAILURE);
     }
+    if (settings.bg_threads <= 0)
+    {
+        log_fatal("Number of background threads must be greater than 0");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.hot_sample < 0)
+    {
+        log_fatal("Hot keys sampling must not be negative");
+        exit(EXIT_FAILURE);
+    }
+    if (dedup_kb < 0 || dedup_kb > MAX_VALUE_LEN / 1024)
+    {
+        log_fatal("Size of values to dedup must be between 0 and %d KB", MAX_VALUE_LEN / 1024);
+        exit(EXIT_FAILURE);
+    }
+    settings.dedup_size = dedup_kb * 1024;
+    if (!aff_init(affinity))
+    {
+        exit(EXIT_FAILURE);
+    }
     if(settings.item_buf_size < 512)
     {
         log_fatal("item buf size must be larger than 512 bytes");
@@ -2327,6 +3358,7 @@ int main (int argc, char **argv)
         log_error("failed to open db %s", dbhome);
         exit(1);
     }
+    max_inflight = settings.max_inflight * hs_disks(store);
 
     if ((stub_fd = open("/dev/null", O_RDONLY)) == -1)
     {
@@ -2336,11 +3368,26 @@ int main (int argc, char **argv)
     thread_init(settings.num_threads);
 
     /* create the listening socket, bind it, and init */
-    if (server_socket(settings.port, false))
+    if (settings.port == 0 && settings.socketpath == NULL)
+    {
+        log_fatal("no listener, TCP is disabled and no unix socket given");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.port > 0 && server_socket(settings.port, false))
     {
         log_fatal("failed to listen");
         exit(EXIT_FAILURE);
     }
+    if (settings.socketpath != NULL && server_socket_unix(settings.socketpath))
+    {
+        log_fatal("failed to listen on unix socket %s", settings.socketpath);
+        exit(EXIT_FAILURE);
+    }
+    if (settings.udpport > 0 && server_socket(settings.udpport, true))
+    {
+        log_fatal("failed to listen on UDP port %d", settings.udpport);
+        exit(EXIT_FAILURE);
+    }
 
     /* register signal callback */
     if (signal(SIGTERM, sig_handler) == SIG_ERR)
@@ -2365,8 +3412,10 @@ int main (int argc, char **argv)
 
     /* wait other thread to ends */
     log_notice("waiting for close, rss = %"PRIu64"", get_maxrss());
+    double stop_time = io_time();
     pthread_join(flush_id, NULL);
     pthread_detach(flush_id);
+    log_notice("flush thread stopped in %.3f secs", io_time() - stop_time);
 
     hs_close(store);
     log_warn("close done.");
@@ -31,11 +31,24 @@
 #include "const.h"
 #include "log.h"
 #include "common.h"
+#include "htree.h"
+#include "record.h"
+#include "affinity.h"
 
 
 #define DATA_BUFFER_SIZE 2048
 #define MAX_PAYLOAD_SIZE 1400
+#define UDP_READ_BUFFER_SIZE 65536
+#define UDP_HEADER_SIZE 8
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
+/* replies of pipelined commands are sent together, up to this many bytes */
+#define MAX_COALESCE_SIZE (64 * 1024)
+/* room kept in wbuf for one more simple reply while coalescing */
+#define OUTPUT_LINE_RESERVE 256
+/* values of this size or more are sent from the disk a chunk at a time */
+#define STREAM_CHUNK_SIZE (256 * 1024)
+/* values a connection streams in one reply, the others are read whole */
+#define MAX_CONN_STREAMS 8
 /* I'm told the max legnth of a 64-bit num converted to string is 20 bytes.
  * Plus a few for spaces, \r\n, \0 */
 #define SUFFIX_SIZE 24
@@ -83,9 +96,13 @@ struct stats
     uint64_t      slow_cmds;
     uint64_t      get_hits;
     uint64_t      get_misses;
+    uint64_t      get_streams;      /* large values sent a chunk at a time */
     time_t        started;          /* when the process was started */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
+    uint64_t      busy_rejects;     /* storage commands shed by admission control */
+    uint64_t      udp_requests;
+    uint64_t      udp_drops;        /* bad requests or failed replies */
 };
 
 #define MAX_VERBOSITY_LEVEL 2
@@ -128,6 +145,28 @@ enum conn_states
 #define NREAD_REPLACE 3
 #define NREAD_APPEND 4
 #define NREAD_PREPEND 5
+#define NREAD_CAS 6
+
+/* per listening socket stats, shared by its connections */
+#define MAX_LISTENERS 8
+typedef struct listener_stats
+{
+    char          name[128];
+    int           sndbuf;       /* of accepted connections, 0 for the default */
+    uint32_t      curr_conns;
+    uint32_t      total_conns;
+    uint64_t      bytes_read;
+    uint64_t      bytes_written;
+} listener_stats;
+
+/* a value streamed from its data file */
+typedef struct conn_stream
+{
+    RecordStream *rs;
+    int    msg;       /* msglist[] entry of its chunks */
+    int    iov;       /* iov[] entry of its chunks */
+    char   line[MAX_KEY_LEN + 64];  /* "VALUE <key> <flags> <bytes>\r\n" */
+} conn_stream;
 
 typedef struct conn conn;
 struct conn
@@ -142,12 +181,12 @@ struct conn
     int    rbytes;  /** how much data, starting from rcur, do we have unparsed */
 
     char   *wbuf;
-    char   *wcurr;
     int    wsize;
     int    wbytes;
     int    write_and_go; /** which state to go into after finishing current write */
     void   *write_and_free; /** free this memory after finishing writing */
     bool   noreply;   /* True if the reply should not be sent. */
+    bool   raw_compressed; /* get returns the values compressed by the server as they are */
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     int    rlbytes;
@@ -182,7 +221,24 @@ struct conn
     item   **icurr;
     int    ileft;
 
+    conn_stream *streams; /* MAX_CONN_STREAMS, allocated with sbuf when needed */
+    int    nstreams;
+    int    scurr;     /* the one being sent */
+    char   *sbuf;     /* its current chunk */
+
+    /* data for UDP clients */
+    bool   udp;
+    int    request_id; /* Incoming UDP request ID */
+    struct sockaddr_storage request_addr; /* Who sent the most recent request */
+    socklen_t request_addr_size;
+    unsigned char *hdrbuf; /* udp packet headers */
+    int    hdrsize;   /* number of headers' worth of space is allocated */
+
+    listener_stats *listener;
     char   *remote;
+    float  queue_wait; /* secs between polled and dispatched to a worker */
+    uint32_t node_calls[AFF_MAX_NODES]; /* storage calls by node, for steering */
+    uint32_t ncalls;
     conn   *next;     /* Used for generating a list of conn structures */
 };
 
@@ -194,14 +250,21 @@ struct conn
 void item_init(void);
 item *do_item_from_freelist(void);
 int do_item_add_to_freelist(item *it);
+size_t do_item_trim_freelist(size_t goal);
 item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes);
+item *item_alloc2(char *key, const size_t nkey, const int flags, const int nbytes, const int64_t extra);
 int item_free(item *it);
-item *item_get(char *key, unsigned int nkey);
+item *item_get(char *key, unsigned int nkey, bool raw);
+item *item_get_stream(char *key, unsigned int nkey, bool raw, bool cas, RecordStream **stream,
+        unsigned int *vlen, uint32_t *flag);
+item *item_get_range(char *key, unsigned int nkey, uint32_t from, unsigned int len);
 
 /* conn management */
 conn *do_conn_from_freelist();
 bool do_conn_add_to_freelist(conn *c);
-conn *conn_new(const int sfd, const int init_state, const int read_buffer_size);
+size_t do_conn_trim_freelist(size_t goal);
+conn *conn_new(const int sfd, const int init_state, const int read_buffer_size,
+               const bool is_udp, listener_stats *listener);
 void conn_close(conn* c);
 
 int add_delta(char *key, size_t nkey, int64_t delta, char *buf);
@@ -211,21 +274,28 @@ void thread_init(int nthreads);
 int add_event(int fd, int mask, conn *c);
 int delete_event(int fd);
 void loop_run(int nthreads);
+void mt_storage_run(const HKey *hk, void (*func)(void *arg), void *arg);
+uint64_t mt_forwarded_calls(void);
+uint64_t mt_steered_conns(void);
 
 int drive_machine(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 conn *mt_conn_from_freelist(void);
 bool mt_conn_add_to_freelist(conn *c);
+size_t mt_conn_trim_freelist(size_t goal);
 item *mt_item_from_freelist(void);
 int mt_item_add_to_freelist(item *it);
+size_t mt_item_trim_freelist(size_t goal);
 void  mt_stats_lock(void);
 void  mt_stats_unlock(void);
 
 # define conn_from_freelist()        mt_conn_from_freelist()
 # define conn_add_to_freelist(x)     mt_conn_add_to_freelist(x)
+# define conn_trim_freelist(x)       mt_conn_trim_freelist(x)
 # define item_from_freelist()        mt_item_from_freelist()
 # define item_add_to_freelist(x)     mt_item_add_to_freelist(x)
+# define item_trim_freelist(x)       mt_item_trim_freelist(x)
 # define STATS_LOCK()                mt_stats_lock()
 # define STATS_UNLOCK()              mt_stats_unlock()
 
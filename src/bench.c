@@ -0,0 +1,142 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+/*
+ * In-process benchmark of the storage engine through libbeansdb, without
+ * the network and protocol layers:
+ *
+ *   beansdb_bench <path> [keys] [value size] [threads]
+ *
+ * sets `keys` keys, reads them all back, then reads them again from a
+ * read only handle opened on the same path, which should see them all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libbeansdb.h"
+
+static beansdb *db;
+static int nkeys = 100000, vsize = 100, nthreads = 4;
+static char *value;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *do_set(void *arg)
+{
+    int i, id = (int)(long)arg;
+    char key[32];
+    for (i = id; i < nkeys; i += nthreads)
+    {
+        int ksz = snprintf(key, sizeof(key), "bench_%d", i);
+        if (!beansdb_set(db, key, ksz, value, vsize, 0))
+            fprintf(stderr, "set %s failed\n", key);
+    }
+    return NULL;
+}
+
+static long misses;
+
+static void *do_get(void *arg)
+{
+    int i, id = (int)(long)arg;
+    char key[32];
+    unsigned int vlen;
+    for (i = id; i < nkeys; i += nthreads)
+    {
+        int ksz = snprintf(key, sizeof(key), "bench_%d", i);
+        char *v = beansdb_get(db, key, ksz, &vlen, NULL);
+        if (v == NULL || vlen != (unsigned int)vsize)
+            __sync_fetch_and_add(&misses, 1);
+        free(v);
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*func)(void*))
+{
+    pthread_t tids[256];
+    int i;
+    double t = now();
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, func, (void*)(long)i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    t = now() - t;
+    printf("%-8s %10d ops %8.3f s %12.0f ops/s\n", name, nkeys, t, nkeys / t);
+}
+
+static bool count_key(const char *key, int ksz, int version, void *arg)
+{
+    (*(long*)arg)++;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <path> [keys] [value size] [threads]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) nkeys = atoi(argv[2]);
+    if (argc > 3) vsize = atoi(argv[3]);
+    if (argc > 4) nthreads = atoi(argv[4]);
+    if (nthreads < 1 || nthreads > 256)
+        nthreads = 4;
+
+    value = (char*)malloc(vsize);
+    memset(value, 'v', vsize);
+
+    beansdb_options opt;
+    beansdb_options_init(&opt);
+    opt.threads = nthreads;
+    db = beansdb_open(argv[1], &opt);
+    if (db == NULL)
+    {
+        fprintf(stderr, "open %s failed\n", argv[1]);
+        return 1;
+    }
+    run("set", do_set);
+    run("get", do_get);
+    beansdb_flush(db);
+
+    beansdb *rw = db;
+    opt.read_only = true;
+    db = beansdb_open(argv[1], &opt);
+    if (db == NULL)
+    {
+        fprintf(stderr, "open %s read only failed\n", argv[1]);
+        return 1;
+    }
+    long rw_misses = misses;
+    misses = 0;
+    run("get(ro)", do_get);
+    long n = 0;
+    double t = now();
+    beansdb_visit(db, count_key, &n);
+    printf("%-8s %10ld keys %8.3f s\n", "visit", n, now() - t);
+    beansdb_close(db);
+    beansdb_close(rw);
+
+    printf("misses: %ld, read only: %ld, keys visited: %ld of %d\n", rw_misses, misses, n, nkeys);
+    free(value);
+    return rw_misses == 0 && misses == 0 && n == nkeys ? 0 : 1;
+}
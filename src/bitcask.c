@@ -27,6 +27,7 @@
 #include <time.h>
 #include <inttypes.h>
 #include <dirent.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -43,6 +44,11 @@
 #include "hint.h"
 #include "const.h"
 #include "log.h"
+#include "memgov.h"
+#include "ioclass.h"
+#include "taskpool.h"
+#include "blob.h"
+#include "frozen.h"
 
 
 #define MAX_BUCKET_COUNT 256
@@ -55,27 +61,63 @@ const int SAVE_HTREE_LIMIT = 5;
 const char DATA_FILE[] = "%s/%03d.data";
 const char HINT_FILE[] = "%s/%03d.hint.qlz";
 const char HTREE_FILE[] = "%s/%03d.htree";
+const char HINT_LOG[] = "%s/%03d.hint.log";
+
+#define COLD_HEAT   4       /* fewer decayed reads make a file cold */
+#define DISK_UNRESOLVED -2  /* the disk of a data file is resolved on its next open */
+#define HOT_HEAT    1000    /* more decayed reads make a file hot */
 
 struct bitcask_t
 {
     uint32_t depth, pos;
     time_t before;
+    bool   read_only;   // never touch the files, another process may own them
     Mgr    *mgr;
-    HTree  *tree, *curr_tree;
+    HTree  *tree;
     int    last_snapshot;
     int    curr;
     uint64_t bytes, curr_bytes;
     char   *write_buffer;
     time_t last_flush_time;
     uint32_t    wbuf_size, wbuf_start_pos, wbuf_curr_pos;
+    char   *hint_buffer; // hint records of the write buffer
+    uint32_t    hbuf_size, hbuf_curr_pos, curr_count;
     pthread_mutex_t flush_lock, buffer_lock, write_lock;
-    int    optimize_flag;
+    pthread_mutex_t optimize_lock;
+    pthread_cond_t  optimize_done;
+    int    optimize_flag;   // 1: running, 2: asked to stop
+    bool   closing;         // never optimize again
     char   *flush_buffer;
     uint32_t    fbuf_size, fbuf_start_pos;
     int     flushing_bucket;
     int64_t buckets[256];
+    uint32_t reads[256];    // reads from the data files since the last aging
+    uint32_t heat[256];     // reads decayed by half at every aging
+    int     disks[256];     // the disk loads of the data files, for io_account()
+    DictTrainer *dict;      // compression dictionaries of the small values
+    BlobStore *blobs;       // large values stored once by content, with -D
+    FrozenIndex *frozen;    // with before, the items are looked up here
+    char   *maps[256];      // with before, the data files mapped
+    size_t map_size[256];
 };
 
+static int mg_wbuf = -1, mg_fbuf = -1;
+
+static inline void resize_write_buffer(Bitcask *bc, uint32_t size)
+{
+    mg_charge(mg_wbuf, (int64_t)size - bc->wbuf_size);
+    bc->wbuf_size = size;
+    free(bc->write_buffer);
+    bc->write_buffer = (char*)safe_malloc(bc->wbuf_size);
+}
+
+static inline void resize_hint_buffer(Bitcask *bc, uint32_t size)
+{
+    mg_charge(mg_wbuf, (int64_t)size - bc->hbuf_size);
+    bc->hbuf_size = size;
+    bc->hint_buffer = (char*)safe_realloc(bc->hint_buffer, bc->hbuf_size);
+}
+
 static inline bool file_exists(const char *path)
 {
     struct stat st;
@@ -104,7 +146,18 @@ static inline char *new_path(char *dst, int dst_size, Mgr *mgr, const char *fmt,
     return new_path_real(dst, dst_size, mgr, fmt, i);
 }
 
+// the data file of bucket is opened as fd, moved or allocated with fd -1
+static inline int bucket_disk(Bitcask *bc, int bucket, int fd)
+{
+    if (fd < 0)
+        bc->disks[bucket] = DISK_UNRESOLVED;
+    else if (bc->disks[bucket] == DISK_UNRESOLVED)
+        bc->disks[bucket] = mgr_disk_of(fd);
+    return bc->disks[bucket];
+}
+
 int dump_buckets(Bitcask *bc);
+static void flush_hint_log(Bitcask *bc, int bucket, const char *buf, uint32_t size);
 static inline char *new_data(char *dst, int dst_size, Bitcask *bc, const char *fmt, int i)
 {
     char *path = gen_path(dst, dst_size, mgr_base(bc->mgr), fmt, i);
@@ -118,6 +171,7 @@ static inline char *new_data(char *dst, int dst_size, Bitcask *bc, const char *f
         exit(-1);
     }
     bc->buckets[i] = 0;
+    bucket_disk(bc, i, -1);
     dump_buckets(bc);
     return new_path_real(dst, dst_size, bc->mgr, fmt, i);
 }
@@ -257,6 +311,8 @@ int get_bucket_by_name(char *dir, char *name, long *bucket)
         log_warn("find tmp file %s/%s", dir, name);
         return -1;
     }
+    if (strcmp(HINT_LOG + 7, suffix) == 0)
+        return -1;
     int i;
     for (i = 0; i < 3; i++)
     {
@@ -269,7 +325,7 @@ int get_bucket_by_name(char *dir, char *name, long *bucket)
     return -1;
 }
 
-int check_buckets(Mgr *mgr, int64_t *sizes, int locations[][3])
+int check_buckets(Mgr *mgr, int64_t *sizes, int locations[][3], bool read_only)
 {
     char **disks = mgr->disks;
     struct stat sb;
@@ -346,7 +402,11 @@ int check_buckets(Mgr *mgr, int64_t *sizes, int locations[][3])
                 int old_loc = locations[bucket][type];
                 if (old_loc == -1)
                 {
-                    if (settings.autolink)
+                    if (read_only)
+                    {
+                        locations[bucket][type] = i;
+                    }
+                    else if (settings.autolink)
                     {
                         safe_snprintf(sym, MAX_PATH_LEN, "%s/%s", disks[0], name);
                         if (symlink(path, sym) != 0)
@@ -409,7 +469,7 @@ Bitcask* bc_open(const char *path, int depth, int pos, time_t before)
     Mgr *mgr = mgr_create(t, 1);
     if (mgr == NULL) return NULL;
 
-    Bitcask* bc = bc_open2(mgr, depth, pos, before);
+    Bitcask* bc = bc_open2(mgr, depth, pos, before, false);
     if (bc != NULL) bc_scan(bc);
     return bc;
 }
@@ -434,7 +494,7 @@ static void init_buckets(Bitcask *bc)
 
     int locations[256][3];
     memset(locations, -1, sizeof(int)*256*3);
-    if (check_buckets(bc->mgr, bc->buckets, locations) != 0 )
+    if (check_buckets(bc->mgr, bc->buckets, locations, bc->read_only) != 0 )
     {
         log_fatal("bitcask 0x%x check failed, exit!", bc->pos);
         exit(-1);
@@ -499,7 +559,11 @@ static void init_buckets(Bitcask *bc)
     //print_buckets(bc->buckets);
 }
 
-Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before)
+/*
+ * A read only bitcask serves the data written before `before`, and never
+ * changes the files, so it can be opened beside a running server.
+ */
+Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before, bool read_only)
 {
     Bitcask* bc = (Bitcask*)safe_malloc(sizeof(Bitcask));
     /*if (bc == NULL) return NULL;*/
@@ -509,13 +573,21 @@ Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before)
     bc->depth = depth;
     bc->pos = pos;
     bc->before = before;
+    bc->read_only = read_only;
     bc->bytes = 0;
     bc->curr_bytes = 0;
     bc->tree = NULL;
     bc->last_snapshot = -1;
-    bc->curr_tree = ht_new(depth, pos, true);
+    if (mg_wbuf < 0)
+    {
+        mg_wbuf = mg_register("write_buffer", MG_PRIO_BUFFER, NULL, NULL);
+        mg_fbuf = mg_register("flush_buffer", MG_PRIO_BUFFER, NULL, NULL);
+    }
     bc->wbuf_size = 1024 * 4;
     bc->write_buffer = (char*)safe_malloc(bc->wbuf_size);
+    bc->hbuf_size = 1024 * 4;
+    bc->hint_buffer = (char*)safe_malloc(bc->hbuf_size);
+    mg_charge(mg_wbuf, bc->wbuf_size + bc->hbuf_size);
     bc->last_flush_time = time(NULL);
     bc->flush_buffer = NULL;
     bc->fbuf_start_pos = 0;
@@ -524,6 +596,11 @@ Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before)
     pthread_mutex_init(&bc->buffer_lock, NULL);
     pthread_mutex_init(&bc->write_lock, NULL);
     pthread_mutex_init(&bc->flush_lock, NULL);
+    pthread_mutex_init(&bc->optimize_lock, NULL);
+    pthread_cond_init(&bc->optimize_done, NULL);
+    int i;
+    for (i = 0; i < 256; i++)
+        bc->disks[i] = DISK_UNRESOLVED;
     init_buckets(bc);
     return bc;
 }
@@ -536,6 +613,8 @@ static void skip_empty_file(Bitcask *bc)
     for (i = 0; i < MAX_BUCKET_COUNT; i++)
     {
         int64_t size = bc->buckets[i];
+        if (size >= 0) // left by a crash, the hint will be rebuilt from data
+            mgr_unlink(gen_path(opath, MAX_PATH_LEN, base, HINT_LOG, i));
         gen_path(opath, MAX_PATH_LEN, base, DATA_FILE, i);
         if (size > 0)
         {
@@ -582,16 +661,118 @@ static void skip_empty_file(Bitcask *bc)
     }
 }
 
+/*
+ * Nothing is written to a bitcask serving the data before a time, so its
+ * items are looked up in a frozen index (in the HTree if they do not fit
+ * in one), and its data files are read from their mappings, both taking
+ * no lock. The files are not mapped if they may belong to a running
+ * server, which may optimize them.
+ */
+static void freeze(Bitcask *bc)
+{
+    char datapath[MAX_PATH_LEN];
+    int i;
+    bc->frozen = fi_build(bc->tree, bc->depth);
+    if (bc->read_only)
+        return;
+    for (i = 0; i < bc->curr; i++)
+    {
+        if (bc->buckets[i] <= 0)
+            continue;
+        gen_path(datapath, MAX_PATH_LEN, mgr_base(bc->mgr), DATA_FILE, i);
+        int fd = open(datapath, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            if (fd != -1) close(fd);
+            continue;
+        }
+        char *addr = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            log_warn("mmap %s failed: %s, read it instead", datapath, strerror(errno));
+            continue;
+        }
+        madvise(addr, st.st_size, MADV_RANDOM);
+        bc->maps[i] = addr;
+        bc->map_size[i] = st.st_size;
+    }
+}
+
+static void unfreeze(Bitcask *bc)
+{
+    int i;
+    fi_destroy(bc->frozen);
+    bc->frozen = NULL;
+    for (i = 0; i < MAX_BUCKET_COUNT; i++)
+    {
+        if (bc->maps[i] != NULL)
+            munmap(bc->maps[i], bc->map_size[i]);
+        bc->maps[i] = NULL;
+    }
+}
+
+static Item *find_item(Bitcask *bc, const HKey *hk, int *maybe_tmp, char *buf)
+{
+    if (bc->frozen != NULL)
+    {
+        *maybe_tmp = 0;
+        return (Item*)fi_get(bc->frozen, hk);
+    }
+    return ht_get_maybe_tmp(bc->tree, hk, maybe_tmp, buf);
+}
+
+/*
+ * The record from the mapping, NULL if it is broken, or if it is large
+ * enough to be streamed from the file instead (*large is set then).
+ */
+static DataRecord *read_mapped(Bitcask *bc, uint32_t bucket, uint32_t pos, bool decomp, const char *path,
+        const char *key, uint32_t stream_size, bool *large)
+{
+    char *addr = bc->maps[bucket];
+    size_t size = bc->map_size[bucket];
+    if ((size_t)pos + sizeof(DataRecord) - sizeof(char*) > size)
+    {
+        log_error("Bug: %s @ %u is beyond the end %zu, key = %s", path, pos, size, key);
+        return NULL;
+    }
+    DataRecord *h = (DataRecord*)(addr + pos - sizeof(char*));
+    if (stream_size > 0 && h->vsz >= stream_size)
+    {
+        *large = true;
+        return NULL;
+    }
+    DataRecord *r = decode_record(addr + pos, size - pos, decomp, path, pos, key, true, NULL);
+    bc->reads[bucket]++;
+    return r;
+}
+
+static bool count_blob(DataRecord *r, void *bs, void *unused)
+{
+    if (r->flag & DEDUP_FLAG)
+        blob_recount((BlobStore*)bs, r->value);
+    return true;
+}
+
 void bc_scan(Bitcask *bc)
 {
     char datapath[MAX_PATH_LEN], hintpath[MAX_PATH_LEN];
     int i = 0;
     struct stat st, hst;
 
-    skip_empty_file(bc);
-    dump_buckets(bc);
+    if (!bc->read_only)
+    {
+        skip_empty_file(bc);
+        dump_buckets(bc);
+    }
 
     const char *base = mgr_base(bc->mgr);
+    // records compressed with them are decoded while scanning
+    safe_snprintf(datapath, MAX_PATH_LEN, "%s/dict", base);
+    bc->dict = dict_open(datapath, bc->read_only);
+    bc->blobs = blob_open(bc->mgr, bc->read_only);
+
     // load snapshot of htree
     for (i = MAX_BUCKET_COUNT - 1; i >= 0; --i)
     {
@@ -609,7 +790,7 @@ void bc_scan(Bitcask *bc)
             else
             {
                 log_error("open HTree from %s failed", datapath);
-                mgr_unlink(datapath);
+                if (!bc->read_only) mgr_unlink(datapath);
             }
         }
     }
@@ -618,12 +799,15 @@ void bc_scan(Bitcask *bc)
         bc->tree = ht_new(bc->depth, bc->pos, false);
     }
 
+    int last = -1;
     for (i = 0; i < MAX_BUCKET_COUNT; i++)
     {
         if (stat(gen_path(datapath, MAX_PATH_LEN, base, DATA_FILE, i), &st) != 0)
         {
+            if (bc->read_only) continue; // empty buckets are not skipped
             break;
         }
+        last = i;
         bc->bytes += st.st_size;
         if (i <= bc->last_snapshot) continue;
 
@@ -654,7 +838,15 @@ void bc_scan(Bitcask *bc)
         }
     }
 
-    if (i - bc->last_snapshot > SAVE_HTREE_LIMIT)
+    if (blob_need_recount(bc->blobs))
+    {
+        for (i = 0; i <= last; i++)
+            visit_record(gen_path(datapath, MAX_PATH_LEN, base, DATA_FILE, i), count_blob, bc->blobs, NULL, false);
+        blob_sweep(bc->blobs);
+    }
+
+    i = last + 1;
+    if (i - bc->last_snapshot > SAVE_HTREE_LIMIT && !bc->read_only)
     {
         if (ht_save(bc->tree, new_path(datapath, MAX_PATH_LEN, bc->mgr, HTREE_FILE, i-1)) == 0)
         {
@@ -673,6 +865,39 @@ void bc_scan(Bitcask *bc)
     {
         log_notice("bitcask %x loaded, curr = %d", bc->pos , i);
     }
+    if (bc->before > 0)
+        freeze(bc);
+}
+
+/*
+ * Ask the running optimization to stop after the data file it is on,
+ * and refuse the later ones, without waiting.
+ */
+void bc_stop_optimize(Bitcask *bc)
+{
+    pthread_mutex_lock(&bc->optimize_lock);
+    bc->closing = true;
+    if (bc->optimize_flag > 0)
+        bc->optimize_flag = 2;
+    pthread_mutex_unlock(&bc->optimize_lock);
+}
+
+static bool begin_optimize(Bitcask *bc)
+{
+    pthread_mutex_lock(&bc->optimize_lock);
+    bool ok = !bc->closing && bc->optimize_flag == 0;
+    if (ok)
+        bc->optimize_flag = 1;
+    pthread_mutex_unlock(&bc->optimize_lock);
+    return ok;
+}
+
+static void end_optimize(Bitcask *bc)
+{
+    pthread_mutex_lock(&bc->optimize_lock);
+    bc->optimize_flag = 0;
+    pthread_cond_broadcast(&bc->optimize_done);
+    pthread_mutex_unlock(&bc->optimize_lock);
 }
 
 /*
@@ -680,38 +905,42 @@ void bc_scan(Bitcask *bc)
  * */
 void bc_close(Bitcask *bc)
 {
-    char datapath[MAX_PATH_LEN], hintpath[MAX_PATH_LEN];
+    char datapath[MAX_PATH_LEN], hintpath[MAX_PATH_LEN], logpath[MAX_PATH_LEN];
 
-    if (bc->optimize_flag > 0)
+    bc_stop_optimize(bc);
+    pthread_mutex_lock(&bc->optimize_lock);
+    while (bc->optimize_flag > 0)
+        pthread_cond_wait(&bc->optimize_done, &bc->optimize_lock);
+    pthread_mutex_unlock(&bc->optimize_lock);
+
+    unfreeze(bc);
+    if (bc->read_only)
     {
-        bc->optimize_flag = 2;
-        while (bc->optimize_flag > 0)
-        {
-            sleep(1);
-        }
+        ht_destroy(bc->tree);
+        goto CLOSE_END;
     }
 
     pthread_mutex_lock(&bc->write_lock);
 
     bc_flush(bc, 0, 0);
-    struct stat sb;
-    if (stat(gen_path(datapath, MAX_PATH_LEN, mgr_base(bc->mgr), DATA_FILE, bc->curr), &sb) == 0)
+    // all flushed, the current data file ends at the write buffer
+    if (bc->wbuf_start_pos > 0)
     {
-        bc->buckets[bc->curr] = sb.st_size;
+        bc->buckets[bc->curr] = bc->wbuf_start_pos;
         dump_buckets(bc);
     }
 
-    if (NULL != bc->curr_tree)
+    flush_hint_log(bc, bc->curr, bc->hint_buffer, bc->hbuf_curr_pos);
+    bc->hbuf_curr_pos = 0;
+    gen_path(logpath, MAX_PATH_LEN, mgr_base(bc->mgr), HINT_LOG, bc->curr);
+    if (bc->curr_bytes > 0)
     {
-        if (bc->curr_bytes > 0)
-        {
-            build_hint(bc->curr_tree, new_path(hintpath, MAX_PATH_LEN, bc->mgr, HINT_FILE, bc->curr));
-        }
-        else
-        {
-            ht_destroy(bc->curr_tree);
-        }
-        bc->curr_tree = NULL;
+        build_hint_from_log(ht_new(bc->depth, bc->pos, true), bc->curr, logpath,
+                new_path(hintpath, MAX_PATH_LEN, bc->mgr, HINT_FILE, bc->curr));
+    }
+    else
+    {
+        mgr_unlink(logpath);
     }
 
     if (bc->curr_bytes == 0) --(bc->curr);
@@ -728,8 +957,15 @@ void bc_close(Bitcask *bc)
     }
     ht_destroy(bc->tree);
 
+CLOSE_END:
+    dict_close(bc->dict);
+    blob_close(bc->blobs);
     mgr_destroy(bc->mgr);
+    mg_charge(mg_wbuf, -(int64_t)(bc->wbuf_size + bc->hbuf_size));
     free(bc->write_buffer);
+    free(bc->hint_buffer);
+    pthread_cond_destroy(&bc->optimize_done);
+    pthread_mutex_destroy(&bc->optimize_lock);
     free(bc);
 }
 
@@ -766,10 +1002,62 @@ static void update_item_pos(Item *it, void *_args)
     }
 }
 
+static inline void move_heat(Bitcask *bc, int from, int to)
+{
+    bucket_disk(bc, from, -1);
+    bucket_disk(bc, to, -1);
+    if (from == to) return;
+    bc->heat[to] += bc->heat[from];
+    bc->reads[to] += bc->reads[from];
+    bc->heat[from] = bc->reads[from] = 0;
+}
+
+static int sealed_buckets(Bitcask *bc)
+{
+    pthread_mutex_lock(&bc->flush_lock);
+    int sealed = bc->flushing_bucket >= 0 ? min(bc->curr, bc->flushing_bucket) : bc->curr;
+    pthread_mutex_unlock(&bc->flush_lock);
+    return sealed;
+}
+
+/*
+ * Move the most read sealed data file off its disk if that disk is
+ * overloaded, one file per gc so that the disks are not flooded.
+ */
+static void relocate_hot_bucket(Bitcask *bc)
+{
+    int i, hot = -1;
+    uint32_t most = 0;
+    int sealed = sealed_buckets(bc);
+    for (i = 0; i < sealed; i++)
+    {
+        if (bc->buckets[i] > 0 && bc->heat[i] + bc->reads[i] > most)
+        {
+            most = bc->heat[i] + bc->reads[i];
+            hot = i;
+        }
+    }
+    if (hot < 0)
+        return;
+
+    char name[16];
+    safe_snprintf(name, 16, DATA_FILE + 3, hot);
+    if (mgr_relocate(bc->mgr, name))
+        bucket_disk(bc, hot, -1);
+}
+
+static bool drop_blob(DataRecord *r, void *bs, void *unused)
+{
+    if (r->flag & DEDUP_FLAG)
+        blob_drop((BlobStore*)bs, r->value);
+    return true;
+}
+
 int bc_optimize(Bitcask *bc, int limit)
 {
     int i, total, last = -1;
-    bc->optimize_flag = 1;
+    if (!begin_optimize(bc))
+        return 0;
     const char *base = mgr_base(bc->mgr);
     char htreepath_tmp[MAX_PATH_LEN];
     // remove htree
@@ -809,6 +1097,7 @@ int bc_optimize(Bitcask *bc, int limit)
             if (stat(datapath, &st) != 0)
             {
                 log_error("data file: %s lost", datapath);
+                end_optimize(bc);
                 return -1;
             }
         }
@@ -834,7 +1123,7 @@ int bc_optimize(Bitcask *bc, int limit)
                 if (symlink(datapath, npath) != 0)
                 {
                     log_fatal("symlink failed: %s -> %s, err:%s", datapath, npath, strerror(errno));
-                    bc->optimize_flag = 0;
+                    end_optimize(bc);
                     return -1;
                 }
 
@@ -852,6 +1141,7 @@ int bc_optimize(Bitcask *bc, int limit)
 
                 bc->buckets[last] = bc->buckets[i];
                 bc->buckets[i] = -1;
+                move_heat(bc, i, last);
                 dump_buckets(bc);
             }
             continue;
@@ -875,7 +1165,7 @@ int bc_optimize(Bitcask *bc, int limit)
             if ((bc->buckets[last]>= 0) !=  (lstat(ldpath,&sb)==0))
             {
                 log_fatal("buckets mismatch!");
-                bc->optimize_flag = 0;
+                end_optimize(bc);
                 return -1;
             }
 
@@ -885,28 +1175,32 @@ int bc_optimize(Bitcask *bc, int limit)
                 new_path(lhpath_real, MAX_PATH_LEN, bc->mgr, HINT_FILE, last);
             }
 
+            blob_discard(bc->blobs);
             int ret = optimizeDataFile(bc->tree, bc->mgr, i, datapath, hintpath, last, ldpath, lhpath_real,
-                    settings.max_bucket_size, skipped, (last == i) || (last != i && bc->buckets[last] < 0), &bytes_deleted);
+                    settings.max_bucket_size, skipped, (last == i) || (last != i && bc->buckets[last] < 0), &bytes_deleted,
+                    drop_blob, bc->blobs);
 
             if (ret == 0)
             {
+                blob_commit(bc->blobs);
                 struct stat sb;
                 if (stat(ldpath, &sb) == 0)
                 {
                     bc->buckets[i] = -1;
                     bc->buckets[last]  = sb.st_size;
+                    move_heat(bc, i, last);
                     dump_buckets(bc);
                 }
                 else{
                     log_error("last %s not exist after gc:", ldpath);
-                    bc->optimize_flag = 0;
+                    end_optimize(bc);
                     return -1;
                 }
                 break;
             }
             else if (ret < 0 )
             {
-                bc->optimize_flag = 0;
+                end_optimize(bc);
                 return -1;
             }
             else
@@ -919,7 +1213,7 @@ int bc_optimize(Bitcask *bc, int limit)
                 else
                 {
                     log_warn("Bug: fail to optimize %s into %d self, return", datapath, last);
-                    bc->optimize_flag = 0;
+                    end_optimize(bc);
                     return -1;
                 }
             }
@@ -930,7 +1224,7 @@ int bc_optimize(Bitcask *bc, int limit)
         pthread_mutex_unlock(&bc->buffer_lock);
     }
 
-    // update pos of items in curr_tree
+    // update pos of items in curr bucket
     pthread_mutex_lock(&bc->write_lock);
     pthread_mutex_lock(&bc->flush_lock);
     if (i == bc->curr && ++last < bc->curr)
@@ -945,19 +1239,36 @@ int bc_optimize(Bitcask *bc, int limit)
                 log_fatal("symlink failed: %s -> %s, err:%s", opath, npath, strerror(errno));
         }
 
+        char lpath[MAX_PATH_LEN];
+        gen_path(lpath, MAX_PATH_LEN, base, HINT_LOG, bc->curr);
+        HTree *tree = ht_new(bc->depth, bc->pos, true);
+        if (stat(lpath, &st) == 0 && st.st_size > 0)
+        {
+            HintFile *hint = open_hint(lpath, NULL);
+            if (hint != NULL)
+            {
+                replay_hint_log(tree, bc->curr, hint->buf, hint->size);
+                close_hint(hint);
+            }
+        }
+        replay_hint_log(tree, bc->curr, bc->hint_buffer, bc->hbuf_curr_pos);
         struct update_args args;
         args.tree = bc->tree;
         args.index = last;
-        ht_visit(bc->curr_tree, update_item_pos, &args);
+        ht_visit(tree, update_item_pos, &args);
+        ht_destroy(tree);
 
         if (bc->buckets[bc->curr] > 0)
         {
             unlink(npath);
             mgr_rename(opath, npath);
         }
+        if (file_exists(lpath))
+            mgr_rename(lpath, gen_path(npath, MAX_PATH_LEN, base, HINT_LOG, last));
 
         bc->buckets[last] = bc->buckets[i];
         bc->buckets[i] = -1;
+        move_heat(bc, i, last);
         dump_buckets(bc);
 
         bc->curr = last;
@@ -966,19 +1277,72 @@ int bc_optimize(Bitcask *bc, int limit)
     pthread_mutex_unlock(&bc->write_lock);
     if (last > 0)
         log_notice("bitcask %x optimization done, curr = %d, last = %d", bc->pos, bc->curr, last);
-    bc->optimize_flag = 0;
+    if (bc->optimize_flag == 1)
+        relocate_hot_bucket(bc);
+    end_optimize(bc);
     return 0;
 }
 
-DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_deleted)
+/*
+ * Age the heat of the data files, then move the coldest sealed one off
+ * the fast tier and the hottest one onto it, at most one of each per call.
+ * A sealed file is cold when it is barely read any more, or when the fast
+ * tier is running out of room for new buckets.
+ */
+void bc_migrate(Bitcask *bc)
 {
-    if (!check_key(key, strlen(key)))
+    int i, cold = -1, hot = -1;
+    if (bc->read_only) return;
+    for (i = 0; i < MAX_BUCKET_COUNT; i++)
+    {
+        uint32_t reads = bc->reads[i];
+        bc->reads[i] = 0;
+        bc->heat[i] = bc->heat[i] / 2 + reads;
+    }
+    if (!bc->mgr->tiered || bc->optimize_flag || bc->closing)
+        return;
+
+    bool short_of_room = !mgr_tier_room(bc->mgr, TIER_FAST, 3 * (uint64_t)settings.max_bucket_size);
+    int sealed = sealed_buckets(bc);
+    char name[16];
+    for (i = 0; i < sealed; i++)
+    {
+        if (bc->buckets[i] <= 0)
+            continue;
+        safe_snprintf(name, 16, DATA_FILE + 3, i);
+        int tier = mgr_tier_of(bc->mgr, name);
+        if (tier == TIER_FAST && (bc->heat[i] < COLD_HEAT || short_of_room)
+                && (cold < 0 || bc->heat[i] < bc->heat[cold]))
+            cold = i;
+        else if (tier == TIER_SLOW && bc->heat[i] >= HOT_HEAT
+                && (hot < 0 || bc->heat[i] > bc->heat[hot]))
+            hot = i;
+    }
+    if (cold >= 0)
+    {
+        safe_snprintf(name, 16, DATA_FILE + 3, cold);
+        if (mgr_migrate(bc->mgr, name, TIER_SLOW))
+            bucket_disk(bc, cold, -1);
+    }
+    if (hot >= 0 && !short_of_room)
+    {
+        safe_snprintf(name, 16, DATA_FILE + 3, hot);
+        if (mgr_migrate(bc->mgr, name, TIER_FAST))
+            bucket_disk(bc, hot, -1);
+    }
+}
+
+static DataRecord* get_record(Bitcask *bc, const HKey *hk, uint32_t *ret_pos, bool return_deleted, bool decomp,
+        uint32_t stream_size, RecordStream **stream)
+{
+    const char *key = hk->key;
+    if (!check_key(key, hk->ksz))
         return NULL;
 
 
     int maybe_tmp = 0;
     char buf[512];
-    Item *item = ht_get_maybe_tmp(bc->tree, key, &maybe_tmp, buf);
+    Item *item = find_item(bc, hk, &maybe_tmp, buf);
     if (NULL == item) return NULL;
 
     *ret_pos = item->pos;
@@ -992,18 +1356,19 @@ DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_
     if (bucket > (uint32_t)(bc->curr))
     {
         log_error("Bug: invalid bucket %d > %d, bitcask %x, key = %s", bucket, bc->curr, bc->pos, key);
-        ht_remove(bc->tree, key);
+        if (bc->frozen == NULL)
+            ht_remove_key(bc->tree, hk);
         return NULL;
     }
 
     DataRecord *r = NULL;
-    if (bucket == (uint32_t)(bc->curr) || bucket == (uint32_t)(bc->flushing_bucket))
+    if (bc->frozen == NULL && (bucket == (uint32_t)(bc->curr) || bucket == (uint32_t)(bc->flushing_bucket)))
     {
         pthread_mutex_lock(&bc->buffer_lock);
         if (bucket == (uint32_t)(bc->curr) && pos >= bc->wbuf_start_pos)
         {
             uint32_t p = pos - bc->wbuf_start_pos;
-            r = decode_record(bc->write_buffer + p, bc->wbuf_curr_pos - p, true, "wbuf", pos, key, true, NULL);
+            r = decode_record(bc->write_buffer + p, bc->wbuf_curr_pos - p, decomp, "wbuf", pos, key, true, NULL);
         }
         else if (bucket == (uint32_t)(bc->flushing_bucket) && pos >= bc->fbuf_start_pos)
         {
@@ -1014,7 +1379,7 @@ DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_
                 return NULL;
             }
             uint32_t p = pos - bc->fbuf_start_pos;
-            r = decode_record(bc->flush_buffer + p, bc->fbuf_size - p, true, "fbuf", pos, key, true, NULL);
+            r = decode_record(bc->flush_buffer + p, bc->fbuf_size - p, decomp, "fbuf", pos, key, true, NULL);
         }
         pthread_mutex_unlock(&bc->buffer_lock);
 
@@ -1027,6 +1392,13 @@ DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_
 
     char datapath[MAX_PATH_LEN];
     gen_path(datapath, MAX_PATH_LEN, mgr_base(bc->mgr), DATA_FILE, bucket);
+    if (bc->maps[bucket] != NULL)
+    {
+        bool large = false;
+        r = read_mapped(bc, bucket, pos, decomp, datapath, key, stream != NULL ? stream_size : 0, &large);
+        if (!large)
+            goto READ_FAIL;
+    }
     if (maybe_tmp)
     {
         char tmp_path[MAX_PATH_LEN];
@@ -1035,7 +1407,7 @@ DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_
         if (-1 != tmp_fd)
         {
             log_debug("success to open TMP file %s (to get %s)", tmp_path, key);
-            r = fast_read_record(tmp_fd, pos, true, tmp_path, key);
+            r = fast_read_record(tmp_fd, mgr_disk_of(tmp_fd), pos, decomp, tmp_path, key);
             close(tmp_fd);
             if (NULL == r || strcmp(key, r->key) != 0)
             {
@@ -1065,14 +1437,17 @@ RETRY_READ:
     }
     else
     {
-        r = fast_read_record(fd, pos, true, datapath, key);
+        r = fast_read_record2(fd, bucket_disk(bc, bucket, fd), pos, decomp, datapath, key, stream_size, stream);
+        bc->reads[bucket]++; // racy but good enough to find the hot ones
+        if (stream != NULL && *stream != NULL)
+            return NULL; // it reads fd
         close(fd);
     }
 
     //get old pos before updating, but read file after updating, may happen if file is small
-    if(!maybe_tmp && (NULL == r || strcmp(key, r->key) != 0))
+    if(!maybe_tmp && bc->frozen == NULL && (NULL == r || strcmp(key, r->key) != 0))
     {
-        item = ht_get_withbuf(bc->tree, key, strlen(key), buf, true);
+        item = ht_get_withbuf(bc->tree, hk, buf, true);
         if (NULL != item)
         {
             int new_pos = item->pos & 0xffffff00;
@@ -1106,38 +1481,215 @@ READ_FAIL:
 
     if (r != NULL)
         r->version = item->ver;
-    else
-        ht_remove(bc->tree, key);
+    else if (bc->frozen == NULL)
+        ht_remove_key(bc->tree, hk);
     return r;
 }
 
-struct build_thread_args
+/*
+ * With decomp false, a record stored compressed is returned as it is, with
+ * COMPRESS_FLAG or DICT_FLAG set; the checksum is verified on the stored
+ * bytes anyway. The value of a record referring to a blob is always read.
+ */
+DataRecord* bc_get(Bitcask *bc, const HKey *hk, uint32_t *ret_pos, bool return_deleted, bool decomp)
 {
-    HTree *tree;
-    char *path;
+    return bc_get2(bc, hk, ret_pos, return_deleted, decomp, 0, NULL);
+}
+
+/*
+ * With stream, an uncompressed value of stream_size bytes or more in a data
+ * file is not read: NULL is returned and *stream is set to read it.
+ */
+DataRecord* bc_get2(Bitcask *bc, const HKey *hk, uint32_t *ret_pos, bool return_deleted, bool decomp,
+        uint32_t stream_size, RecordStream **stream)
+{
+    DataRecord *r = get_record(bc, hk, ret_pos, return_deleted, decomp, stream_size, stream);
+    if (r != NULL && (r->flag & DEDUP_FLAG))
+    {
+        unsigned int vlen = 0;
+        char *v = blob_get(bc->blobs, r->value, r->vsz, &vlen);
+        if (v == NULL)
+        {
+            log_error("read blob of %s failed", r->key);
+            free_record(&r);
+            return NULL;
+        }
+        if (r->free_value)
+            free(r->value);
+        r->value = v;
+        r->free_value = true;
+        r->vsz = vlen;
+        r->flag &= ~DEDUP_FLAG;
+    }
+    return r;
+}
+
+static inline uint32_t clip_range(uint32_t size, uint32_t from, uint32_t len)
+{
+    if (from >= size)
+        return 0;
+    return (len == 0 || len > size - from) ? size - from : len;
+}
+
+/*
+ * Read *len bytes of the value from byte from on (0 for the rest of it),
+ * set *len to the bytes read and *total to the size of the value. Only the
+ * header and the slice of a record in a data file are read, its checksum
+ * is not verified. Records in the buffers, being optimized or stored
+ * compressed are read whole.
+ */
+char *bc_get_range(Bitcask *bc, const HKey *hk, uint32_t from, unsigned int *len, uint32_t *total, uint32_t *flag)
+{
+    const char *key = hk->key;
+    if (!check_key(key, hk->ksz))
+        return NULL;
+
+    int maybe_tmp = 0;
+    char buf[512];
+    Item *item = find_item(bc, hk, &maybe_tmp, buf);
+    if (NULL == item || item->ver < 0)
+        return NULL;
+
+    uint32_t bucket = item->pos & 0xff;
+    uint32_t pos = item->pos & 0xffffff00;
+    if (!maybe_tmp && bucket < (uint32_t)(bc->curr) && bucket != (uint32_t)(bc->flushing_bucket))
+    {
+        char datapath[MAX_PATH_LEN];
+        gen_path(datapath, MAX_PATH_LEN, mgr_base(bc->mgr), DATA_FILE, bucket);
+        int fd = open(datapath, O_RDONLY);
+        int disk = fd >= 0 ? bucket_disk(bc, bucket, fd) : -1;
+        DataRecord *r = fd >= 0 ? fast_read_header(fd, disk, pos, datapath, key) : NULL;
+        if (r != NULL && strcmp(key, r->key) == 0
+                && (r->flag & (COMPRESS_FLAG | DICT_FLAG | DEDUP_FLAG)) == 0)
+        {
+            *total = r->vsz;
+            *flag = r->flag;
+            *len = clip_range(r->vsz, from, *len);
+            char *value = fast_read_value(fd, disk, pos, r, from, *len, datapath);
+            bc->reads[bucket]++;
+            free_record(&r);
+            close(fd);
+            if (value != NULL)
+                return value;
+        }
+        else
+        {
+            if (r != NULL) free_record(&r);
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    // the value of a record referring to a blob is read from the blob
+    uint32_t ret_pos = 0;
+    DataRecord *r = get_record(bc, hk, &ret_pos, false, true, 0, NULL);
+    if (r == NULL)
+        return NULL;
+    char *value = NULL;
+    *flag = r->flag & ~DEDUP_FLAG;
+    if (r->flag & DEDUP_FLAG)
+    {
+        *total = blob_size(r->value);
+        *len = clip_range(*total, from, *len);
+        value = blob_get_range(bc->blobs, r->value, from, *len);
+    }
+    else
+    {
+        *total = r->vsz;
+        *len = clip_range(r->vsz, from, *len);
+        value = (char*)try_malloc(max(*len, 1));
+        if (value != NULL)
+            memcpy(value, r->value + from, *len); // safe
+    }
+    free_record(&r);
+    return value;
+}
+
+static void flush_hint_log(Bitcask *bc, int bucket, const char *buf, uint32_t size)
+{
+    if (size == 0) return;
+
+    char path[MAX_PATH_LEN];
+    gen_path(path, MAX_PATH_LEN, mgr_base(bc->mgr), HINT_LOG, bucket);
+    FILE *f = fopen(path, "ab");
+    if (f == NULL)
+    {
+        log_error("open file %s for flushing failed. exit!", path);
+        exit(1);
+    }
+    double start = io_time();
+    size_t n = fwrite(buf, 1, size, f);
+    io_account(mgr_disk_of(fileno(f)), true, size, io_time() - start);
+    if (n < size)
+    {
+        log_error("write hint log failed: return %zu. exit!", n);
+        exit(1);
+    }
+    fclose(f);
+}
+
+// should be called with buffer_lock held
+static void append_hint(Bitcask *bc, const HKey *hk, uint32_t pos, uint16_t hash, int ver)
+{
+    uint32_t length = sizeof(HintRecord) - NAME_IN_RECORD + hk->ksz + 1;
+    if (bc->hbuf_curr_pos + length > bc->hbuf_size)
+    {
+        uint32_t size = bc->hbuf_size;
+        while (bc->hbuf_curr_pos + length > size)
+            size *= 2;
+        resize_hint_buffer(bc, size);
+    }
+
+    HintRecord *r = (HintRecord*)(bc->hint_buffer + bc->hbuf_curr_pos);
+    r->ksize = hk->ksz;
+    r->pos = pos >> 8;
+    r->version = ver;
+    r->hash = hash;
+    memcpy(r->key, hk->key, hk->ksz); // safe
+    r->key[hk->ksz] = 0;
+    bc->hbuf_curr_pos += length;
+}
+
+struct build_args
+{
+    int depth, pos, bucket;
+    char *logpath, *hintpath;
 };
 
-void *build_thread(void *param)
+static void build_task(void *param)
 {
-    pthread_detach(pthread_self());
-    struct build_thread_args *args = (struct build_thread_args*) param;
-    build_hint(args->tree, args->path);
-    free(args->path);
+    struct build_args *args = (struct build_args*) param;
+    io_set_class(IO_HINT);
+    build_hint_from_log(ht_new(args->depth, args->pos, true), args->bucket,
+            args->logpath, args->hintpath);
+    free(args->logpath);
+    free(args->hintpath);
     free(param);
-    return NULL;
 }
 
+/*
+ * Build the hint of a rotated bucket in the task pool, after all of
+ * its hint records have reached the log.
+ */
+static void start_build_hint(Bitcask *bc, int bucket)
+{
+    char logpath[MAX_PATH_LEN], hintpath[MAX_PATH_LEN];
+    struct build_args *args = (struct build_args*)safe_malloc(
+                                         sizeof(struct build_args));
+    args->depth = bc->depth;
+    args->pos = bc->pos;
+    args->bucket = bucket;
+    args->logpath = strdup(gen_path(logpath, MAX_PATH_LEN, mgr_base(bc->mgr), HINT_LOG, bucket));
+    args->hintpath = strdup(new_path(hintpath, MAX_PATH_LEN, bc->mgr, HINT_FILE, bucket));
+    tp_submit(TP_PRIO_HINT, build_task, args, NULL);
+}
+
+// should be called with buffer_lock held
 void bc_rotate(Bitcask *bc)
 {
-    // build in new thread
-    char datapath[MAX_PATH_LEN], hintpath[MAX_PATH_LEN];
-    new_path(hintpath, MAX_PATH_LEN, bc->mgr, HINT_FILE, bc->curr);
-    struct build_thread_args *args = (struct build_thread_args*)safe_malloc(
-                                         sizeof(struct build_thread_args));
-    args->tree = bc->curr_tree;
-    args->path = strdup(hintpath);
-    pthread_t build_ptid;
-    pthread_create(&build_ptid, NULL, build_thread, args);
+    char datapath[MAX_PATH_LEN];
+    // version updates of flushed records
+    flush_hint_log(bc, bc->curr, bc->hint_buffer, bc->hbuf_curr_pos);
+    bc->hbuf_curr_pos = 0;
 
     struct stat sb;
     if (stat(gen_path(datapath, MAX_PATH_LEN, mgr_base(bc->mgr), DATA_FILE, bc->curr), &sb) == 0)
@@ -1147,9 +1699,9 @@ void bc_rotate(Bitcask *bc)
     }
     // next bucket
     bc->curr++;
-    bc->curr_tree = ht_new(bc->depth, bc->pos, true);
     bc->wbuf_start_pos = 0;
     bc->curr_bytes = 0;
+    bc->curr_count = 0;
 }
 
 void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
@@ -1170,21 +1722,24 @@ void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
         bc->flushing_bucket = bc->curr;
         uint32_t size = bc->wbuf_curr_pos;
         bc->flush_buffer = (char*)safe_malloc(size);
+        mg_charge(mg_fbuf, size);
         memcpy(bc->flush_buffer, bc->write_buffer, size); // safe
         bc->fbuf_size = size;
+        uint32_t hsize = bc->hbuf_curr_pos;
+        char *hints = (char*)safe_malloc(hsize);
+        mg_charge(mg_fbuf, hsize);
+        memcpy(hints, bc->hint_buffer, hsize); // safe
+        bc->hbuf_curr_pos = 0;
 
         uint32_t last_pos = bc->wbuf_start_pos;
+        bool rotated = false;
         if (bc->wbuf_size < WRITE_BUFFER_SIZE)
         {
-            bc->wbuf_size *= 2;
-            free(bc->write_buffer);
-            bc->write_buffer = (char*)safe_malloc(bc->wbuf_size);
+            resize_write_buffer(bc, bc->wbuf_size * 2);
         }
         else if (bc->wbuf_size > WRITE_BUFFER_SIZE * 2)
         {
-            bc->wbuf_size = WRITE_BUFFER_SIZE;
-            free(bc->write_buffer);
-            bc->write_buffer = (char*)safe_malloc(bc->wbuf_size);
+            resize_write_buffer(bc, WRITE_BUFFER_SIZE);
         }
 
         bc->bytes += size;
@@ -1198,6 +1753,7 @@ void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
             log_notice("bitcask 0x%x bc_rotate after buffer write : curr %d -> %d, wbuf_size = %d, limit = %d, file size= %u, last_flush =  %d",
                     bc->pos, bc->curr, bc->curr+1, bc->wbuf_size, limit, bc->wbuf_start_pos, size);
             bc_rotate(bc);
+            rotated = true;
         }
         pthread_mutex_unlock(&bc->buffer_lock);
 
@@ -1218,7 +1774,9 @@ void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
             exit(1);
         }
 
+        double start = io_time();
         size_t n = fwrite(bc->flush_buffer, 1, size, f);
+        io_account(bucket_disk(bc, bc->flushing_bucket, fileno(f)), true, size, io_time() - start);
         if (n < size)
         {
             log_error("write failed: return %zu. exit!", n);
@@ -1232,8 +1790,16 @@ void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
         fclose(f);
         bc->last_flush_time = now;
 
+        // the hint log never runs ahead of the data
+        flush_hint_log(bc, bc->flushing_bucket, hints, hsize);
+        mg_charge(mg_fbuf, -(int64_t)hsize);
+        free(hints);
+        if (rotated)
+            start_build_hint(bc, bc->flushing_bucket);
+
         pthread_mutex_lock(&bc->buffer_lock);
         bc->flushing_bucket = -1;
+        mg_charge(mg_fbuf, -(int64_t)size);
         free(bc->flush_buffer);
         bc->flush_buffer = NULL;
     }
@@ -1242,12 +1808,46 @@ void bc_flush(Bitcask *bc, unsigned int limit, int flush_period)
     pthread_mutex_unlock(&bc->flush_lock);
 }
 
-bool bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, int version)
+/*
+ * Flush the pending records and shrink the write buffer back to
+ * the initial size, return the bytes released.
+ */
+size_t bc_shrink(Bitcask *bc)
+{
+    size_t released = 0;
+    uint32_t old_size = bc->wbuf_size;
+    bc_flush(bc, 0, 0); // may enlarge the buffer
+
+    pthread_mutex_lock(&bc->buffer_lock);
+    if (bc->wbuf_curr_pos == 0 && bc->wbuf_size > 1024 * 4)
+    {
+        resize_write_buffer(bc, 1024 * 4);
+        if (old_size > bc->wbuf_size)
+            released = old_size - bc->wbuf_size;
+    }
+    if (bc->hbuf_curr_pos == 0 && bc->hbuf_size > 1024 * 4)
+    {
+        released += bc->hbuf_size - 1024 * 4;
+        resize_hint_buffer(bc, 1024 * 4);
+    }
+    pthread_mutex_unlock(&bc->buffer_lock);
+    return released;
+}
+
+/*
+ * With cas > 0, the value is set only if the version of the key is still
+ * cas, with cas < 0 only if the key does not exist.
+ */
+static int set_record(Bitcask *bc, const HKey *hk, char *value, size_t vlen, int flag, int version, int cas)
 {
-    if ((version < 0 && vlen > 0) || vlen > MAX_VALUE_LEN || !check_key(key, strlen(key)))
+    const char *key = hk->key;
+    int ksz = hk->ksz;
+    if (bc->read_only)
+        return CAS_FAILED;
+    if ((version < 0 && vlen > 0) || vlen > MAX_VALUE_LEN || !check_key(key, ksz))
     {
         log_error("invalid set cmd, key %s, version %d, vlen %ld", key, version, vlen);
-        return false;
+        return CAS_FAILED;
     }
     else
     {
@@ -1255,16 +1855,32 @@ bool bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, in
             log_warn("set large value for key %s, version %d, vlen %ld", key, version, vlen);
     }
 
-    bool suc = false;
+    // hashing and storing a large value take no lock, a blob not used
+    // by the record is released at last
+    uint16_t hash = 0;
+    if (version >= 0)
+        hash = gen_hash(value, vlen);
+    char ref[BLOB_REF_SIZE];
+    bool deduped = version >= 0 && settings.dedup_size > 0 && vlen >= settings.dedup_size
+        && blob_put(bc->blobs, value, vlen, hash, ref);
+    bool appended = false;
+
+    int ret = CAS_FAILED;
     pthread_mutex_lock(&bc->write_lock);
 
     int oldv = 0, ver = version;
-    Item *it = ht_get(bc->tree, key);
+    Item *it = ht_get_key(bc->tree, hk);
     if (it != NULL)
     {
         oldv = it->ver;
     }
 
+    if ((cas > 0 && oldv != cas) || (cas < 0 && oldv > 0))
+    {
+        ret = oldv > 0 ? CAS_EXISTS : CAS_NOT_FOUND;
+        goto SET_FAIL;
+    }
+
     if (version == 0 && oldv > 0)  // replace
     {
         ver = oldv + 1;
@@ -1290,37 +1906,34 @@ bool bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, in
         ver = version;
     }
 
-    uint16_t hash = 0;
-    if (ver > 0)
-        hash = gen_hash(value, vlen);
-
     if (NULL != it && hash == it->hash)
     {
         uint32_t ret_pos = 0;
-        DataRecord *r = bc_get(bc, key, &ret_pos, false);
+        DataRecord *r = bc_get(bc, hk, &ret_pos, false, true);
         if (r != NULL && r->flag == flag && vlen  == r->vsz
                 && memcmp(value, r->value, vlen) == 0)
         {
             if (version != 0)
             {
                 // update version
+                pthread_mutex_lock(&bc->buffer_lock);
                 if ((it->pos & 0xff) == bc->curr)
                 {
-                    ht_add(bc->curr_tree, key, it->pos, it->hash, ver);
+                    append_hint(bc, hk, it->pos, it->hash, ver);
                 }
-                ht_add(bc->tree, key, it->pos, it->hash, ver);
+                pthread_mutex_unlock(&bc->buffer_lock);
+                ht_add_key(bc->tree, hk, it->pos, it->hash, ver);
             }
-            suc = true;
+            ret = CAS_STORED;
             free_record(&r);
             goto SET_FAIL;
         }
         if (r != NULL) free_record(&r);
     }
 
-    int klen = strlen(key);
-    DataRecord *r = (DataRecord*)safe_malloc(sizeof(DataRecord) + klen);
-    r->ksz = klen;
-    memcpy(r->key, key, klen); // safe
+    DataRecord *r = (DataRecord*)safe_malloc(sizeof(DataRecord) + ksz);
+    r->ksz = ksz;
+    memcpy(r->key, key, ksz); // safe
     r->vsz = vlen;
     r->value = value;
     r->free_value = false;
@@ -1328,12 +1941,25 @@ bool bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, in
     r->version = ver;
     r->tstamp = time(NULL);
 
+    if (deduped)
+    {
+        r->value = ref;
+        r->vsz = BLOB_REF_SIZE;
+        r->flag |= DEDUP_FLAG;
+    }
+    else if (ver > 0 && (flag & CLIENT_COMPRESS_FLAG) == 0)
+    {
+        dict_sample(bc->dict, value, vlen);
+        compress_record_dict(r, dict_current(bc->dict));
+    }
+
     unsigned int rlen;
     char *rbuf = encode_record(r, &rlen);
     if (rbuf == NULL || (rlen & 0xff) != 0)
     {
         log_error("encode_record() failed with %d", rlen);
         if (rbuf != NULL) free(rbuf);
+        free_record(&r);
         goto SET_FAIL;
     }
 
@@ -1345,39 +1971,54 @@ bool bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, in
         bc_flush(bc, 0, 0);//just to clear write_buffer so we can enlarge it
         pthread_mutex_lock(&bc->buffer_lock);
 
-        while (rlen > bc->wbuf_size)
-        {
-            bc->wbuf_size *= 2;
-            free(bc->write_buffer);
-            bc->write_buffer = (char*)safe_malloc(bc->wbuf_size);
-        }
+        uint32_t wbuf_size = bc->wbuf_size;
+        while (rlen > wbuf_size)
+            wbuf_size *= 2;
+        if (wbuf_size > bc->wbuf_size)
+            resize_write_buffer(bc, wbuf_size);
         if (bc->wbuf_start_pos + bc->wbuf_size > settings.max_bucket_size)
         {
             log_notice("bitcask 0x%x bc_rotate for large record: curr %d -> %d, record size = %d",
                     bc->pos, bc->curr, bc->curr+1, rlen);
             bc_rotate(bc);
+            start_build_hint(bc, bc->curr - 1);
         }
     }
     memcpy(bc->write_buffer + bc->wbuf_curr_pos, rbuf, rlen); // safe
     int pos = (bc->wbuf_start_pos + bc->wbuf_curr_pos) | bc->curr;
     bc->wbuf_curr_pos += rlen;
+    append_hint(bc, hk, pos, hash, ver);
+    // keys of the current bucket, not their updates
+    if (it == NULL || (it->pos & 0xff) != bc->curr)
+        bc->curr_count++;
     pthread_mutex_unlock(&bc->buffer_lock);
 
-    ht_add(bc->curr_tree, key, pos, hash, ver);
-    ht_add(bc->tree, key, pos, hash, ver);
-    suc = true;
+    ht_add_key(bc->tree, hk, pos, hash, ver);
+    ret = CAS_STORED;
+    appended = true;
     free(rbuf);
     free_record(&r);
 
 SET_FAIL:
     pthread_mutex_unlock(&bc->write_lock);
+    if (deduped && !appended) blob_release(bc->blobs, ref);
     if (it != NULL) free(it);
-    return suc;
+    return ret;
+}
+
+bool bc_set(Bitcask *bc, const HKey *hk, char *value, size_t vlen, int flag, int version)
+{
+    return set_record(bc, hk, value, vlen, flag, version, 0) == CAS_STORED;
+}
+
+int bc_cas(Bitcask *bc, const HKey *hk, char *value, size_t vlen, int flag, int cas)
+{
+    return set_record(bc, hk, value, vlen, flag, 0, cas);
 }
 
-bool bc_delete(Bitcask *bc, const char *key)
+bool bc_delete(Bitcask *bc, const HKey *hk)
 {
-    return bc_set(bc, key, "", 0, 0, -1);
+    return bc_set(bc, hk, "", 0, 0, -1);
 }
 
 uint16_t bc_get_hash(Bitcask *bc, const char *pos, unsigned int *count)
@@ -1394,13 +2035,59 @@ uint32_t   bc_count(Bitcask *bc, uint32_t *curr)
 {
     uint32_t total = 0;
     ht_get_hash(bc->tree, "@", &total);
-    if (NULL != curr && NULL != bc->curr_tree)
+    if (NULL != curr)
     {
-        ht_get_hash(bc->curr_tree, "@", curr);
+        *curr = bc->curr_count;
     }
     return total;
 }
 
+struct item_buf
+{
+    int size;
+    int curr;
+    char *buf;
+};
+
+#define ITEM_SIZE(it) ((sizeof(Item) + (it)->ksz + 7) & ~7)
+
+static void copy_item(Item *it, void *param)
+{
+    if (it->ver <= 0) return;
+
+    struct item_buf *p = (struct item_buf*)param;
+    int length = ITEM_SIZE(it);
+    while (p->size - p->curr < length)
+    {
+        p->size *= 2;
+        p->buf = (char*)safe_realloc(p->buf, p->size);
+    }
+    memcpy(p->buf + p->curr, it, sizeof(Item) + it->ksz); // safe
+    p->curr += length;
+}
+
+/*
+ * Call visitor on copies of the live items, so it can read or change
+ * the bitcask.
+ */
+void bc_visit(Bitcask *bc, fun_visitor visitor, void *param)
+{
+    struct item_buf p;
+    p.size = 64 * 1024;
+    p.curr = 0;
+    p.buf = (char*)safe_malloc(p.size);
+    ht_visit(bc->tree, copy_item, &p);
+
+    char *q = p.buf;
+    while (q < p.buf + p.curr)
+    {
+        Item *it = (Item*)q;
+        visitor(it, param);
+        q += ITEM_SIZE(it);
+    }
+    free(p.buf);
+}
+
 void bc_stat(Bitcask *bc, uint64_t *bytes)
 {
     if (bytes != NULL)
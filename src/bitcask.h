@@ -26,19 +26,36 @@
 
 typedef struct bitcask_t Bitcask;
 
+// results of bc_cas()
+#define CAS_FAILED      0
+#define CAS_STORED      1
+#define CAS_EXISTS      2   // the version is not the expected one
+#define CAS_NOT_FOUND   3
+// and of hs_append(), hs_incr()
+#define CAS_CONFLICT    4   // gave up, the key kept changing
+#define CAS_INVALID     5   // not a value to append to or to incr
+
 Bitcask*   bc_open(const char *path, int depth, int pos, time_t before);
-Bitcask*   bc_open2(Mgr *mgr, int depth, int pos, time_t before);
+Bitcask*   bc_open2(Mgr *mgr, int depth, int pos, time_t before, bool read_only);
 void       bc_scan(Bitcask *bc);
 void       bc_flush(Bitcask *bc, unsigned int limit, int period);
+size_t     bc_shrink(Bitcask *bc);
 void       bc_close(Bitcask *bc);
 void       bc_merge(Bitcask *bc);
 int        bc_optimize(Bitcask *bc, int limit);
-DataRecord* bc_get(Bitcask *bc, const char *key, uint32_t *ret_pos, bool return_deleted);
-bool       bc_set(Bitcask *bc, const char *key, char *value, size_t vlen, int flag, int version);
-bool       bc_delete(Bitcask *bc, const char *key);
+void       bc_stop_optimize(Bitcask *bc);
+void       bc_migrate(Bitcask *bc);
+DataRecord* bc_get(Bitcask *bc, const HKey *hk, uint32_t *ret_pos, bool return_deleted, bool decomp);
+DataRecord* bc_get2(Bitcask *bc, const HKey *hk, uint32_t *ret_pos, bool return_deleted, bool decomp,
+        uint32_t stream_size, RecordStream **stream);
+char*      bc_get_range(Bitcask *bc, const HKey *hk, uint32_t from, unsigned int *len, uint32_t *total, uint32_t *flag);
+bool       bc_set(Bitcask *bc, const HKey *hk, char *value, size_t vlen, int flag, int version);
+int        bc_cas(Bitcask *bc, const HKey *hk, char *value, size_t vlen, int flag, int cas);
+bool       bc_delete(Bitcask *bc, const HKey *hk);
 uint16_t   bc_get_hash(Bitcask *bc, const char *pos, unsigned int *count);
 char*      bc_list(Bitcask *bc, const char *pos, const char *prefix);
 uint32_t   bc_count(Bitcask *bc, uint32_t *curr);
+void       bc_visit(Bitcask *bc, fun_visitor visitor, void *param);
 void       bc_stat(Bitcask *bc, uint64_t *bytes);
 
 #endif
@@ -0,0 +1,641 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "blob.h"
+#include "sha256.h"
+#include "const.h"
+#include "util.h"
+#include "log.h"
+#include "memgov.h"
+#include "ioclass.h"
+#include "diskmgr.h"
+
+#define REFS_FILE "%s/refs"
+#define VERIFY_CHUNK (1U << 20) /* of a blob read at once to check it */
+
+#define BLOB_READY   0
+#define BLOB_WRITING 1      /* by the first put of it, the others wait */
+#define BLOB_FAILED  2      /* removed once the puts waiting release it */
+
+typedef struct blob_entry
+{
+    unsigned char sha[SHA256_SIZE];
+    uint32_t size;
+    uint32_t refs;
+    int state;
+    bool verified;          /* its content matched its sha256 once read */
+    struct blob_entry *next;
+} BlobEntry;
+
+struct blob_store
+{
+    pthread_mutex_t lock;
+    pthread_cond_t written;
+    Mgr *mgr;
+    char dir[MAX_PATH_LEN];
+    bool read_only, recount;
+    BlobEntry **table;
+    uint32_t nslots, count;
+    char *dropped;      // references to release when the optimization is done
+    uint32_t ndropped, dropped_size;
+};
+
+static int mg_blob = -1;
+static pthread_mutex_t mg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// of all the stores
+static uint64_t total_blobs, total_refs, total_stored, total_logical, total_hits;
+
+static inline uint32_t slot_of(const BlobStore *bs, const unsigned char *sha)
+{
+    uint32_t h;
+    memcpy(&h, sha, sizeof(h));
+    return h & (bs->nslots - 1);
+}
+
+static BlobEntry *find(BlobStore *bs, const unsigned char *sha)
+{
+    BlobEntry *e;
+    for (e = bs->table[slot_of(bs, sha)]; e != NULL; e = e->next)
+    {
+        if (memcmp(e->sha, sha, SHA256_SIZE) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void grow(BlobStore *bs)
+{
+    uint32_t i, old = bs->nslots;
+    BlobEntry **table = bs->table;
+    bs->nslots *= 2;
+    bs->table = (BlobEntry**)safe_malloc(sizeof(BlobEntry*) * bs->nslots);
+    memset(bs->table, 0, sizeof(BlobEntry*) * bs->nslots);
+    for (i = 0; i < old; i++)
+    {
+        BlobEntry *e = table[i], *next;
+        for (; e != NULL; e = next)
+        {
+            next = e->next;
+            uint32_t s = slot_of(bs, e->sha);
+            e->next = bs->table[s];
+            bs->table[s] = e;
+        }
+    }
+    free(table);
+    mg_charge(mg_blob, (int64_t)sizeof(BlobEntry*) * (bs->nslots - old));
+}
+
+static BlobEntry *add(BlobStore *bs, const unsigned char *sha, uint32_t size)
+{
+    if (bs->count >= bs->nslots * 2)
+        grow(bs);
+    BlobEntry *e = (BlobEntry*)safe_malloc(sizeof(BlobEntry));
+    memcpy(e->sha, sha, SHA256_SIZE);
+    e->size = size;
+    e->refs = 0;
+    e->state = BLOB_READY;
+    e->verified = false;
+    uint32_t s = slot_of(bs, sha);
+    e->next = bs->table[s];
+    bs->table[s] = e;
+    bs->count++;
+    mg_charge(mg_blob, sizeof(BlobEntry));
+    __sync_fetch_and_add(&total_blobs, 1);
+    __sync_fetch_and_add(&total_stored, size);
+    return e;
+}
+
+static void remove_entry(BlobStore *bs, BlobEntry *e)
+{
+    BlobEntry **p = &bs->table[slot_of(bs, e->sha)];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    bs->count--;
+    mg_charge(mg_blob, -(int64_t)sizeof(BlobEntry));
+    __sync_fetch_and_sub(&total_blobs, 1);
+    __sync_fetch_and_sub(&total_stored, e->size);
+    free(e);
+}
+
+static inline void add_ref(BlobEntry *e, int n)
+{
+    e->refs += n;
+    __sync_fetch_and_add(&total_refs, n);
+    __sync_fetch_and_add(&total_logical, (int64_t)n * e->size);
+}
+
+static char *blob_path(const BlobStore *bs, const unsigned char *sha, char *path, bool subdir)
+{
+    char hex[SHA256_SIZE * 2 + 1];
+    int i;
+    for (i = 0; i < SHA256_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", sha[i]);
+    if (subdir)
+        safe_snprintf(path, MAX_PATH_LEN, "%s/%.2s", bs->dir, hex);
+    else
+        safe_snprintf(path, MAX_PATH_LEN, "%s/%.2s/%s", bs->dir, hex, hex);
+    return path;
+}
+
+static bool parse_hex(const char *hex, unsigned char *sha)
+{
+    int i;
+    if (strlen(hex) != SHA256_SIZE * 2)
+        return false;
+    for (i = 0; i < SHA256_SIZE; i++)
+    {
+        unsigned int b;
+        if (sscanf(hex + i * 2, "%2x", &b) != 1)
+            return false;
+        sha[i] = b;
+    }
+    return true;
+}
+
+static void load_refs(BlobStore *bs)
+{
+    char path[MAX_PATH_LEN];
+    safe_snprintf(path, MAX_PATH_LEN, REFS_FILE, bs->dir);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        // written at close, so missing after a crash
+        bs->recount = access(bs->dir, F_OK) == 0;
+        return;
+    }
+
+    unsigned char sha[SHA256_SIZE];
+    uint32_t v[2];
+    while (fread(sha, 1, SHA256_SIZE, f) == SHA256_SIZE && fread(v, sizeof(uint32_t), 2, f) == 2)
+    {
+        if (find(bs, sha) == NULL)
+            add_ref(add(bs, sha, v[0]), v[1]);
+    }
+    fclose(f);
+    unlink(path);
+}
+
+static void save_refs(BlobStore *bs)
+{
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    safe_snprintf(path, MAX_PATH_LEN, REFS_FILE, bs->dir);
+    safe_snprintf(tmp, MAX_PATH_LEN, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        log_error("open %s failed", tmp);
+        return;
+    }
+    uint32_t i;
+    bool ok = true;
+    for (i = 0; i < bs->nslots && ok; i++)
+    {
+        BlobEntry *e;
+        for (e = bs->table[i]; e != NULL && ok; e = e->next)
+        {
+            uint32_t v[2] = {e->size, e->refs};
+            ok = fwrite(e->sha, 1, SHA256_SIZE, f) == SHA256_SIZE && fwrite(v, sizeof(uint32_t), 2, f) == 2;
+        }
+    }
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    if (!ok || rename(tmp, path) != 0)
+    {
+        log_error("write %s failed, blobs will be counted at next open", path);
+        unlink(tmp);
+    }
+}
+
+BlobStore *blob_open(Mgr *mgr, bool read_only)
+{
+    pthread_mutex_lock(&mg_lock);
+    if (mg_blob < 0)
+        mg_blob = mg_register("blob_refs", MG_PRIO_INDEX, NULL, NULL);
+    pthread_mutex_unlock(&mg_lock);
+
+    BlobStore *bs = (BlobStore*)safe_malloc(sizeof(BlobStore));
+    memset(bs, 0, sizeof(BlobStore));
+    pthread_mutex_init(&bs->lock, NULL);
+    pthread_cond_init(&bs->written, NULL);
+    bs->mgr = mgr;
+    safe_snprintf(bs->dir, MAX_PATH_LEN, "%s/blob", mgr_base(mgr));
+    bs->read_only = read_only;
+    bs->nslots = 1024;
+    bs->table = (BlobEntry**)safe_malloc(sizeof(BlobEntry*) * bs->nslots);
+    memset(bs->table, 0, sizeof(BlobEntry*) * bs->nslots);
+    mg_charge(mg_blob, sizeof(BlobEntry*) * bs->nslots);
+
+    // a reader only follows the references
+    if (!read_only)
+        load_refs(bs);
+    return bs;
+}
+
+void blob_close(BlobStore *bs)
+{
+    if (bs == NULL) return;
+    if (!bs->read_only && (bs->count > 0 || access(bs->dir, F_OK) == 0))
+        save_refs(bs);
+
+    uint32_t i;
+    for (i = 0; i < bs->nslots; i++)
+    {
+        while (bs->table[i] != NULL)
+        {
+            BlobEntry *e = bs->table[i];
+            add_ref(e, -(int)e->refs);
+            remove_entry(bs, e);
+        }
+    }
+    mg_charge(mg_blob, -(int64_t)sizeof(BlobEntry*) * bs->nslots);
+    free(bs->table);
+    free(bs->dropped);
+    pthread_cond_destroy(&bs->written);
+    pthread_mutex_destroy(&bs->lock);
+    free(bs);
+}
+
+/* make the directories of the blob at path, <dir>/blob/xx */
+static bool make_dirs(const char *path)
+{
+    char dir[MAX_PATH_LEN];
+    safe_snprintf(dir, MAX_PATH_LEN, "%s", path);
+    char *sub = strrchr(dir, '/');
+    *sub = '\0';
+    char *top = strrchr(dir, '/');
+    *top = '\0';
+    bool ok = mkdir(dir, 0750) == 0 || errno == EEXIST;
+    *top = '/';
+    ok = ok && (mkdir(dir, 0750) == 0 || errno == EEXIST);
+    if (!ok)
+        log_error("mkdir %s failed: %s", dir, strerror(errno));
+    return ok;
+}
+
+/*
+ * The disk of a new blob is picked by the Mgr as for a cold data file,
+ * off the fast tier which the mover keeps for the hot ones, and it is
+ * linked into the bitcask if not there.
+ */
+static bool write_blob(BlobStore *bs, const unsigned char *sha, const char *value, size_t vlen)
+{
+    char path[MAX_PATH_LEN], real[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    struct stat st;
+    if (stat(blob_path(bs, sha, path, false), &st) == 0 && (size_t)st.st_size == vlen)
+        return true;
+
+    const char *name = path + strlen(mgr_base(bs->mgr)) + 1;
+    if (!make_dirs(path))
+        return false;
+    safe_snprintf(real, MAX_PATH_LEN, "%s/%s", mgr_alloc_cold(bs->mgr, name), name);
+    if (strcmp(real, path) != 0 && !make_dirs(real))
+    {
+        mgr_unlink(path);
+        return false;
+    }
+    safe_snprintf(tmp, MAX_PATH_LEN, "%s.tmp", real);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0)
+    {
+        log_error("open %s failed: %s", tmp, strerror(errno));
+        mgr_unlink(path);
+        return false;
+    }
+    double start = io_time();
+    bool ok = write(fd, value, vlen) == (ssize_t)vlen && fsync(fd) == 0;
+    io_account(mgr_disk_of(fd), true, vlen, io_time() - start);
+    close(fd);
+    if (!ok || rename(tmp, real) != 0)
+    {
+        log_error("write %s failed", real);
+        unlink(tmp);
+        mgr_unlink(path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Called before the write lock of the bitcask is taken: the first put of
+ * a value writes it, and the others of the same value wait for it.
+ */
+bool blob_put(BlobStore *bs, const char *value, size_t vlen, uint16_t hash, char *ref)
+{
+    unsigned char sha[SHA256_SIZE];
+    uint32_t size = vlen;
+    if (bs == NULL || bs->read_only || vlen > UINT32_MAX)
+        return false;
+    sha256(value, vlen, sha);
+    memcpy(ref, sha, SHA256_SIZE);
+    memcpy(ref + SHA256_SIZE, &size, sizeof(uint32_t));
+    memcpy(ref + SHA256_SIZE + sizeof(uint32_t), &hash, sizeof(uint16_t));
+
+    pthread_mutex_lock(&bs->lock);
+    BlobEntry *e = find(bs, sha);
+    bool found = e != NULL;
+    if (!found)
+    {
+        e = add(bs, sha, size);
+        e->state = BLOB_WRITING;
+    }
+    add_ref(e, 1); // so the optimization can not remove it meanwhile
+    while (e->state == BLOB_WRITING && found)
+        pthread_cond_wait(&bs->written, &bs->lock);
+    int state = e->state;
+    pthread_mutex_unlock(&bs->lock);
+    if (found && state == BLOB_READY)
+    {
+        __sync_fetch_and_add(&total_hits, 1);
+        return true;
+    }
+
+    bool ok = found ? false : write_blob(bs, sha, value, vlen);
+    if (!found)
+    {
+        pthread_mutex_lock(&bs->lock);
+        e->state = ok ? BLOB_READY : BLOB_FAILED;
+        pthread_cond_broadcast(&bs->written);
+        pthread_mutex_unlock(&bs->lock);
+    }
+    if (!ok)
+        blob_release(bs, ref);
+    return ok;
+}
+
+static bool is_verified(BlobStore *bs, const char *ref)
+{
+    pthread_mutex_lock(&bs->lock);
+    BlobEntry *e = find(bs, (const unsigned char*)ref);
+    bool verified = e != NULL && e->verified;
+    pthread_mutex_unlock(&bs->lock);
+    return verified;
+}
+
+static void set_verified(BlobStore *bs, const char *ref)
+{
+    pthread_mutex_lock(&bs->lock);
+    BlobEntry *e = find(bs, (const unsigned char*)ref);
+    if (e != NULL)
+        e->verified = true;
+    pthread_mutex_unlock(&bs->lock);
+}
+
+/* hash the whole content of the blob, a chunk at a time */
+static bool verify_blob(int fd, const char *ref, const char *path)
+{
+    unsigned char sha[SHA256_SIZE];
+    uint32_t size = blob_size(ref), off = 0;
+    char *buf = (char*)try_malloc(VERIFY_CHUNK);
+    if (buf == NULL)
+        return false;
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    while (off < size)
+    {
+        uint32_t len = min(size - off, VERIFY_CHUNK);
+        double start = io_time();
+        ssize_t n = pread(fd, buf, len, off);
+        io_account(mgr_disk_of(fd), false, len, io_time() - start);
+        if (n != (ssize_t)len)
+        {
+            log_error("read blob %s failed: %zd != %u", path, n, len);
+            free(buf);
+            return false;
+        }
+        sha256_update(&ctx, buf, len);
+        off += len;
+    }
+    free(buf);
+    sha256_final(&ctx, sha);
+    return memcmp(sha, ref, SHA256_SIZE) == 0;
+}
+
+char *blob_get(BlobStore *bs, const char *ref, unsigned int rlen, unsigned int *vlen)
+{
+    if (rlen != BLOB_REF_SIZE)
+        return NULL;
+    *vlen = blob_size(ref);
+    return blob_get_range(bs, ref, 0, *vlen);
+}
+
+char *blob_get_range(BlobStore *bs, const char *ref, uint32_t from, uint32_t len)
+{
+    char path[MAX_PATH_LEN];
+    if (bs == NULL)
+        return NULL;
+
+    blob_path(bs, (const unsigned char*)ref, path, false);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        log_error("open blob %s failed: %s", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != blob_size(ref))
+    {
+        log_error("blob %s is broken: size %lld != %u", path, (long long)st.st_size, blob_size(ref));
+        close(fd);
+        return NULL;
+    }
+    // a whole value is checked as read, a slice after the first check of the whole
+    bool whole = from == 0 && len == blob_size(ref);
+    if (!whole && !is_verified(bs, ref))
+    {
+        if (!verify_blob(fd, ref, path))
+        {
+            log_error("blob %s is broken: sha256 mismatch", path);
+            close(fd);
+            return NULL;
+        }
+        set_verified(bs, ref);
+    }
+    char *value = (char*)try_malloc(max(len, 1));
+    double start = io_time();
+    ssize_t n = value != NULL ? pread(fd, value, len, from) : -1;
+    io_account(mgr_disk_of(fd), false, len, io_time() - start);
+    close(fd);
+    if (n != (ssize_t)len)
+    {
+        log_error("read blob %s failed: %zd != %u", path, n, len);
+        free(value);
+        return NULL;
+    }
+    if (whole)
+    {
+        unsigned char sha[SHA256_SIZE];
+        sha256(value, len, sha);
+        if (memcmp(sha, ref, SHA256_SIZE) != 0)
+        {
+            log_error("blob %s is broken: sha256 mismatch", path);
+            free(value);
+            return NULL;
+        }
+        set_verified(bs, ref);
+    }
+    return value;
+}
+
+void blob_release(BlobStore *bs, const char *ref)
+{
+    char path[MAX_PATH_LEN];
+    if (bs == NULL || bs->read_only) return;
+    pthread_mutex_lock(&bs->lock);
+    BlobEntry *e = find(bs, (const unsigned char*)ref);
+    if (e != NULL && e->refs > 0)
+    {
+        add_ref(e, -1);
+        if (e->refs == 0)
+        {
+            // under the lock, so a put of the same value waits for it
+            if (e->state == BLOB_READY)
+                mgr_unlink(blob_path(bs, e->sha, path, false));
+            remove_entry(bs, e);
+        }
+    }
+    pthread_mutex_unlock(&bs->lock);
+}
+
+void blob_drop(BlobStore *bs, const char *ref)
+{
+    if (bs == NULL || bs->read_only) return;
+    pthread_mutex_lock(&bs->lock);
+    if (bs->ndropped == bs->dropped_size)
+    {
+        bs->dropped_size = max(bs->dropped_size * 2, 64);
+        bs->dropped = (char*)safe_realloc(bs->dropped, (size_t)bs->dropped_size * BLOB_REF_SIZE);
+    }
+    memcpy(bs->dropped + (size_t)bs->ndropped * BLOB_REF_SIZE, ref, BLOB_REF_SIZE);
+    bs->ndropped++;
+    pthread_mutex_unlock(&bs->lock);
+}
+
+void blob_commit(BlobStore *bs)
+{
+    if (bs == NULL) return;
+    uint32_t i;
+    for (i = 0; i < bs->ndropped; i++)
+        blob_release(bs, bs->dropped + (size_t)i * BLOB_REF_SIZE);
+    blob_discard(bs);
+}
+
+void blob_discard(BlobStore *bs)
+{
+    if (bs == NULL) return;
+    pthread_mutex_lock(&bs->lock);
+    bs->ndropped = 0;
+    if (bs->dropped_size > 4096)
+    {
+        free(bs->dropped);
+        bs->dropped = NULL;
+        bs->dropped_size = 0;
+    }
+    pthread_mutex_unlock(&bs->lock);
+}
+
+uint32_t blob_size(const char *ref)
+{
+    uint32_t size;
+    memcpy(&size, ref + SHA256_SIZE, sizeof(uint32_t));
+    return size;
+}
+
+uint16_t blob_hash(const char *ref)
+{
+    uint16_t hash;
+    memcpy(&hash, ref + SHA256_SIZE + sizeof(uint32_t), sizeof(uint16_t));
+    return hash;
+}
+
+bool blob_need_recount(BlobStore *bs)
+{
+    return bs != NULL && bs->recount;
+}
+
+void blob_recount(BlobStore *bs, const char *ref)
+{
+    uint32_t size;
+    memcpy(&size, ref + SHA256_SIZE, sizeof(uint32_t));
+    pthread_mutex_lock(&bs->lock);
+    BlobEntry *e = find(bs, (const unsigned char*)ref);
+    if (e == NULL)
+        e = add(bs, (const unsigned char*)ref, size);
+    add_ref(e, 1);
+    pthread_mutex_unlock(&bs->lock);
+}
+
+/* remove the blobs no record refers to, left by a crash */
+void blob_sweep(BlobStore *bs)
+{
+    char path[MAX_PATH_LEN], sub[MAX_PATH_LEN];
+    unsigned char sha[SHA256_SIZE];
+    int removed = 0;
+    DIR *dp = opendir(bs->dir);
+    if (dp == NULL) return;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (strlen(de->d_name) != 2 || !isxdigit((unsigned char)de->d_name[0])
+                || !isxdigit((unsigned char)de->d_name[1]))
+            continue;
+        safe_snprintf(sub, MAX_PATH_LEN, "%s/%s", bs->dir, de->d_name);
+        DIR *sp = opendir(sub);
+        if (sp == NULL) continue;
+        struct dirent *se;
+        while ((se = readdir(sp)) != NULL)
+        {
+            if (se->d_name[0] == '.')
+                continue;
+            pthread_mutex_lock(&bs->lock);
+            bool orphan = !parse_hex(se->d_name, sha) || find(bs, sha) == NULL;
+            pthread_mutex_unlock(&bs->lock);
+            if (orphan)
+            {
+                safe_snprintf(path, MAX_PATH_LEN, "%s/%s", sub, se->d_name);
+                mgr_unlink(path);
+                removed++;
+            }
+        }
+        (void) closedir(sp);
+    }
+    (void) closedir(dp);
+    bs->recount = false;
+    log_notice("blobs in %s counted again: %u blobs, %d removed", bs->dir, bs->count, removed);
+}
+
+int blob_stat(char *buf, int size)
+{
+    int n = 0;
+    uint64_t stored = total_stored, logical = total_logical;
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_blobs %"PRIu64"\r\n", total_blobs);
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_refs %"PRIu64"\r\n", total_refs);
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_hits %"PRIu64"\r\n", total_hits);
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_bytes %"PRIu64"\r\n", logical);
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_stored_bytes %"PRIu64"\r\n", stored);
+    n += safe_snprintf(buf + n, size - n, "STAT dedup_ratio %.2f\r\n", stored > 0 ? (double)logical / stored : 1.0);
+    return n;
+}
@@ -0,0 +1,68 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __BLOB_H__
+#define __BLOB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskmgr.h"
+
+/*
+ * Blob store: with -D, the large values of a bitcask are stored once per
+ * content, as <bitcask>/blob/xx/<sha256> on a disk picked by the Mgr
+ * (linked there if on another one), and their records only keep a
+ * reference (BLOB_REF_SIZE bytes: sha256, size and the hash of the value
+ * for the hints).
+ *
+ * A blob counts the records referring to it, live or not: a new record
+ * adds one, and the optimization removes one for every record it drops.
+ * The counts are saved at close, and counted again from the data files
+ * after a crash.
+ */
+
+#define BLOB_REF_SIZE 38
+
+typedef struct blob_store BlobStore;
+
+BlobStore *blob_open(Mgr *mgr, bool read_only);
+void       blob_close(BlobStore *bs);
+
+/* write the reference of the value into ref, storing it if it is new */
+bool       blob_put(BlobStore *bs, const char *value, size_t vlen, uint16_t hash, char *ref);
+/*
+ * the value referred by ref, it should be freed. NULL if the blob does
+ * not match its sha256, checked on every whole read, and on the first
+ * slice read of it since opened.
+ */
+char      *blob_get(BlobStore *bs, const char *ref, unsigned int rlen, unsigned int *vlen);
+/* len bytes of it from from on, which should be within its size */
+char      *blob_get_range(BlobStore *bs, const char *ref, uint32_t from, uint32_t len);
+void       blob_release(BlobStore *bs, const char *ref);
+uint32_t   blob_size(const char *ref);
+uint16_t   blob_hash(const char *ref);
+
+/* the records dropped by an optimization are released once it is done */
+void       blob_drop(BlobStore *bs, const char *ref);
+void       blob_commit(BlobStore *bs);
+void       blob_discard(BlobStore *bs);
+
+/* counting again: true if needed, then add every reference and sweep */
+bool       blob_need_recount(BlobStore *bs);
+void       blob_recount(BlobStore *bs, const char *ref);
+void       blob_sweep(BlobStore *bs);
+
+int        blob_stat(char *buf, int size);
+
+#endif
@@ -4,6 +4,8 @@ struct settings settings = {16};
 void settings_init(void)
 {
     settings.port = 7900;
+    settings.udpport = 0;
+    settings.socketpath = NULL;
     /* By default this string should be NULL for getaddrinfo() */
     settings.inter = NULL;
     settings.item_buf_size = 4 * 1024;     /* default is 4KB */
@@ -16,5 +18,14 @@ void settings_init(void)
     settings.max_bucket_size  = (uint32_t)(4000 << 20); // 4G
     settings.check_file_size = false;
     settings.autolink = true;
+    settings.max_memory = 0;
+    settings.max_pending = 0;
+    settings.max_queue_wait = 0;
+    settings.max_inflight = 0;
+    settings.io_read_latency = 0;
+    settings.bg_threads = 2;
+    settings.shared_nothing = false;
+    settings.hot_sample = 16;
+    settings.dedup_size = 0;
 }
 
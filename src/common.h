@@ -62,6 +62,8 @@ struct settings
     size_t item_buf_size;
     int maxconns;
     int port;
+    int udpport;
+    char *socketpath;   /* path of unix domain socket, NULL means off */
     char *inter;
     int verbose;
     float slow_cmd_time;
@@ -70,6 +72,15 @@ struct settings
     uint32_t max_bucket_size;
     bool check_file_size;
     bool autolink;
+    uint64_t max_memory;    /* in bytes, 0 means unlimited */
+    int max_pending;        /* ready events queued per worker, 0 means unlimited */
+    float max_queue_wait;   /* shed storage commands queued longer than it, 0 means never */
+    int max_inflight;       /* storage operations running per disk, 0 means unlimited */
+    uint32_t io_read_latency; /* in ms, throttle flush and gc over it, 0 means never */
+    int bg_threads;         /* workers building hint files at the same time */
+    bool shared_nothing;    /* every worker owns a slice of the bitcasks */
+    int hot_sample;         /* track one in it gets and sets for the hot keys, 0 means never */
+    uint32_t dedup_size;    /* values at least this large are stored once per content, 0 means never */
 };
 extern int daemon_quit;
 extern struct settings settings;
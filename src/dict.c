@@ -0,0 +1,754 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dict.h"
+#include "fnv1a.h"
+#include "const.h"
+#include "util.h"
+#include "log.h"
+#include "memgov.h"
+#include "taskpool.h"
+
+#define DICT_SAMPLE_RATE  8             /* one value in it is sampled */
+#define DICT_SAMPLE_BYTES (64 * 1024)   /* samples to train a dictionary from */
+#define DICT_RETRAIN      3600          /* in secs, between two trainings of a bitcask */
+#define DICT_MAX_VERSIONS 999
+#define DICT_GAIN         0.95          /* a new dictionary should save 5% more */
+#define DICT_MIN_SIZE     256
+
+#define HASH_BITS   12      /* of the match finder */
+#define MIN_MATCH   4
+#define KMER        6       /* substrings counted by the training */
+#define KMER_BITS   16
+#define SEGMENT     64      /* substrings copied into a dictionary */
+#define TABLE_BYTES (sizeof(uint16_t) << HASH_BITS)
+
+#define REGISTRY_INIT     1024  /* slots of the registry at first */
+#define DICT_MAX_TRAINED  8192  /* no more are trained once so many are registered */
+
+struct dictionary
+{
+    uint32_t id;
+    int size;
+    int refs;           // of the trainers holding it, under registry_lock
+    uint16_t *table;    // last position + 1 of a 4 byte prefix, only to compress
+    char content[DICT_SIZE];
+};
+
+struct dict_trainer
+{
+    pthread_mutex_t lock;
+    char dir[MAX_PATH_LEN];
+    bool read_only;
+    Dict *current;
+    int version;
+    time_t trained;
+    uint32_t ticks;
+    char *samples;      // values prefixed by 2 bytes of length
+    int used;
+    bool training, closed;
+    Dict **held;        // loaded or trained, released when closed
+    int nheld, held_size;
+};
+
+typedef struct
+{
+    uint32_t id;
+    Dict *dict;         // NULL if never used, REMOVED once released
+} Slot;
+
+/*
+ * The dictionaries of the open bitcasks by id, open addressing. Lookups
+ * take no lock: a table is replaced, not resized, when it gets half
+ * full, and the replaced ones are kept as a lookup may still be in them,
+ * they take less than the last one.
+ */
+typedef struct registry
+{
+    uint32_t size, used;    // used slots, removed ones included
+    struct registry *replaced;
+    Slot slots[];
+} Registry;
+
+#define REMOVED ((Dict*)1)
+
+static Registry *volatile registry = NULL;
+static int registered = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mg_dict = -1;
+
+static inline uint32_t hash4(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline uint32_t kmer_hash(const char *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, KMER);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - KMER_BITS));
+}
+
+static Dict *dict_find(uint32_t id)
+{
+    Registry *reg = registry;
+    if (reg == NULL)
+        return NULL;
+    uint32_t i;
+    Dict *d;
+    for (i = id % reg->size; (d = reg->slots[i].dict) != NULL; i = (i + 1) % reg->size)
+    {
+        if (d != REMOVED && reg->slots[i].id == id)
+            return d;
+    }
+    return NULL;
+}
+
+static inline size_t dict_bytes(const Dict *d)
+{
+    return sizeof(Dict) + (d->table != NULL ? TABLE_BYTES : 0);
+}
+
+static void free_dict(Dict *d)
+{
+    free(d->table);
+    free(d);
+}
+
+static void put_slot(Registry *reg, Dict *d)
+{
+    uint32_t i = d->id % reg->size;
+    while (reg->slots[i].dict != NULL)
+        i = (i + 1) % reg->size;
+    reg->slots[i].id = d->id;
+    __sync_synchronize();   // readers do not lock
+    reg->slots[i].dict = d;
+    reg->used++;
+}
+
+// should be called with registry_lock held, the removed slots are dropped
+static void replace_registry(void)
+{
+    Registry *old = registry;
+    uint32_t i, size = REGISTRY_INIT;
+    while ((uint32_t)(registered + 1) * 4 > size)
+        size *= 2;
+    Registry *reg = (Registry*)safe_malloc(sizeof(Registry) + sizeof(Slot) * size);
+    memset(reg, 0, sizeof(Registry) + sizeof(Slot) * size);
+    reg->size = size;
+    reg->replaced = old;
+    for (i = 0; old != NULL && i < old->size; i++)
+    {
+        if (old->slots[i].dict != NULL && old->slots[i].dict != REMOVED)
+            put_slot(reg, old->slots[i].dict);
+    }
+    mg_charge(mg_dict, sizeof(Registry) + sizeof(Slot) * size);
+    __sync_synchronize();
+    registry = reg;
+}
+
+/*
+ * Return the registered one with the same content, holding a reference
+ * to it. NULL on conflict, or for a trained one when too many are.
+ */
+static Dict *dict_register(Dict *d, bool trained)
+{
+    pthread_mutex_lock(&registry_lock);
+    Dict *old = dict_find(d->id);
+    if (old != NULL || (trained && registered >= DICT_MAX_TRAINED))
+    {
+        if (old != NULL && (old->size != d->size || memcmp(old->content, d->content, d->size) != 0))
+        {
+            log_error("dictionary id %08x conflicts", d->id);
+            old = NULL;
+        }
+        if (old != NULL)
+            old->refs++;
+        pthread_mutex_unlock(&registry_lock);
+        free_dict(d);
+        return old;
+    }
+    if (registry == NULL || (registry->used + 1) * 2 > registry->size)
+        replace_registry();
+    d->refs = 1;
+    put_slot(registry, d);
+    registered++;
+    mg_charge(mg_dict, dict_bytes(d));
+    pthread_mutex_unlock(&registry_lock);
+    return d;
+}
+
+/*
+ * Nothing refers to a dictionary no open bitcask holds, so it is not
+ * looked up any more.
+ */
+static void dict_release(Dict *d)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (--d->refs == 0)
+    {
+        Registry *reg = registry;
+        uint32_t i = d->id % reg->size;
+        while (reg->slots[i].dict != d)
+            i = (i + 1) % reg->size;
+        reg->slots[i].dict = REMOVED;
+        registered--;
+        mg_charge(mg_dict, -(int64_t)dict_bytes(d));
+        free_dict(d);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void index_dict(Dict *d)
+{
+    d->table = NULL;
+    d->id = fnv1a(d->content, d->size);
+}
+
+static void build_table(Dict *d)
+{
+    int i;
+    d->table = (uint16_t*)safe_malloc(TABLE_BYTES);
+    memset(d->table, 0, TABLE_BYTES);
+    for (i = 0; i + MIN_MATCH <= d->size; i++)
+        d->table[hash4(d->content + i)] = i + 1;
+}
+
+/* only the dictionaries compressing need the table */
+static void use_dict(Dict *d)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (d->table == NULL)
+    {
+        build_table(d);
+        mg_charge(mg_dict, TABLE_BYTES);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/* lengths from 15 go on in the following bytes, as in LZ4 */
+static inline unsigned char *put_length(unsigned char *op, int len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* literals then a match, the last sequence has no match (offset 0) */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const char *lit, int nlit, int offset, int mlen)
+{
+    int ml = offset > 0 ? mlen - MIN_MATCH : 0;
+    if (oend - op < 1 + nlit + nlit / 255 + 1 + 2 + ml / 255 + 1)
+        return NULL;
+    *op++ = (min(nlit, 15) << 4) | min(ml, 15);
+    if (nlit >= 15)
+        op = put_length(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (offset > 0)
+    {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (ml >= 15)
+            op = put_length(op, ml);
+    }
+    return op;
+}
+
+static inline int get_length(const unsigned char **ip, const unsigned char *iend)
+{
+    int len = 0;
+    unsigned char c;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        c = *(*ip)++;
+        len += c;
+    } while (c == 255);
+    return len;
+}
+
+/*
+ * Greedy LZ77 over the dictionary followed by the value, the positions
+ * of the dictionary are indexed in advance.
+ */
+int dict_compress(const Dict *d, const char *src, int n, char *dst, int cap)
+{
+    char buf[DICT_SIZE + DICT_MAX_VALUE];
+    uint16_t table[1 << HASH_BITS];
+    if (n > DICT_MAX_VALUE || cap < DICT_HEADER)
+        return -1;
+
+    memcpy(buf, d->content, d->size);
+    memcpy(buf + d->size, src, n);
+    memcpy(table, d->table, TABLE_BYTES);
+
+    uint16_t size = n;
+    memcpy(dst, &d->id, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), &size, sizeof(uint16_t));
+    unsigned char *op = (unsigned char*)dst + DICT_HEADER, *oend = (unsigned char*)dst + cap;
+
+    int ip = d->size, anchor = ip, end = d->size + n;
+    while (ip + MIN_MATCH <= end)
+    {
+        uint32_t h = hash4(buf + ip);
+        int ref = table[h] - 1;
+        table[h] = ip + 1;
+        if (ref < 0 || memcmp(buf + ref, buf + ip, MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        int len = MIN_MATCH;
+        while (ip + len < end && buf[ref + len] == buf[ip + len])
+            len++;
+        op = put_sequence(op, oend, buf + anchor, ip - anchor, ip - ref, len);
+        if (op == NULL)
+            return -1;
+
+        int stop = ip + len;
+        for (ip++; ip < stop && ip + MIN_MATCH <= end; ip++)
+            table[hash4(buf + ip)] = ip + 1;
+        ip = anchor = stop;
+    }
+    op = put_sequence(op, oend, buf + anchor, end - anchor, 0, 0);
+    return op == NULL ? -1 : (int)((char*)op - dst);
+}
+
+char *dict_decompress(const char *src, int n, unsigned int *size)
+{
+    char buf[DICT_SIZE + DICT_MAX_VALUE];
+    uint32_t id;
+    uint16_t raw;
+    if (n < DICT_HEADER)
+        return NULL;
+    memcpy(&id, src, sizeof(uint32_t));
+    memcpy(&raw, src + sizeof(uint32_t), sizeof(uint16_t));
+
+    Dict *d = dict_find(id);
+    if (d == NULL)
+    {
+        log_error("unknown dictionary %08x", id);
+        return NULL;
+    }
+    if (raw > DICT_MAX_VALUE)
+        return NULL;
+
+    memcpy(buf, d->content, d->size);
+    int op = d->size, oend = d->size + raw;
+    const unsigned char *ip = (const unsigned char*)src + DICT_HEADER;
+    const unsigned char *iend = (const unsigned char*)src + n;
+    while (ip < iend)
+    {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15)
+        {
+            int more = get_length(&ip, iend);
+            if (more < 0) return NULL;
+            lit += more;
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return NULL;
+        memcpy(buf + op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return NULL;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15)
+        {
+            int more = get_length(&ip, iend);
+            if (more < 0) return NULL;
+            mlen += more;
+        }
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > oend - op)
+            return NULL;
+        int i;
+        for (i = 0; i < mlen; i++, op++)
+            buf[op] = buf[op - offset];     // may overlap
+    }
+    if (op != oend)
+        return NULL;
+
+    char *v = (char*)safe_malloc(max(raw, 1));
+    memcpy(v, buf + d->size, raw);
+    *size = raw;
+    return v;
+}
+
+/*
+ * Pick the segments of the samples whose substrings are found in the
+ * most samples, and forget those substrings once picked, so that the
+ * dictionary covers as much as it can.
+ */
+static Dict *train(const char *samples, int used)
+{
+    uint32_t *counts = (uint32_t*)safe_malloc(sizeof(uint32_t) << KMER_BITS);
+    uint32_t *seen = (uint32_t*)safe_malloc(sizeof(uint32_t) << KMER_BITS);
+    memset(counts, 0, sizeof(uint32_t) << KMER_BITS);
+    memset(seen, 0, sizeof(uint32_t) << KMER_BITS);
+    int maxcand = used / (SEGMENT / 2) + used / (2 + DICT_MIN_VALUE) + 1;
+    int *cands = (int*)safe_malloc(sizeof(int) * 2 * maxcand);
+
+    int off, i, j, ncand = 0;
+    uint32_t n = 0;
+    uint16_t len;
+    for (off = 0; off + 2 <= used; off += 2 + len)
+    {
+        memcpy(&len, samples + off, sizeof(uint16_t));
+        const char *v = samples + off + 2;
+        n++;
+        for (i = 0; i + KMER <= len; i++)
+        {
+            uint32_t h = kmer_hash(v + i);
+            if (seen[h] != n)
+            {
+                seen[h] = n;
+                counts[h]++;
+            }
+        }
+        for (i = 0; i + KMER <= len && ncand < maxcand; i += SEGMENT / 2)
+        {
+            cands[ncand * 2] = off + 2 + i;
+            cands[ncand * 2 + 1] = min(SEGMENT, len - i);
+            ncand++;
+        }
+    }
+
+    Dict *d = (Dict*)safe_malloc(sizeof(Dict));
+    int filled = 0;
+    while (filled + KMER <= DICT_SIZE)
+    {
+        int best = -1;
+        uint64_t best_score = 0;
+        for (i = 0; i < ncand; i++)
+        {
+            const char *seg = samples + cands[i * 2];
+            uint64_t score = 0;
+            for (j = 0; j + KMER <= cands[i * 2 + 1]; j++)
+            {
+                uint32_t c = counts[kmer_hash(seg + j)];
+                if (c > 1)
+                    score += c;
+            }
+            if (score > best_score)
+            {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best < 0)
+            break;
+
+        const char *seg = samples + cands[best * 2];
+        int seglen = cands[best * 2 + 1];
+        int size = min(seglen, DICT_SIZE - filled);
+        // the best ones are at the end, nearest to the values
+        memcpy(d->content + DICT_SIZE - filled - size, seg, size);
+        filled += size;
+        for (j = 0; j + KMER <= seglen; j++)
+            counts[kmer_hash(seg + j)] = 0;
+        cands[best * 2 + 1] = 0;
+    }
+    free(counts);
+    free(seen);
+    free(cands);
+
+    if (filled < DICT_MIN_SIZE)
+    {
+        free(d);
+        return NULL;
+    }
+    memmove(d->content, d->content + DICT_SIZE - filled, filled);
+    d->size = filled;
+    index_dict(d);
+    build_table(d);
+    return d;
+}
+
+/* bytes taken by the samples when compressed by d */
+static uint64_t sample_cost(const Dict *d, const char *samples, int used)
+{
+    char out[DICT_MAX_VALUE];
+    uint64_t total = 0;
+    int off;
+    uint16_t len;
+    for (off = 0; off + 2 <= used; off += 2 + len)
+    {
+        memcpy(&len, samples + off, sizeof(uint16_t));
+        int size = d != NULL ? dict_compress(d, samples + off + 2, len, out, len) : -1;
+        total += size < 0 ? len : size;
+    }
+    return total;
+}
+
+static bool save_dict(const char *dir, int version, const Dict *d)
+{
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    if (0 != access(dir, F_OK) && 0 != mkdir(dir, 0750))
+    {
+        log_error("mkdir %s failed", dir);
+        return false;
+    }
+    safe_snprintf(path, MAX_PATH_LEN, "%s/%03d.dict", dir, version);
+    safe_snprintf(tmp, MAX_PATH_LEN, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        log_error("open %s failed", tmp);
+        return false;
+    }
+    uint32_t size = d->size;
+    bool ok = fwrite(&d->id, sizeof(uint32_t), 1, f) == 1
+              && fwrite(&size, sizeof(uint32_t), 1, f) == 1
+              && fwrite(d->content, 1, size, f) == size
+              && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    if (!ok || rename(tmp, path) != 0)
+    {
+        log_error("write %s failed", path);
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static Dict *load_dict(const char *path, time_t *mtime)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    struct stat st;
+    uint32_t id, size;
+    Dict *d = (Dict*)safe_malloc(sizeof(Dict));
+    bool ok = fstat(fileno(f), &st) == 0
+              && fread(&id, sizeof(uint32_t), 1, f) == 1
+              && fread(&size, sizeof(uint32_t), 1, f) == 1
+              && size <= DICT_SIZE && fread(d->content, 1, size, f) == size;
+    fclose(f);
+    if (ok)
+    {
+        d->size = size;
+        index_dict(d);
+        ok = d->id == id;
+    }
+    if (!ok)
+    {
+        free(d);
+        return NULL;
+    }
+    *mtime = st.st_mtime;
+    return dict_register(d, false);
+}
+
+// the reference from dict_register() is released with the trainer
+static void hold(DictTrainer *t, Dict *d)
+{
+    if (t->nheld == t->held_size)
+    {
+        t->held_size = t->held_size > 0 ? t->held_size * 2 : 16;
+        t->held = (Dict**)safe_realloc(t->held, sizeof(Dict*) * t->held_size);
+    }
+    t->held[t->nheld++] = d;
+}
+
+static void free_trainer(DictTrainer *t)
+{
+    int i;
+    if (t->samples != NULL)
+    {
+        free(t->samples);
+        mg_charge(mg_dict, -DICT_SAMPLE_BYTES);
+    }
+    for (i = 0; i < t->nheld; i++)
+        dict_release(t->held[i]);
+    free(t->held);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+DictTrainer *dict_open(const char *dir, bool read_only)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (mg_dict < 0)
+        mg_dict = mg_register("dict", MG_PRIO_INDEX, NULL, NULL);
+    pthread_mutex_unlock(&registry_lock);
+
+    DictTrainer *t = (DictTrainer*)safe_malloc(sizeof(DictTrainer));
+    memset(t, 0, sizeof(DictTrainer));
+    pthread_mutex_init(&t->lock, NULL);
+    safe_snprintf(t->dir, MAX_PATH_LEN, "%s", dir);
+    t->read_only = read_only;
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL)
+        return t;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL)
+    {
+        char *end, path[MAX_PATH_LEN];
+        long version = strtol(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".dict") != 0)
+            continue;
+
+        time_t mtime;
+        safe_snprintf(path, MAX_PATH_LEN, "%s/%s", dir, de->d_name);
+        Dict *d = load_dict(path, &mtime);
+        if (d == NULL)
+        {
+            log_error("load dictionary %s failed", path);
+            continue;
+        }
+        hold(t, d);
+        if (version > t->version)
+        {
+            t->version = version;
+            t->current = d;
+            t->trained = mtime;
+        }
+    }
+    (void) closedir(dp);
+    if (t->current != NULL)
+        use_dict(t->current);
+    return t;
+}
+
+void dict_close(DictTrainer *t)
+{
+    if (t == NULL) return;
+    pthread_mutex_lock(&t->lock);
+    bool training = t->training;
+    t->closed = true;
+    pthread_mutex_unlock(&t->lock);
+    // or the training frees it when done
+    if (!training)
+        free_trainer(t);
+}
+
+Dict *dict_current(DictTrainer *t)
+{
+    return t != NULL ? t->current : NULL;
+}
+
+static void train_task(void *arg)
+{
+    DictTrainer *t = (DictTrainer*)arg;
+    Dict *d = train(t->samples, t->used);
+    if (d != NULL)
+    {
+        uint64_t before = sample_cost(t->current, t->samples, t->used);
+        uint64_t after = sample_cost(d, t->samples, t->used);
+        if (after < before * DICT_GAIN && !t->closed)
+        {
+            d = dict_register(d, true);
+            if (d != NULL)
+            {
+                pthread_mutex_lock(&t->lock);
+                hold(t, d);
+                pthread_mutex_unlock(&t->lock);
+                use_dict(d);
+            }
+            if (d != NULL && save_dict(t->dir, t->version + 1, d))
+            {
+                log_notice("new dictionary %s/%03d.dict, %d bytes, samples %d -> %llu (was %llu)",
+                           t->dir, t->version + 1, d->size, t->used,
+                           (unsigned long long)after, (unsigned long long)before);
+                pthread_mutex_lock(&t->lock);
+                t->current = d;
+                t->version++;
+                pthread_mutex_unlock(&t->lock);
+            }
+        }
+        else
+        {
+            free_dict(d);
+        }
+    }
+
+    pthread_mutex_lock(&t->lock);
+    free(t->samples);
+    mg_charge(mg_dict, -DICT_SAMPLE_BYTES);
+    t->samples = NULL;
+    t->used = 0;
+    t->training = false;
+    t->trained = time(NULL);
+    bool closed = t->closed;
+    pthread_mutex_unlock(&t->lock);
+    if (closed)
+        free_trainer(t);
+}
+
+/*
+ * Called with the write lock of the bitcask held. When the samples are
+ * enough, a dictionary is trained from them in the task pool, at most
+ * once in DICT_RETRAIN secs.
+ */
+void dict_sample(DictTrainer *t, const char *value, int vlen)
+{
+    if (t == NULL || t->read_only || vlen < DICT_MIN_VALUE || vlen > DICT_MAX_VALUE)
+        return;
+    if (++t->ticks % DICT_SAMPLE_RATE != 0)
+        return;
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&t->lock);
+    if (t->training || t->version >= DICT_MAX_VERSIONS || registered >= DICT_MAX_TRAINED
+            || (t->trained > 0 && now - t->trained < DICT_RETRAIN))
+        goto SAMPLE_END;
+
+    if (t->samples == NULL)
+    {
+        if (!mg_admit(DICT_SAMPLE_BYTES))
+            goto SAMPLE_END;
+        t->samples = (char*)safe_malloc(DICT_SAMPLE_BYTES);
+        mg_charge(mg_dict, DICT_SAMPLE_BYTES);
+        t->used = 0;
+    }
+    if (t->used + 2 + vlen > DICT_SAMPLE_BYTES)
+    {
+        t->training = true;
+        tp_submit(TP_PRIO_HINT, train_task, t, NULL);
+        goto SAMPLE_END;
+    }
+    uint16_t len = vlen;
+    memcpy(t->samples + t->used, &len, sizeof(uint16_t));
+    memcpy(t->samples + t->used + 2, value, vlen);
+    t->used += 2 + vlen;
+
+SAMPLE_END:
+    pthread_mutex_unlock(&t->lock);
+}
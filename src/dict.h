@@ -0,0 +1,52 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __DICT_H__
+#define __DICT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Compression dictionaries for small values, which QuickLZ can not
+ * compress alone. Every bitcask samples the values written to it, and
+ * trains a dictionary of their common substrings in the task pool. The
+ * values are then compressed by an LZ77 coder which can refer into the
+ * dictionary.
+ *
+ * A compressed value starts with the id of its dictionary (a hash of the
+ * content), so it can be decoded without knowing its bitcask. The
+ * dictionaries are saved as <bitcask>/dict/NNN.dict, versioned, and are
+ * never removed, so the old records stay readable. In memory, they are
+ * kept while a bitcask having them is open.
+ */
+
+#define DICT_SIZE        4096   /* max bytes of a dictionary */
+#define DICT_MIN_VALUE   32     /* smaller values are not worth it */
+#define DICT_MAX_VALUE   4096   /* larger values are left to QuickLZ */
+#define DICT_HEADER      6      /* id and size of the original value */
+
+typedef struct dictionary Dict;
+typedef struct dict_trainer DictTrainer;
+
+/* load the dictionaries in dir, sample and train new ones unless read_only */
+DictTrainer *dict_open(const char *dir, bool read_only);
+void         dict_close(DictTrainer *t);
+void         dict_sample(DictTrainer *t, const char *value, int vlen);
+Dict        *dict_current(DictTrainer *t);
+
+/* return the size written to dst, or -1 if it needs more than cap bytes */
+int   dict_compress(const Dict *d, const char *src, int n, char *dst, int cap);
+/* decode with the dictionary named in src, the result should be freed */
+char *dict_decompress(const char *src, int n, unsigned int *size);
+
+#endif
@@ -16,6 +16,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <libgen.h>
@@ -32,6 +35,122 @@
 
 #include "const.h"
 #include "log.h"
+#include "common.h"
+#include "ioclass.h"
+
+#define MAX_LOADS       64
+#define SAMPLE_PERIOD   1.0     /* seconds between two samples of the load */
+#define LOAD_WEIGHT     0.5     /* score lost by the busiest disk, against free space */
+#define ALLOC_COST      0.2     /* busy share of a file allocated recently */
+#define RELOCATE_UTIL   0.3     /* only relocate off disks busy this share of time */
+#define RELOCATE_RATIO  2.0     /* ... and this many times busier than the target */
+#define COPY_BUF_SIZE   (1 << 20)
+
+typedef struct
+{
+    dev_t    dev;
+    char     path[MAX_PATH_LEN];    /* the first directory seen on it */
+    uint64_t read_ops, read_bytes, write_ops, write_bytes, usecs;
+    uint64_t allocs, relocated, migrated;
+    volatile uint32_t latency;      /* us per op, moving average */
+    /* sampled under load_lock */
+    uint64_t last_usecs;
+    double   util;                  /* share of the time busy, moving average */
+    double   recent;                /* files allocated lately, decays every sample */
+} DiskLoad;
+
+static DiskLoad loads[MAX_LOADS];
+static volatile int nloads = 0;
+static double last_sample = 0;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int find_load(dev_t dev)
+{
+    int i, n = nloads;
+    for (i = 0; i < n; i++)
+    {
+        if (loads[i].dev == dev)
+            return i;
+    }
+    return -1;
+}
+
+static int register_load(const char *path)
+{
+    struct stat sb;
+    if (stat(path, &sb) != 0)
+        return -1;
+
+    pthread_mutex_lock(&load_lock);
+    int i = find_load(sb.st_dev);
+    if (i < 0 && nloads < MAX_LOADS)
+    {
+        i = nloads;
+        loads[i].dev = sb.st_dev;
+        safe_snprintf(loads[i].path, MAX_PATH_LEN, "%s", path);
+        __sync_synchronize(); // filled before readers can see it
+        nloads = i + 1;
+    }
+    pthread_mutex_unlock(&load_lock);
+    return i;
+}
+
+static void sample_loads(void)
+{
+    double now = io_time();
+    pthread_mutex_lock(&load_lock);
+    double elapsed = now - last_sample;
+    if (elapsed >= SAMPLE_PERIOD)
+    {
+        int i;
+        for (i = 0; i < nloads; i++)
+        {
+            DiskLoad *d = &loads[i];
+            uint64_t usecs = d->usecs;
+            double util = (usecs - d->last_usecs) / 1e6 / elapsed;
+            d->util = last_sample == 0 ? util : (d->util + util) / 2;
+            d->recent /= 2;
+            d->last_usecs = usecs;
+        }
+        last_sample = now;
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+static inline double busy_of(int load)
+{
+    return load < 0 ? 0 : loads[load].util + loads[load].recent * ALLOC_COST;
+}
+
+int mgr_disk_of(int fd)
+{
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0)
+        return -1;
+    return find_load(sb.st_dev);
+}
+
+void mgr_account(int disk, bool write, size_t bytes, double secs)
+{
+    if (disk < 0) return;
+    DiskLoad *d = &loads[disk];
+    uint32_t us = secs * 1e6;
+    if (write)
+    {
+        __sync_add_and_fetch(&d->write_ops, 1);
+        __sync_add_and_fetch(&d->write_bytes, bytes);
+    }
+    else
+    {
+        __sync_add_and_fetch(&d->read_ops, 1);
+        __sync_add_and_fetch(&d->read_bytes, bytes);
+    }
+    if (us > 0)
+    {
+        __sync_add_and_fetch(&d->usecs, us);
+        d->latency = (d->latency * 7 + us) / 8; // racy but good enough for an average
+    }
+}
 
 ssize_t mgr_readlink(const char *path, char *buf, size_t bufsiz)
 {
@@ -72,12 +191,19 @@ Mgr *mgr_create(const char **disks, int ndisks)
     Mgr *mgr = (Mgr*) safe_malloc(sizeof(Mgr));
     mgr->ndisks = ndisks;
     mgr->disks = (char**)safe_malloc(sizeof(char*) * ndisks);
+    mgr->loads = (int*)safe_malloc(sizeof(int) * ndisks);
+    mgr->tiers = (int*)safe_malloc(sizeof(int) * ndisks);
+    mgr->tiered = false;
     int i;
     for (i = 0; i < ndisks; i++)
     {
         if (0 != access(disks[i], F_OK) && 0 != mkdir(disks[i], 0755))
         {
             log_error("access %s failed", disks[i]);
+            while (--i >= 0)
+                free(mgr->disks[i]);
+            free(mgr->loads);
+            free(mgr->tiers);
             free(mgr->disks);
             free(mgr);
             free(cwd);
@@ -92,6 +218,8 @@ Mgr *mgr_create(const char **disks, int ndisks)
             mgr->disks[i] =  (char*)safe_malloc(strlen(disks[i]) + strlen(cwd) + 2);
             sprintf(mgr->disks[i], "%s/%s", cwd, disks[i]);  //safe
         }
+        mgr->loads[i] = register_load(mgr->disks[i]);
+        mgr->tiers[i] = TIER_SLOW;
     }
     free(cwd);
     return mgr;
@@ -104,6 +232,8 @@ void mgr_destroy(Mgr *mgr)
     {
         free(mgr->disks[i]);
     }
+    free(mgr->loads);
+    free(mgr->tiers);
     free(mgr->disks);
     free(mgr);
 }
@@ -129,16 +259,27 @@ get_disk_avail(const char *path, uint64_t *total)
     return stat.f_bavail * stat.f_frsize;
 }
 
-const char *mgr_alloc(Mgr *mgr, const char *name)
+/*
+ * Pick the disk for a new file: the fast tier while it has room for two
+ * buckets, then the free space counts first, then how busy the disk is,
+ * including the files put on it lately which are not written yet. A disk
+ * without room for a whole bucket is only used when all of them are that
+ * full. A cold file (a blob) keeps off the fast tier, and it is written
+ * at once, so it is not counted as coming.
+ */
+static const char *alloc_disk(Mgr *mgr, const char *name, bool cold)
 {
     if (mgr->ndisks == 1)
     {
         return mgr->disks[0];
     }
-    uint64_t maxa= 0;
+    uint64_t maxa = 0, avail[mgr->ndisks];
+    double maxb = 0;
+    bool roomy = false, fast = false;
     int maxi = 0, i;
     char path[MAX_PATH_LEN];
     struct stat sb;
+    sample_loads();
     for (i = 0; i< mgr->ndisks; i++)
     {
         safe_snprintf(path, MAX_PATH_LEN, "%s/%s", mgr->disks[i], name);
@@ -146,13 +287,40 @@ const char *mgr_alloc(Mgr *mgr, const char *name)
         {
             return mgr->disks[i];
         }
-        uint64_t avail = get_disk_avail(mgr->disks[i], NULL);
-        if (avail > maxa || (avail == maxa && (rand() & 1) == 1) )
+        avail[i] = get_disk_avail(mgr->disks[i], NULL);
+        maxa = max(maxa, avail[i]);
+        maxb = max(maxb, busy_of(mgr->loads[i]));
+        if (avail[i] >= settings.max_bucket_size)
+            roomy = true;
+        if (!cold && mgr->tiers[i] == TIER_FAST && avail[i] >= 2 * (uint64_t)settings.max_bucket_size)
+            fast = true;
+    }
+    double best = -1;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        if (roomy && avail[i] < settings.max_bucket_size)
+            continue;
+        if (fast && mgr->tiers[i] != TIER_FAST)
+            continue;
+        if (cold && mgr->tiered && mgr->tiers[i] == TIER_FAST)
+            continue;
+        double score = maxa > 0 ? (double)avail[i] / maxa : 1;
+        if (maxb > 0)
+            score -= LOAD_WEIGHT * busy_of(mgr->loads[i]) / maxb;
+        if (score > best || (score == best && (rand() & 1) == 1))
         {
-            maxa = avail;
+            best = score;
             maxi = i;
         }
     }
+    if (!cold && mgr->loads[maxi] >= 0)
+    {
+        DiskLoad *d = &loads[mgr->loads[maxi]];
+        pthread_mutex_lock(&load_lock);
+        d->recent += 1;
+        d->allocs++;
+        pthread_mutex_unlock(&load_lock);
+    }
     if (maxi != 0)
     {
         // create symlink
@@ -172,6 +340,264 @@ const char *mgr_alloc(Mgr *mgr, const char *name)
     return mgr->disks[maxi];
 }
 
+const char *mgr_alloc(Mgr *mgr, const char *name)
+{
+    return alloc_disk(mgr, name, false);
+}
+
+const char *mgr_alloc_cold(Mgr *mgr, const char *name)
+{
+    return alloc_disk(mgr, name, true);
+}
+
+static bool copy_file(const char *src, const char *dst, const struct stat *st)
+{
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return false;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    int in_disk = mgr_disk_of(in), out_disk = mgr_disk_of(out);
+    char *buf = (char*)safe_malloc(COPY_BUF_SIZE);
+    for (;;)
+    {
+        io_throttle();
+        double start = io_time();
+        ssize_t n = read(in, buf, COPY_BUF_SIZE);
+        io_account(in_disk, false, max(n, 0), io_time() - start);
+        if (n <= 0)
+        {
+            ok = n == 0;
+            break;
+        }
+        start = io_time();
+        if (write(out, buf, n) != n)
+        {
+            ok = false;
+            break;
+        }
+        io_account(out_disk, true, n, io_time() - start);
+    }
+    free(buf);
+
+    struct timespec times[2] = {st->st_atim, st->st_mtim}; // GC looks at the mtime
+    if (ok && (fsync(out) != 0 || futimens(out, times) != 0))
+        ok = false;
+    close(in);
+    close(out);
+    return ok;
+}
+
+/* the disk of mgr holding the real file, -1 if none */
+static int disk_of(Mgr *mgr, const char *real)
+{
+    int i;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        size_t len = strlen(mgr->disks[i]);
+        if (strncmp(real, mgr->disks[i], len) == 0 && real[len] == '/'
+                && strchr(real + len + 1, '/') == NULL)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Copy the file to disks[dst], then switch its path in disks[0] to the
+ * copy atomically. Readers open the file by that path, and the ones
+ * having the old copy open keep reading it until they close it.
+ */
+static bool move_file(Mgr *mgr, const char *name, const char *path, const char *real,
+                      const struct stat *st, int dst)
+{
+    char tmp[MAX_PATH_LEN], target[MAX_PATH_LEN];
+    safe_snprintf(target, MAX_PATH_LEN, "%s/%s", mgr->disks[dst], name);
+    safe_snprintf(tmp, MAX_PATH_LEN, "%s.reloc", target);
+    if (!copy_file(real, tmp, st))
+    {
+        log_error("copy %s to %s failed: %s", real, tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    if (dst == 0)
+    {
+        // replaces the symlink
+        if (rename(tmp, path) != 0)
+        {
+            log_error("rename failed: %s -> %s, err: %s", tmp, path, strerror(errno));
+            unlink(tmp);
+            return false;
+        }
+    }
+    else
+    {
+        char link[MAX_PATH_LEN];
+        safe_snprintf(link, MAX_PATH_LEN, "%s.reloc", path);
+        unlink(link);
+        if (rename(tmp, target) != 0 || symlink(target, link) != 0 || rename(link, path) != 0)
+        {
+            log_error("switch %s to %s failed, err: %s", path, target, strerror(errno));
+            unlink(link);
+            unlink(target);
+            return false;
+        }
+    }
+    if (strcmp(real, path) != 0)
+        unlink(real);
+    return true;
+}
+
+/* the path of name in disks[0] and the file it links to */
+static bool resolve(Mgr *mgr, const char *name, char *path, char *real, struct stat *st)
+{
+    safe_snprintf(path, MAX_PATH_LEN, "%s/%s", mgr->disks[0], name);
+    if (lstat(path, st) != 0)
+        return false;
+    if ((st->st_mode & S_IFMT) == S_IFLNK)
+    {
+        if (mgr_readlink(path, real, MAX_PATH_LEN) <= 0)
+            return false;
+    }
+    else
+    {
+        safe_snprintf(real, MAX_PATH_LEN, "%s", path);
+    }
+    return stat(real, st) == 0;
+}
+
+/*
+ * Move the sealed file `name` to another disk of the same tier, when its
+ * disk is busy and much busier than the other one.
+ */
+bool mgr_relocate(Mgr *mgr, const char *name)
+{
+    if (mgr->ndisks == 1)
+        return false;
+
+    char path[MAX_PATH_LEN], real[MAX_PATH_LEN];
+    struct stat st;
+    if (!resolve(mgr, name, path, real, &st))
+        return false;
+
+    sample_loads();
+    int from = disk_of(mgr, real);
+    int src = find_load(st.st_dev);
+    double src_busy = busy_of(src);
+    if (from < 0 || src < 0 || loads[src].util < RELOCATE_UTIL)
+        return false;
+
+    int i, dst = -1;
+    double best = src_busy / RELOCATE_RATIO;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        int load = mgr->loads[i];
+        if (load < 0 || load == src || mgr->tiers[i] != mgr->tiers[from] || busy_of(load) >= best)
+            continue;
+        if (get_disk_avail(mgr->disks[i], NULL) < (uint64_t)st.st_size + settings.max_bucket_size)
+            continue;
+        best = busy_of(load);
+        dst = i;
+    }
+    if (dst < 0)
+        return false;
+
+    log_notice("mgr_relocate %s -> %s, busy %.2f -> %.2f", real, mgr->disks[dst], src_busy, best);
+    if (!move_file(mgr, name, path, real, &st, dst))
+        return false;
+    __sync_add_and_fetch(&loads[src].relocated, 1);
+    return true;
+}
+
+int mgr_parse_tier(char *path)
+{
+    char *tag = strrchr(path, '@');
+    if (tag == NULL)
+        return TIER_SLOW;
+    int tier = strcmp(tag, "@fast") == 0 ? TIER_FAST : strcmp(tag, "@slow") == 0 ? TIER_SLOW : -1;
+    if (tier >= 0)
+        *tag = 0;
+    return tier < 0 ? TIER_SLOW : tier;
+}
+
+void mgr_set_tiers(Mgr *mgr, const int *tiers)
+{
+    int i, fast = 0;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        mgr->tiers[i] = tiers[i];
+        if (tiers[i] == TIER_FAST)
+            fast++;
+    }
+    mgr->tiered = fast > 0 && fast < mgr->ndisks;
+}
+
+int mgr_tier_of(Mgr *mgr, const char *name)
+{
+    char path[MAX_PATH_LEN], real[MAX_PATH_LEN];
+    struct stat st;
+    if (!resolve(mgr, name, path, real, &st))
+        return -1;
+    int i = disk_of(mgr, real);
+    return i < 0 ? -1 : mgr->tiers[i];
+}
+
+bool mgr_tier_room(Mgr *mgr, int tier, uint64_t need)
+{
+    int i;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        if (mgr->tiers[i] == tier && get_disk_avail(mgr->disks[i], NULL) >= need)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Move the sealed file `name` to the least busy disk of `tier` which has
+ * room for it and a few more buckets.
+ */
+bool mgr_migrate(Mgr *mgr, const char *name, int tier)
+{
+    char path[MAX_PATH_LEN], real[MAX_PATH_LEN];
+    struct stat st;
+    if (!mgr->tiered || !resolve(mgr, name, path, real, &st))
+        return false;
+    int from = disk_of(mgr, real);
+    if (from < 0 || mgr->tiers[from] == tier)
+        return false;
+
+    sample_loads();
+    int i, dst = -1;
+    double best = 0;
+    for (i = 0; i < mgr->ndisks; i++)
+    {
+        if (mgr->tiers[i] != tier)
+            continue;
+        if (get_disk_avail(mgr->disks[i], NULL) < (uint64_t)st.st_size + 2 * settings.max_bucket_size)
+            continue;
+        if (dst < 0 || busy_of(mgr->loads[i]) < best)
+        {
+            best = busy_of(mgr->loads[i]);
+            dst = i;
+        }
+    }
+    if (dst < 0)
+        return false;
+
+    log_notice("mgr_migrate %s -> %s", real, mgr->disks[dst]);
+    if (!move_file(mgr, name, path, real, &st, dst))
+        return false;
+    if (mgr->loads[dst] >= 0)
+        __sync_add_and_fetch(&loads[mgr->loads[dst]].migrated, 1);
+    return true;
+}
+
 void _mgr_unlink(const char *path, const char *file, int line, const char *func)
 {
     struct stat sb;
@@ -243,3 +669,36 @@ void mgr_stat(Mgr *mgr, uint64_t *total, uint64_t *avail)
         *total += t;
     }
 }
+
+/* the stats of one disk take less, the path line included */
+#define LOAD_STAT_SIZE (MAX_PATH_LEN + 12 * 64)
+
+int mgr_load_stat_size(void)
+{
+    return nloads * LOAD_STAT_SIZE;
+}
+
+/* the disks registered since the size was taken are skipped */
+int mgr_load_stat(char *buf, int size)
+{
+    int i, n = 0;
+    sample_loads();
+    for (i = 0; i < nloads && size - n >= LOAD_STAT_SIZE; i++)
+    {
+        DiskLoad *d = &loads[i];
+        uint64_t total = 0, avail = get_disk_avail(d->path, &total);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_path %s\r\n", i, d->path);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_read_ops %"PRIu64"\r\n", i, d->read_ops);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_read_bytes %"PRIu64"\r\n", i, d->read_bytes);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_write_ops %"PRIu64"\r\n", i, d->write_ops);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_write_bytes %"PRIu64"\r\n", i, d->write_bytes);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_latency_us %u\r\n", i, d->latency);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_util %.3f\r\n", i, d->util);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_allocs %"PRIu64"\r\n", i, d->allocs);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_relocated %"PRIu64"\r\n", i, d->relocated);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_migrated_in %"PRIu64"\r\n", i, d->migrated);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_avail %"PRIu64"\r\n", i, avail);
+        n += safe_snprintf(buf + n, size - n, "STAT disk_%d_total %"PRIu64"\r\n", i, total);
+    }
+    return n;
+}
@@ -17,12 +17,19 @@
 #define __DISKMGR_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "util.h"
 
+#define TIER_SLOW   0
+#define TIER_FAST   1
+
 typedef struct disk_mgr
 {
     char **disks;
     int ndisks;
+    int *loads;     /* the load of each disk, -1 if unknown */
+    int *tiers;     /* TIER_SLOW unless tagged */
+    bool tiered;    /* has disks of both tiers */
 } Mgr;
 
 Mgr *mgr_create(const char **disks, int ndisks);
@@ -31,6 +38,7 @@ ssize_t mgr_readlink(const char *path, char *buf, size_t bufsiz);
 
 const char *mgr_base(Mgr *mgr);
 const char *mgr_alloc(Mgr *mgr, const char *path);
+const char *mgr_alloc_cold(Mgr *mgr, const char *path);
 
 #define mgr_unlink(X)  _mgr_unlink(X, __FILE__, __LINE__, __FUNCTION__)
 void _mgr_unlink(const char *path, const char *file, int line, const char *func);
@@ -39,6 +47,30 @@ void mgr_rename(const char *oldpath, const char *newpath);
 
 void mgr_stat(Mgr *mgr, uint64_t *total, uint64_t *avail);
 
+/*
+ * Disk load: the I/O on every physical disk (by st_dev), shared by all the
+ * Mgrs having a directory on it. New files go to the disk with the best
+ * mix of free space and idleness, and busy disks can hand their hot files
+ * over to idle ones.
+ */
+int  mgr_disk_of(int fd);
+void mgr_account(int disk, bool write, size_t bytes, double secs);
+bool mgr_relocate(Mgr *mgr, const char *name);
+int  mgr_load_stat_size(void);
+int  mgr_load_stat(char *buf, int size);
+
+/*
+ * Tiers: a directory tagged "@fast" (e.g. /nvme/beansdb@fast) gets the new
+ * files while it has room, the sealed ones are moved between the tiers as
+ * they become cold or hot. The files are always opened by their path in
+ * disks[0], so lookups do not care where they are.
+ */
+int  mgr_parse_tier(char *path);
+void mgr_set_tiers(Mgr *mgr, const int *tiers);
+int  mgr_tier_of(Mgr *mgr, const char *name);
+bool mgr_tier_room(Mgr *mgr, int tier, uint64_t need);
+bool mgr_migrate(Mgr *mgr, const char *name, int tier);
+
 static inline char *simple_basename(const char *path)
 {
     char *p = (char*)path + strlen(path);
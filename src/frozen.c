@@ -0,0 +1,191 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "frozen.h"
+#include "memgov.h"
+#include "util.h"
+#include "log.h"
+
+#define MAX_RADIX_BITS 16
+#define RADIX_LOAD     8        /* keys per radix slot at least */
+#define ITEM_SIZE(ksz) ((sizeof(Item) + (ksz) + 3) & ~(size_t)3)
+
+struct frozen_index
+{
+    size_t   count;
+    int      shift, bits;   /* the radix is bits of the hash after the leading shift bits */
+    uint32_t *radix;        /* (1 << bits) + 1 first indexes of the slots */
+    uint32_t *hashes;       /* sorted */
+    uint32_t *offsets;      /* of the items in the arena, in the same order */
+    char     *arena;
+    size_t   size;          /* in bytes, all included */
+};
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t off;
+} Entry;
+
+struct collect_args
+{
+    Entry  *entries;
+    size_t count, cap;
+    char   *arena;
+    size_t used, size;
+    bool   overflow;    /* the offsets would not fit in 32 bits */
+};
+
+static int mg_frozen = -1;
+static __thread const char *sort_arena;
+
+static void collect(Item *it, void *param)
+{
+    struct collect_args *a = (struct collect_args*)param;
+    size_t len = ITEM_SIZE(it->ksz);
+    if (a->overflow || a->used + len > UINT32_MAX)
+    {
+        a->overflow = true;
+        return;
+    }
+    if (a->count == a->cap)
+    {
+        a->cap = a->cap > 0 ? a->cap * 2 : 1024;
+        a->entries = (Entry*)safe_realloc(a->entries, sizeof(Entry) * a->cap);
+    }
+    if (a->used + len > a->size)
+    {
+        a->size = a->size > 0 ? a->size * 2 : 64 * 1024;
+        a->arena = (char*)safe_realloc(a->arena, a->size);
+    }
+
+    Item *p = (Item*)(a->arena + a->used);
+    memcpy(p, it, sizeof(Item) - ITEM_PADDING); // safe
+    memcpy(p->key, it->key, it->ksz); // safe
+    p->key[it->ksz] = 0;
+
+    HKey hk;
+    hk_init(&hk, it->key, it->ksz);
+    a->entries[a->count].hash = hk.hash;
+    a->entries[a->count].off = a->used;
+    a->count++;
+    a->used += len;
+}
+
+static int cmp_entry(const void *x, const void *y)
+{
+    const Entry *a = (const Entry*)x, *b = (const Entry*)y;
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return strcmp(((const Item*)(sort_arena + a->off))->key, ((const Item*)(sort_arena + b->off))->key);
+}
+
+static inline uint32_t slot_of(const FrozenIndex *fi, uint32_t hash)
+{
+    if (fi->bits == 0)
+        return 0;
+    return (hash << fi->shift) >> (32 - fi->bits);
+}
+
+/*
+ * Should be called before the tree is shared, it is visited unlocked.
+ * Return NULL if the items take 4GB or more.
+ */
+FrozenIndex *fi_build(HTree *tree, int depth)
+{
+    if (mg_frozen < 0)
+        mg_frozen = mg_register("frozen_index", MG_PRIO_INDEX, NULL, NULL);
+
+    struct collect_args a;
+    memset(&a, 0, sizeof(a));
+    ht_visit2(tree, collect, &a);
+    if (a.overflow)
+    {
+        log_warn("too many items to freeze: %zu in %zu bytes", a.count, a.used);
+        free(a.entries);
+        free(a.arena);
+        return NULL;
+    }
+
+    sort_arena = a.arena;
+    if (a.count > 1)
+        qsort(a.entries, a.count, sizeof(Entry), cmp_entry);
+
+    FrozenIndex *fi = (FrozenIndex*)safe_malloc(sizeof(FrozenIndex));
+    fi->count = a.count;
+    fi->shift = depth * 4;
+    fi->bits = 0;
+    while (fi->bits < MAX_RADIX_BITS && fi->shift + fi->bits < 32
+            && ((size_t)RADIX_LOAD << fi->bits) < a.count)
+        fi->bits++;
+
+    uint32_t nslots = 1U << fi->bits;
+    size_t i;
+    fi->radix = (uint32_t*)safe_malloc(sizeof(uint32_t) * (nslots + 1));
+    fi->hashes = (uint32_t*)safe_malloc(sizeof(uint32_t) * (a.count + 1));
+    fi->offsets = (uint32_t*)safe_malloc(sizeof(uint32_t) * (a.count + 1));
+    uint32_t slot = 0;
+    for (i = 0; i < a.count; i++)
+    {
+        fi->hashes[i] = a.entries[i].hash;
+        fi->offsets[i] = a.entries[i].off;
+        uint32_t s = slot_of(fi, a.entries[i].hash);
+        while (slot <= s)
+            fi->radix[slot++] = i;
+    }
+    while (slot <= nslots)
+        fi->radix[slot++] = a.count;
+    free(a.entries);
+
+    fi->arena = a.used > 0 ? (char*)safe_realloc(a.arena, a.used) : a.arena;
+    fi->size = sizeof(FrozenIndex) + sizeof(uint32_t) * ((nslots + 1) + 2 * (a.count + 1)) + a.used;
+    mg_charge(mg_frozen, fi->size);
+    return fi;
+}
+
+void fi_destroy(FrozenIndex *fi)
+{
+    if (fi == NULL)
+        return;
+    mg_charge(mg_frozen, -(int64_t)fi->size);
+    free(fi->radix);
+    free(fi->hashes);
+    free(fi->offsets);
+    free(fi->arena);
+    free(fi);
+}
+
+const Item *fi_get(const FrozenIndex *fi, const HKey *hk)
+{
+    uint32_t hash = hk->hash, s = slot_of(fi, hash);
+    uint32_t lo = fi->radix[s], end = fi->radix[s + 1], hi = end;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (fi->hashes[mid] < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < end && fi->hashes[lo] == hash; lo++)
+    {
+        const Item *it = (const Item*)(fi->arena + fi->offsets[lo]);
+        if (it->ksz == hk->ksz && memcmp(it->key, hk->key, hk->ksz) == 0)
+            return it;
+    }
+    return NULL;
+}
@@ -0,0 +1,42 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __FROZEN_H__
+#define __FROZEN_H__
+
+#include <stddef.h>
+
+#include "htree.h"
+
+/*
+ * Frozen index: an immutable copy of the items of a HTree, for the
+ * bitcasks serving the data written before a time (-m), which never
+ * change after loading. The key hashes are kept sorted in an array of
+ * their own, with a radix table over their leading bits, and the items
+ * packed in another, so a lookup is a short binary search taking no
+ * lock.
+ */
+
+typedef struct frozen_index FrozenIndex;
+
+/*
+ * depth is the height of the store, the leading hex digits of the key
+ * hashes are the same. NULL if the items do not fit in 4GB, the HTree is
+ * used then.
+ */
+FrozenIndex *fi_build(HTree *tree, int depth);
+void         fi_destroy(FrozenIndex *fi);
+
+/* the item of the key, which is valid until fi_destroy() */
+const Item  *fi_get(const FrozenIndex *fi, const HKey *hk);
+
+#endif
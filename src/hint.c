@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "hint.h"
 #include "quicklz.h"
@@ -37,6 +38,7 @@
 
 #include "mfile.h"
 #include "log.h"
+#include "ioclass.h"
 
 // for build hint
 struct param
@@ -88,7 +90,10 @@ void write_hint_file(char *buf, int size, const char *path)
         log_error("open %s failed", tmp);
         return;
     }
+    double start = io_time();
     int n = fwrite(dst, 1, size, hf);
+    fflush(hf);
+    io_account(mgr_disk_of(fileno(hf)), true, size, io_time() - start);
     fclose(hf);
     if (dst != buf) free(dst);
 
@@ -194,6 +199,45 @@ void scanHintFile(HTree *tree, int bucket, const char *path, const char *new_pat
     close_hint(hint);
 }
 
+/*
+ * The active bucket has no index of its own: each record written to it
+ * is also appended to a hint log, and the hint file is built from the
+ * log once the bucket is rotated or closed. Deleted records are kept,
+ * the hint file needs them.
+ */
+void replay_hint_log(HTree *tree, int bucket, const char *buf, size_t size)
+{
+    const char *p = buf, *end = buf + size;
+    while (p < end)
+    {
+        HintRecord *r = (HintRecord*) p;
+        p += sizeof(HintRecord) - NAME_IN_RECORD + r->ksize + 1;
+        if (p > end)
+        {
+            log_error("replay hint log: unexpected end, need %ld byte", p - end);
+            break;
+        }
+        if (check_key(r->key, r->ksize))
+            ht_add2(tree, r->key, r->ksize, (r->pos << 8) | (bucket & 0xff), r->hash, r->version);
+    }
+}
+
+void build_hint_from_log(HTree *tree, int bucket, const char *logpath, const char *hintpath)
+{
+    struct stat st;
+    if (stat(logpath, &st) == 0 && st.st_size > 0)
+    {
+        HintFile *hint = open_hint(logpath, NULL);
+        if (hint != NULL)
+        {
+            replay_hint_log(tree, bucket, hint->buf, hint->size);
+            close_hint(hint);
+        }
+    }
+    build_hint(tree, hintpath);
+    mgr_unlink(logpath);
+}
+
 int count_deleted_record(HTree *tree, int bucket, const char *path, int *total, bool skipped)
 {
     *total = 0;
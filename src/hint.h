@@ -43,6 +43,8 @@ HintFile *open_hint(const char *path, const char *new_path);
 void close_hint(HintFile *hint);
 void scanHintFile(HTree *tree, int bucket, const char *path, const char *new_path);
 void build_hint(HTree *tree, const char *path);
+void replay_hint_log(HTree *tree, int bucket, const char *buf, size_t size);
+void build_hint_from_log(HTree *tree, int bucket, const char *logpath, const char *hintpath);
 void write_hint_file(char *buf, int size, const char *path);
 int count_deleted_record(HTree *tree, int bucket, const char *path, int *total, bool skipped);
 
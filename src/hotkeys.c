@@ -0,0 +1,215 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hotkeys.h"
+#include "const.h"
+#include "util.h"
+
+#define HOT_SLOTS       64      /* keys tracked by each thread */
+#define HOT_WINDOW      60      /* in secs, counts older than two windows are halved */
+#define MAX_SKETCHES    1024
+
+typedef struct
+{
+    uint32_t hash;
+    int      ksz;
+    int      bitcask;
+    uint64_t count, error, bytes;
+    char     key[MAX_KEY_LEN + 1];
+} HotSlot;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    time_t since;
+    int used;
+    HotSlot slots[HOT_SLOTS];
+} Sketch;
+
+static Sketch *sketches[MAX_SKETCHES];
+static int nsketches = 0;
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread Sketch *local = NULL;
+static __thread uint32_t ticks = 0;
+
+static Sketch *local_sketch(void)
+{
+    if (local != NULL)
+        return local;
+
+    pthread_mutex_lock(&hot_lock);
+    if (nsketches < MAX_SKETCHES)
+    {
+        local = (Sketch*)safe_malloc(sizeof(Sketch));
+        memset(local, 0, sizeof(Sketch));
+        pthread_mutex_init(&local->lock, NULL);
+        local->since = time(NULL);
+        sketches[nsketches++] = local;
+    }
+    pthread_mutex_unlock(&hot_lock);
+    return local;
+}
+
+/* halve the counts and the time they cover, so old hot keys fade out */
+static void age(Sketch *s, time_t now)
+{
+    time_t elapsed = now - s->since;
+    if (elapsed < 2 * HOT_WINDOW)
+        return;
+
+    int i, n = 0;
+    for (i = 0; i < s->used; i++)
+    {
+        HotSlot *slot = &s->slots[i];
+        slot->count /= 2;
+        slot->error /= 2;
+        slot->bytes /= 2;
+        if (slot->count > 0)
+        {
+            if (n != i)
+                s->slots[n] = *slot;
+            n++;
+        }
+    }
+    s->used = n;
+    s->since = now - elapsed / 2;
+}
+
+/*
+ * Space-Saving: a key not tracked yet replaces the least counted one, and
+ * inherits its count, which becomes the error bound of the new key.
+ */
+void hot_record(const HKey *hk, int bitcask, size_t bytes)
+{
+    if (settings.hot_sample <= 0 || ++ticks % settings.hot_sample != 0)
+        return;
+    Sketch *s = local_sketch();
+    if (s == NULL)
+        return;
+
+    int i, least = 0;
+    pthread_mutex_lock(&s->lock);
+    age(s, time(NULL));
+    for (i = 0; i < s->used; i++)
+    {
+        HotSlot *slot = &s->slots[i];
+        if (slot->hash == hk->hash && slot->ksz == hk->ksz && memcmp(slot->key, hk->key, hk->ksz) == 0)
+        {
+            slot->count++;
+            slot->bytes += bytes;
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        if (slot->count < s->slots[least].count)
+            least = i;
+    }
+
+    HotSlot *slot;
+    if (s->used < HOT_SLOTS)
+    {
+        slot = &s->slots[s->used++];
+        slot->count = 1;
+        slot->error = 0;
+    }
+    else
+    {
+        slot = &s->slots[least];
+        slot->error = slot->count;
+        slot->count++;
+    }
+    slot->hash = hk->hash;
+    slot->ksz = min(hk->ksz, MAX_KEY_LEN);
+    memcpy(slot->key, hk->key, slot->ksz);
+    slot->key[slot->ksz] = 0;
+    slot->bitcask = bitcask;
+    slot->bytes = bytes;
+    pthread_mutex_unlock(&s->lock);
+}
+
+typedef struct
+{
+    HotSlot slot;
+    double rate, error, bytes;  /* per second, summed over the threads */
+} HotKey;
+
+static int by_rate(const void *a, const void *b)
+{
+    double x = ((const HotKey*)a)->rate, y = ((const HotKey*)b)->rate;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Merge the sketches of all the threads and write the `top` keys with the
+ * estimated ops and bytes per second, the bitcask they are in, and how
+ * much the ops may be overestimated.
+ */
+int hot_stat(char *buf, int size, int top)
+{
+    int i, j, k, n = 0, count = 0;
+    int sample = max(settings.hot_sample, 1);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&hot_lock);
+    int total = nsketches;
+    pthread_mutex_unlock(&hot_lock);
+
+    HotKey *keys = (HotKey*)safe_malloc(sizeof(HotKey) * max(total * HOT_SLOTS, 1));
+    for (i = 0; i < total; i++)
+    {
+        Sketch *s = sketches[i];
+        pthread_mutex_lock(&s->lock);
+        age(s, now);
+        double secs = max(now - s->since, 1);
+        for (j = 0; j < s->used; j++)
+        {
+            HotSlot *slot = &s->slots[j];
+            for (k = 0; k < count; k++)
+            {
+                if (keys[k].slot.hash == slot->hash && keys[k].slot.ksz == slot->ksz
+                        && memcmp(keys[k].slot.key, slot->key, slot->ksz) == 0)
+                    break;
+            }
+            if (k == count)
+            {
+                keys[count].slot = *slot;
+                keys[count].rate = keys[count].error = keys[count].bytes = 0;
+                count++;
+            }
+            keys[k].rate += slot->count * sample / secs;
+            keys[k].error += slot->error * sample / secs;
+            keys[k].bytes += slot->bytes * sample / secs;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    qsort(keys, count, sizeof(HotKey), by_rate);
+    for (i = 0; i < count && i < top && size - n >= HOT_STAT_SIZE + 64; i++)
+    {
+        HotKey *h = &keys[i];
+        n += safe_snprintf(buf + n, size - n, "STAT hotkey_%d_key %s\r\n", i, h->slot.key);
+        n += safe_snprintf(buf + n, size - n, "STAT hotkey_%d_ops_per_sec %.1f\r\n", i, h->rate);
+        n += safe_snprintf(buf + n, size - n, "STAT hotkey_%d_error %.1f\r\n", i, h->error);
+        n += safe_snprintf(buf + n, size - n, "STAT hotkey_%d_bytes_per_sec %.0f\r\n", i, h->bytes);
+        n += safe_snprintf(buf + n, size - n, "STAT hotkey_%d_bitcask %x\r\n", i, h->slot.bitcask);
+    }
+    n += safe_snprintf(buf + n, size - n, "STAT hotkey_sample %d\r\n", settings.hot_sample);
+    free(keys);
+    return n;
+}
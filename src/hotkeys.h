@@ -0,0 +1,35 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __HOTKEYS_H__
+#define __HOTKEYS_H__
+
+#include <stddef.h>
+
+#include "common.h"
+#include "htree.h"
+
+/*
+ * Hot keys: every thread serving requests keeps a small Space-Saving
+ * sketch of the keys it sees, sampling one request in settings.hot_sample.
+ * The sketches are merged only when they are asked for, so the requests
+ * never share anything.
+ */
+
+/* room for the stats of one key */
+#define HOT_STAT_SIZE (MAX_KEY_LEN + 512)
+
+void hot_record(const HKey *hk, int bitcask, size_t bytes);
+/* the keys not fitting in HOT_STAT_SIZE * top bytes are left out */
+int  hot_stat(char *buf, int size, int top);
+
+#endif
@@ -28,7 +28,6 @@
 #include "htree.h"
 #include "hstore.h"
 #include "diskmgr.h"
-#include "fnv1a.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -40,9 +39,13 @@
 
 #include "const.h"
 #include "log.h"
+#include "memgov.h"
+#include "ioclass.h"
+#include "taskpool.h"
+#include "affinity.h"
 
-#define NUM_OF_MUTEX 37
 #define MAX_PATHS 20
+#define MAX_CAS_RETRIES 1000
 const int APPEND_FLAG  = 0x00000100;
 const int INCR_FLAG    = 0x00000204;
 
@@ -52,104 +55,85 @@ struct t_hstore
     time_t before;
     int scan_threads;
     int op_start, op_end, op_laststat, op_limit; // for optimization
+    int optimizing, migrating;  // gc tasks queued or running
+    bool closing;
+    pthread_mutex_t gc_lock;
+    pthread_cond_t gc_done;
     Mgr *mgr;
-    pthread_mutex_t locks[NUM_OF_MUTEX];
     Bitcask *bitcasks[];
 };
 
-static inline int get_index(HStore *store, char *key)
+static inline int get_index(HStore *store, const HKey *hk)
 {
     if (store->height == 0) return 0;
-    uint32_t h = fnv1a(key, strlen(key));
-    return h >> ((8 - store->height) * 4);
-}
-
-static inline pthread_mutex_t * get_mutex(HStore *store, char *key)
-{
-    uint32_t i = fnv1a(key, strlen(key)) % NUM_OF_MUTEX;
-    return &store->locks[i];
+    return hk->hash >> ((8 - store->height) * 4);
 }
 
 
 // scan
-static int scan_completed = 0;
-static pthread_mutex_t scan_lock;
-static pthread_cond_t  scan_cond;
-
 typedef void (*BC_FUNC)(Bitcask *bc);
 
 struct scan_args
 {
-    HStore *store;
-    int index;
+    Bitcask *bc;
     BC_FUNC func;
+    int node;
 };
 
-static void *scan_thread(void *_args)
+static void scan_task(void *_args)
 {
     struct scan_args *args = (struct scan_args*)_args;
-    HStore *store = args->store;
-    int i, index = args->index;
-    for (i = 0; i < store->count; i++)
-    {
-        if (i % store->scan_threads == index)
-        {
-            args->func(store->bitcasks[i]);
-        }
-    }
-
-    pthread_mutex_lock(&scan_lock);
-    scan_completed++;
-    pthread_cond_signal(&scan_cond);
-    pthread_mutex_unlock(&scan_lock);
-
-    log_debug("thread %d completed", index);
-    return NULL;
+    if (args->node >= 0)
+        aff_bind_node(AFF_SCAN, args->node);
+    args->func(args->bc);
 }
 
 static void parallelize(HStore *store, BC_FUNC func)
 {
-    scan_completed = 0;
-    pthread_mutex_init(&scan_lock, NULL);
-    pthread_cond_init(&scan_cond, NULL);
-
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-
-    int i, ret;
-    pthread_t *thread_ids = (pthread_t*)safe_malloc(sizeof(pthread_t) * store->scan_threads);
-    struct scan_args *args = (struct scan_args *) safe_malloc(sizeof(struct scan_args) * store->scan_threads);
-    for (i = 0; i < store->scan_threads; i++)
+    int i;
+    TaskGroup group = {0};
+    struct scan_args *args = (struct scan_args *) safe_malloc(sizeof(struct scan_args) * store->count);
+    for (i = 0; i < store->count; i++)
     {
-        args[i].store = store;
-        args[i].index = i;
+        args[i].bc = store->bitcasks[i];
         args[i].func = func;
-        if ((ret = pthread_create(thread_ids + i, &attr, scan_thread, args + i)) != 0)
-        {
-            log_fatal("Can't create thread: %s", strerror(ret));
-            exit(1);
-        }
-    }
-
-    pthread_mutex_lock(&scan_lock);
-    while (scan_completed < store->scan_threads)
-    {
-        pthread_cond_wait(&scan_cond, &scan_lock);
+        // with -O, on the node of its owner, so its tree is allocated there
+        args[i].node = settings.shared_nothing ? aff_worker_node(i % settings.num_threads) : -1;
+        tp_submit(TP_PRIO_HIGH, scan_task, args + i, &group);
     }
-    pthread_mutex_unlock(&scan_lock);
+    tp_wait(&group);
+    free(args);
+}
 
-    for (i = 0; i < store->scan_threads; i++)
+// called by the memory governor, flush and shrink write buffers round robin
+static size_t hs_shrink(size_t goal, void *arg)
+{
+    static int next = 0;
+    HStore *store = (HStore*)arg;
+    size_t released = 0;
+    int i;
+    for (i = 0; i < store->count && released < goal; i++)
     {
-        pthread_join(thread_ids[i], NULL);
-        pthread_detach(thread_ids[i]);
+        released += bc_shrink(store->bitcasks[next++ % store->count]);
     }
-    free(thread_ids);
-    free(args);
+    return released;
 }
 
 HStore *hs_open(char *path, int height, time_t before, int scan_threads)
+{
+    return hs_open2(path, height, before, scan_threads, false);
+}
+
+/*
+ * A read only store never changes the files, it serves the data written
+ * before `before` (or up to the time of opening), even if a server is
+ * running on the same path.
+ */
+HStore *hs_open2(char *path, int height, time_t before, int scan_threads, bool read_only)
 {
     if (NULL == path) return NULL;
+    if (read_only && before == 0)
+        before = time(NULL) + 1; // the records are older than it, in seconds
     if (height < 0 || height > 3)
     {
         log_error("invalid db height: %d", height);
@@ -169,22 +153,31 @@ HStore *hs_open(char *path, int height, time_t before, int scan_threads)
     }
 
     char *paths[20], *rpath = path;
-    int npath = 0;
+    int tiers[20], npath = 0;
     while ((paths[npath] = strsep(&rpath, ",:")) != NULL)
     {
         if (npath >= MAX_PATHS) return NULL;
         path = paths[npath];
+        tiers[npath] = mgr_parse_tier(path);
         if (strlen(path) > MAX_HOME_PATH_LEN)
         {
             log_error("path %s logger then %d", path, MAX_HOME_PATH_LEN);
             return NULL;
         }
-        if (0 != access(path, F_OK) && 0 != mkdir(path, 0755))
+        if (read_only)
+        {
+            if (0 != access(path, R_OK))
+            {
+                log_error("access %s failed", path);
+                return NULL;
+            }
+        }
+        else if (0 != access(path, F_OK) && 0 != mkdir(path, 0755))
         {
             log_error("mkdir %s failed", path);
             return NULL;
         }
-        if (height > 1)
+        if (height > 1 && !read_only)
         {
             // try to mkdir
             HStore *s = hs_open(path, height - 1, 0, 0);
@@ -209,16 +202,15 @@ HStore *hs_open(char *path, int height, time_t before, int scan_threads)
     store->op_start = 0;
     store->op_end = 0;
     store->op_limit = 0;
+    pthread_mutex_init(&store->gc_lock, NULL);
+    pthread_cond_init(&store->gc_done, NULL);
     store->mgr = mgr_create((const char**)paths, npath);
     if (store->mgr == NULL)
     {
         free(store);
         return NULL;
     }
-    for (i = 0; i < NUM_OF_MUTEX; i++)
-    {
-        pthread_mutex_init(&store->locks[i], NULL);
-    }
+    mgr_set_tiers(store->mgr, tiers);
 
     char *buf[20] = {0};
     for (i = 0; i < npath; i++)
@@ -248,13 +240,15 @@ HStore *hs_open(char *path, int height, time_t before, int scan_threads)
         }
         Mgr *mgr = mgr_create((const char**)buf, npath);
         if (mgr == NULL) return NULL;
-        store->bitcasks[i] = bc_open2(mgr, height, i, before);
+        mgr_set_tiers(mgr, tiers);
+        store->bitcasks[i] = bc_open2(mgr, height, i, before, read_only);
     }
     for (i = 0; i < npath; i++)
     {
         free(buf[i]);
     }
 
+    tp_start(scan_threads > 2 ? scan_threads : 2);
     if (store->scan_threads > 1 && count > 1)
     {
         parallelize(store, bc_scan);
@@ -267,6 +261,8 @@ HStore *hs_open(char *path, int height, time_t before, int scan_threads)
         }
     }
 
+    if (before == 0)
+        mg_register("write_buffer", MG_PRIO_BUFFER, hs_shrink, store);
     return store;
 }
 
@@ -277,17 +273,37 @@ void hs_flush(HStore *store, unsigned int limit, int period)
     int i;
     for (i = 0; i < store->count; i++)
     {
+        io_throttle();
         bc_flush(store->bitcasks[i], limit, period);
     }
 }
 
+// a gc task is done, should be called with gc_lock held
+static void gc_task_done(HStore *store, int *running)
+{
+    *running = 0;
+    pthread_cond_broadcast(&store->gc_done);
+}
+
 void hs_close(HStore *store)
 {
     int i;
     if (!store) return;
-    // stop optimizing
-    store->op_start = store->op_end = 0;
+    double t0 = io_time();
+    // stop optimizing after the data file it is on, and migrating
+    pthread_mutex_lock(&store->gc_lock);
+    store->closing = true;
+    store->op_end = 0;
+    for (i = 0; i < store->count; i++)
+    {
+        bc_stop_optimize(store->bitcasks[i]);
+    }
+    while (store->optimizing || store->migrating)
+        pthread_cond_wait(&store->gc_done, &store->gc_lock);
+    pthread_mutex_unlock(&store->gc_lock);
+    mg_register("write_buffer", MG_PRIO_BUFFER, NULL, store);
 
+    double t1 = io_time();
     if (store->scan_threads > 1 && store->count > 1)
     {
         parallelize(store, bc_close);
@@ -299,7 +315,16 @@ void hs_close(HStore *store)
             bc_close(store->bitcasks[i]);
         }
     }
+    double t2 = io_time();
+    // hint files of the last rotated buckets
+    tp_drain();
+    double t3 = io_time();
+    log_notice("closed %d bitcasks in %.3f secs: gc stopped in %.3f, bitcasks closed in %.3f, hints built in %.3f",
+            store->count, t3 - t0, t1 - t0, t2 - t1, t3 - t2);
+
     mgr_destroy(store->mgr);
+    pthread_cond_destroy(&store->gc_done);
+    pthread_mutex_destroy(&store->gc_lock);
     free(store);
 }
 
@@ -372,31 +397,68 @@ static char *hs_list(HStore *store, char *key)
     }
 }
 
-char *hs_get(HStore *store, char *key, unsigned int *vlen, uint32_t *flag)
+char *hs_get(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag)
 {
-    if (!key || !store) return NULL;
+    return hs_get2(store, hk, vlen, flag, false);
+}
 
+/*
+ * With raw, a value stored compressed by QuickLZ is returned as it is,
+ * and COMPRESS_FLAG in flag tells so. Values compressed with a dictionary
+ * are always decompressed.
+ */
+char *hs_get2(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag, bool raw)
+{
+    return hs_get_stream(store, hk, vlen, flag, NULL, raw, 0, NULL);
+}
+
+/*
+ * The version of the key is set into ver if not NULL, negative if it was
+ * deleted. With stream, a value of stream_size bytes or more is not read
+ * if it can be read from its data file a chunk at a time: *stream is set
+ * for that, with *vlen and *flag, and NULL is returned.
+ */
+char *hs_get_stream(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag, int *ver, bool raw,
+        uint32_t stream_size, RecordStream **stream)
+{
+    if (!hk || !hk->key || !store) return NULL;
+
+    const char *key = hk->key;
     if (key[0] == '@')
     {
-        char *r = hs_list(store, key + 1);
+        char *r = hs_list(store, (char*)key + 1);
         if (r) *vlen = strlen(r);
         *flag = 0;
         return r;
     }
 
     int info = 0;
+    HKey real;
     if (key[0] == '?')
     {
         info = 1;
-        if (strlen(key) > 1 && key[1] == '?')
+        if (hk->ksz > 1 && key[1] == '?')
             info = 2;
-        key += info;
+        /* meta queries are rare, hash the real key again */
+        hk_init(&real, key + info, hk->ksz - info);
+        hk = &real;
     }
-    int index = get_index(store, key);
+    int index = get_index(store, hk);
     uint32_t ret_pos = 0;
-    DataRecord *r = bc_get(store->bitcasks[index], key, &ret_pos, true);
+    DataRecord *r = bc_get2(store->bitcasks[index], hk, &ret_pos, true, info || !raw,
+            stream_size, info ? NULL : stream);
+    if (r == NULL && stream != NULL && *stream != NULL)
+    {
+        *vlen = record_stream_size(*stream);
+        *flag = record_stream_flag(*stream);
+        return NULL;
+    }
+    if (r != NULL && raw)
+        r = decompress_dict_record(r); // the clients have no dictionaries
     if (r == NULL)
         return NULL;
+    if (ver != NULL)
+        *ver = r->version;
 
     char *res = NULL;
     if (info)
@@ -427,93 +489,139 @@ char *hs_get(HStore *store, char *key, unsigned int *vlen, uint32_t *flag)
     return res;
 }
 
-bool hs_set(HStore *store, char *key, char *value, unsigned int vlen, uint32_t flag, int ver)
+/*
+ * A slice of the value, see bc_get_range(); values compressed by the server
+ * are decompressed first.
+ */
+char *hs_get_range(HStore *store, const HKey *hk, uint32_t from, unsigned int *len, uint32_t *total, uint32_t *flag)
 {
-    if (!store || !key || key[0] == '@') return false;
-    if (store->before > 0) return false;
+    if (!hk || !hk->key || !store) return NULL;
+    if (hk->key[0] == '@' || hk->key[0] == '?')
+        return NULL;
 
-    int index = get_index(store, key);
-    return bc_set(store->bitcasks[index], key, value, vlen, flag, ver);
+    int index = get_index(store, hk);
+    return bc_get_range(store->bitcasks[index], hk, from, len, total, flag);
 }
 
-bool hs_append(HStore *store, char *key, char *value, unsigned int vlen)
+bool hs_set(HStore *store, const HKey *hk, char *value, unsigned int vlen, uint32_t flag, int ver)
 {
-    if (!store || !key || key[0] == '@') return false;
+    if (!store || !hk || !hk->key || hk->key[0] == '@') return false;
     if (store->before > 0) return false;
 
-    pthread_mutex_t *lock = get_mutex(store, key);
-    pthread_mutex_lock(lock);
-
-    int suc = false;
-    unsigned int rlen = 0;
-    uint32_t flag = (uint32_t)APPEND_FLAG;
-    char *body = hs_get(store, key, &rlen, &flag);
-    if (body != NULL && flag != APPEND_FLAG)
-    {
-        log_error("try to append %s with flag=%x", key, flag);
-        goto APPEND_END;
-    }
-    body = (char*)safe_realloc(body, rlen + vlen);
-    memcpy(body + rlen, value, vlen); // safe
-    suc = hs_set(store, key, body, rlen + vlen, flag, 0); // TODO: use timestamp
-
-APPEND_END:
-    if (body != NULL) free(body);
-    pthread_mutex_unlock(lock);
-    return suc;
+    int index = get_index(store, hk);
+    return bc_set(store->bitcasks[index], hk, value, vlen, flag, ver);
 }
 
-int64_t hs_incr(HStore *store, char *key, int64_t value)
+/*
+ * Set the value only if the version of the key is still cas, see bc_cas().
+ */
+int hs_cas(HStore *store, const HKey *hk, char *value, unsigned int vlen, uint32_t flag, int cas)
 {
-    if (!store || !key || key[0] == '@') return 0;
-    if (store->before > 0) return 0;
+    if (!store || !hk || !hk->key || hk->key[0] == '@') return CAS_FAILED;
+    if (store->before > 0) return CAS_FAILED;
 
-    pthread_mutex_t *lock = get_mutex(store, key);
-    pthread_mutex_lock(lock);
+    int index = get_index(store, hk);
+    return bc_cas(store->bitcasks[index], hk, value, vlen, flag, cas);
+}
 
-    int64_t result = 0;
-    unsigned int rlen = 0;
-    uint32_t flag = (uint32_t)INCR_FLAG;
-    char buf[25];
-    char *body = hs_get(store, key, &rlen, &flag);
+/*
+ * Read-modify-write is optimistic: the new value is set only if the key
+ * has not changed since it was read, else it is done again, up to
+ * MAX_CAS_RETRIES times, then CAS_CONFLICT is returned.
+ */
+int hs_append(HStore *store, const HKey *hk, char *value, unsigned int vlen)
+{
+    if (!store || !hk || !hk->key || hk->key[0] == '@') return CAS_FAILED;
+    if (store->before > 0) return CAS_FAILED;
 
-    if (body != NULL)
+    int ret = CAS_FAILED, tries = 0;
+    do
     {
-        if (flag != INCR_FLAG || rlen > 22)
+        unsigned int rlen = 0;
+        uint32_t flag = (uint32_t)APPEND_FLAG;
+        int ver = 0;
+        char *body = hs_get_stream(store, hk, &rlen, &flag, &ver, false, 0, NULL);
+        if (body != NULL && flag != APPEND_FLAG)
         {
-            log_error("try to incr %s but flag=0x%x, len=%u", key, flag, rlen);
-            goto INCR_END;
+            log_error("try to append %s with flag=%x", hk->key, flag);
+            free(body);
+            return CAS_INVALID;
         }
+        body = (char*)safe_realloc(body, rlen + vlen);
+        memcpy(body + rlen, value, vlen); // safe
+        ret = hs_cas(store, hk, body, rlen + vlen, flag, ver > 0 ? ver : -1);
+        free(body);
+    }
+    while ((ret == CAS_EXISTS || ret == CAS_NOT_FOUND) && ++tries < MAX_CAS_RETRIES);
+    if (ret == CAS_EXISTS || ret == CAS_NOT_FOUND)
+    {
+        log_error("append %s gave up after %d tries", hk->key, tries);
+        return CAS_CONFLICT;
+    }
+    return ret;
+}
 
-        body = safe_realloc(body, rlen + 1);
-        body[rlen] = 0;
-        result = strtoll(body, NULL, 10);
-        if (result == 0 && errno == EINVAL)
+/*
+ * The new value is put in result, which is valid only if CAS_STORED is
+ * returned, see hs_append() for the others.
+ */
+int hs_incr(HStore *store, const HKey *hk, int64_t value, int64_t *result)
+{
+    if (!store || !hk || !hk->key || hk->key[0] == '@') return CAS_FAILED;
+    if (store->before > 0) return CAS_FAILED;
+
+    int ret = CAS_FAILED, tries = 0;
+    do
+    {
+        unsigned int rlen = 0;
+        uint32_t flag = (uint32_t)INCR_FLAG;
+        int ver = 0;
+        char buf[25];
+        char *body = hs_get_stream(store, hk, &rlen, &flag, &ver, false, 0, NULL);
+
+        *result = 0;
+        if (body != NULL)
         {
-            log_error("incr %s failed: %s", key, buf);
-            goto INCR_END;
+            if (flag != INCR_FLAG || rlen > 22)
+            {
+                log_error("try to incr %s but flag=0x%x, len=%u", hk->key, flag, rlen);
+                free(body);
+                return CAS_INVALID;
+            }
+
+            body = safe_realloc(body, rlen + 1);
+            body[rlen] = 0;
+            char *end = NULL;
+            errno = 0;
+            *result = strtoll(body, &end, 10);
+            bool bad = end == body || *end != 0 || errno != 0;
+            free(body);
+            if (bad)
+            {
+                log_error("incr %s failed", hk->key);
+                return CAS_INVALID;
+            }
         }
-    }
 
-    result += value;
-    if (result < 0) result = 0;
-    rlen = safe_snprintf(buf, 25, "%lld", (long long int) result);
-    if (!hs_set(store, key, buf, rlen, INCR_FLAG, 0))   // use timestamp later
+        *result += value;
+        if (*result < 0) *result = 0;
+        rlen = safe_snprintf(buf, 25, "%lld", (long long int) *result);
+        ret = hs_cas(store, hk, buf, rlen, INCR_FLAG, ver > 0 ? ver : -1);
+    }
+    while ((ret == CAS_EXISTS || ret == CAS_NOT_FOUND) && ++tries < MAX_CAS_RETRIES);
+    if (ret == CAS_EXISTS || ret == CAS_NOT_FOUND)
     {
-        result = 0; // set failed
+        log_error("incr %s gave up after %d tries", hk->key, tries);
+        return CAS_CONFLICT;
     }
-
-INCR_END:
-    pthread_mutex_unlock(lock);
-    if (body != NULL) free(body);
-    return result;
+    return ret;
 }
 
-void *do_optimize(void *arg)
+static void do_optimize(void *arg)
 {
-    pthread_detach(pthread_self());
     HStore *store = (HStore *) arg;
     time_t st = time(NULL);
+    io_set_class(IO_GC);
     log_notice("start to optimize from 0x%x to 0x%x, limit %d",
             store->op_start, store->op_end - 1 , store->op_limit);
     store->op_laststat = 0;
@@ -521,10 +629,41 @@ void *do_optimize(void *arg)
     {
         store->op_laststat = bc_optimize(store->bitcasks[store->op_start], store->op_limit);
     }
-    store->op_start = store->op_end = 0;
     log_notice("optimization %s in %lld seconds",
            store->op_laststat >=0 ?"completed":"failed",  (long long)(time(NULL) - st));
-    return NULL;
+    pthread_mutex_lock(&store->gc_lock);
+    store->op_start = store->op_end = 0;
+    gc_task_done(store, &store->optimizing);
+    pthread_mutex_unlock(&store->gc_lock);
+}
+
+static void do_migrate(void *arg)
+{
+    HStore *store = (HStore *) arg;
+    int i;
+    io_set_class(IO_GC);
+    for (i = 0; i < store->count && !store->closing; i++)
+    {
+        bc_migrate(store->bitcasks[i]);
+    }
+    pthread_mutex_lock(&store->gc_lock);
+    gc_task_done(store, &store->migrating);
+    pthread_mutex_unlock(&store->gc_lock);
+}
+
+/*
+ * Age the heat of the data files and move them between the tiers, in the
+ * background after the running optimization if any.
+ */
+void hs_migrate(HStore *store)
+{
+    pthread_mutex_lock(&store->gc_lock);
+    bool start = store->before == 0 && !store->closing && !store->migrating;
+    if (start)
+        store->migrating = 1;
+    pthread_mutex_unlock(&store->gc_lock);
+    if (start)
+        tp_submit(TP_PRIO_GC, do_migrate, store, NULL);
 }
 
 static bool tree2range(char *tree, int height, int *start, int *end)
@@ -559,18 +698,23 @@ int hs_optimize(HStore *store, long limit, char *tree)
 {
     if (store->before > 0)
         return  -1;
-    if (store->op_start < store->op_end)
-        return  -2;
 
     int start, end;
     if (!tree2range(tree, store->height, &start, &end))
         return -3;
 
-    pthread_t id;
+    pthread_mutex_lock(&store->gc_lock);
+    if (store->optimizing || store->closing)
+    {
+        pthread_mutex_unlock(&store->gc_lock);
+        return  -2;
+    }
+    store->optimizing = 1;
     store->op_limit = limit;
     store->op_start = start;
     store->op_end = end;
-    pthread_create(&id, NULL, do_optimize, store);
+    pthread_mutex_unlock(&store->gc_lock);
+    tp_submit(TP_PRIO_GC, do_optimize, store, NULL);
 
     return 0;
 }
@@ -584,13 +728,30 @@ int hs_optimize_stat(HStore *store)
         return store->op_laststat - 1;
 }
 
-bool hs_delete(HStore *store, char *key)
+/*
+ * Call visitor on every live item, one bitcask at a time.
+ */
+void hs_visit(HStore *store, fun_visitor visitor, void *param)
 {
-    if (!key || !store) return false;
+    int i;
+    for (i = 0; i < store->count; i++)
+    {
+        bc_visit(store->bitcasks[i], visitor, param);
+    }
+}
+
+int hs_index(HStore *store, const HKey *hk)
+{
+    return get_index(store, hk);
+}
+
+bool hs_delete(HStore *store, const HKey *hk)
+{
+    if (!hk || !hk->key || !store) return false;
     if (store->before > 0) return false;
 
-    int index = get_index(store, key);
-    return bc_delete(store->bitcasks[index], key);
+    int index = get_index(store, hk);
+    return bc_delete(store->bitcasks[index], hk);
 }
 
 uint64_t hs_count(HStore *store, uint64_t *curr)
@@ -622,3 +783,8 @@ void hs_stat(HStore *store, uint64_t *total, uint64_t *avail)
     uint64_t total_space;
     mgr_stat(store->mgr, &total_space, avail);
 }
+
+int hs_disks(HStore *store)
+{
+    return store->mgr->ndisks;
+}
@@ -19,19 +19,31 @@
 #include <stdint.h>
 
 #include "util.h"
+#include "htree.h"
+#include "record.h"
 
 typedef struct t_hstore HStore;
 
 HStore* hs_open(char *path, int height, time_t before, int scan_threads);
+HStore* hs_open2(char *path, int height, time_t before, int scan_threads, bool read_only);
 void    hs_flush(HStore *store, unsigned int limit, int period);
 void    hs_close(HStore *store);
-char*   hs_get(HStore *store, char *key, unsigned int *vlen, uint32_t *flag);
-bool    hs_set(HStore *store, char *key, char *value, unsigned int vlen, uint32_t flag, int version);
-bool    hs_append(HStore *store, char *key, char *value, unsigned int vlen);
-int64_t hs_incr(HStore *store, char *key, int64_t value);
-bool    hs_delete(HStore *store, char *key);
+char*   hs_get(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag);
+char*   hs_get2(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag, bool raw);
+char*   hs_get_stream(HStore *store, const HKey *hk, unsigned int *vlen, uint32_t *flag, int *ver, bool raw,
+                      uint32_t stream_size, RecordStream **stream);
+char*   hs_get_range(HStore *store, const HKey *hk, uint32_t from, unsigned int *len, uint32_t *total, uint32_t *flag);
+bool    hs_set(HStore *store, const HKey *hk, char *value, unsigned int vlen, uint32_t flag, int version);
+int     hs_cas(HStore *store, const HKey *hk, char *value, unsigned int vlen, uint32_t flag, int cas);
+int     hs_append(HStore *store, const HKey *hk, char *value, unsigned int vlen);
+int     hs_incr(HStore *store, const HKey *hk, int64_t value, int64_t *result);
+bool    hs_delete(HStore *store, const HKey *hk);
+int     hs_index(HStore *store, const HKey *hk);
+void    hs_visit(HStore *store, fun_visitor visitor, void *param);
 uint64_t hs_count(HStore *store, uint64_t *curr);
 void    hs_stat(HStore *store, uint64_t *total, uint64_t *avail);
+int     hs_disks(HStore *store);
 int     hs_optimize(HStore *store, long limit, char *tree);
 int     hs_optimize_stat(HStore *store);
+void    hs_migrate(HStore *store);
 #endif
@@ -30,6 +30,8 @@
 #include "const.h"
 #include "log.h"
 #include "diskmgr.h"
+#include "memgov.h"
+#include "scan.h"
 
 const int BUCKET_SIZE = 16;
 const int SPLIT_LIMIT = 64;
@@ -117,6 +119,20 @@ static inline Node *get_child(HTree *tree, Node *node, int b)
     return tree->root + i;
 }
 
+static int mg_htree = -1;
+
+static inline Data *alloc_data(int size)
+{
+    mg_charge(mg_htree, size);
+    return (Data*)safe_malloc(size);
+}
+
+static inline void release_data(Data *data)
+{
+    mg_charge(mg_htree, -data->size);
+    free(data);
+}
+
 static inline void init_data(Data *data, int size)
 {
     data->next = NULL;
@@ -142,7 +158,7 @@ static inline void free_data(Node *node)
     {
         d0 = d;
         d = d->next;
-        free(d0);
+        release_data(d0);
     }
     node->data = NULL;
 }
@@ -174,6 +190,7 @@ static void enlarge_pool(HTree *tree)
 
     log_notice("enlarge pool %d -> %d, new_height = %d", old_size, new_size, tree->height + 1);
 
+    mg_charge(mg_htree, sizeof(Node) * (new_size - old_size));
     tree->root = (Node*)safe_realloc(tree->root, sizeof(Node) * new_size);
     memset(tree->root + old_size, 0, sizeof(Node) * (new_size - old_size));
     for (i = old_size; i<new_size; i++)
@@ -184,7 +201,7 @@ static void enlarge_pool(HTree *tree)
 
 static void clear(Node *node)
 {
-    Data *data = (Data*)safe_malloc(64);
+    Data *data = alloc_data(64);
     init_data(data, 64);
     set_data(node, data);
 
@@ -234,7 +251,7 @@ static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash, bool e
         if (last->used + it_len > tree->block_size)
         {
             int size = DATA_HEAD_SIZE + it_len;
-            data = (Data*)safe_malloc(size);
+            data = alloc_data(size);
             init_data(data, size);
             last->next = data;
         }
@@ -242,6 +259,7 @@ static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash, bool e
         {
             int size = max(last->used + it_len, last->size);
             size = min(size, tree->block_size);
+            mg_charge(mg_htree, size - last->size);
             data = (Data*)safe_realloc(last, size);
             data->size = size;
 
@@ -337,7 +355,7 @@ static void remove_item(HTree *tree, Node *node, Item *it, uint32_t keyhash)
                 else if (data != data0 && data->next != NULL) //neither first nor last
                 {
                     last->next = data->next;
-                    free(data);
+                    release_data(data);
                 }
                 return;
             }
@@ -592,6 +610,9 @@ static void visit_node(HTree *tree, Node *node, fun_visitor visitor, void *param
 
 HTree *ht_new(int depth, int pos, bool tmp)
 {
+    if (mg_htree < 0)
+        mg_htree = mg_register("htree", MG_PRIO_INDEX, NULL, NULL);
+
     HTree *tree = (HTree*)safe_malloc(sizeof(HTree));
     memset(tree, 0, sizeof(HTree));
     tree->depth = depth;
@@ -606,6 +627,7 @@ HTree *ht_new(int depth, int pos, bool tmp)
 
     int pool_size = g_index[tree->height];
     Node *root = (Node*)safe_malloc(sizeof(Node) * pool_size);
+    mg_charge(mg_htree, sizeof(Node) * pool_size);
 
     memset(root, 0, sizeof(Node) * pool_size);
 
@@ -684,7 +706,10 @@ HTree *ht_open(int depth, int pos, const char *path)
 
     int pool_size = g_index[tree->height];
     int psize = sizeof(Node) * pool_size;
+    if (mg_htree < 0)
+        mg_htree = mg_register("htree", MG_PRIO_INDEX, NULL, NULL);
     root = (Node*)safe_malloc(psize);
+    mg_charge(mg_htree, psize);
 
     if (fread(root, psize, 1, f) != 1)
     {
@@ -716,6 +741,7 @@ HTree *ht_open(int depth, int pos, const char *path)
             }
             data->used = data->size = size + sizeof(Data*);
             data->next = NULL;
+            mg_charge(mg_htree, data->size);
         }
         else if (size == 0)
         {
@@ -766,8 +792,9 @@ FAIL:
     {
         for (i = 0; i < pool_used; i++)
         {
-            if (root[i].data) free(root[i].data);
+            if (root[i].data) release_data(root[i].data);
         }
+        mg_charge(mg_htree, -psize);
         free(root);
     }
     free(tree);
@@ -931,6 +958,7 @@ void ht_destroy(HTree *tree)
         if (tree->root[i].data)
             free_data(tree->root + i);
     }
+    mg_charge(mg_htree, -(int64_t)sizeof(Node) * pool_size);
     free(tree->root);
     free(tree);
 }
@@ -953,35 +981,52 @@ bool check_key(const char *key, int len)
         log_error("bad key len=%d %x", len, key[0]);
         return false;
     }
-    int k;
-    for (k = 0; k < len; k++)
+    if (!scan_key_bytes(key, len))
     {
-        if (isspace(key[k]) || iscntrl(key[k]))
-        {
-            log_error("bad key len=%d %s", len, key);
-            return false;
-        }
+        log_error("bad key len=%d %s", len, key);
+        return false;
     }
     return true;
 }
 
-bool check_bucket(HTree *tree, const char* key, int len)
+void hk_init(HKey *hk, const char *key, int ksz)
+{
+    hk->key = key;
+    hk->ksz = ksz;
+    hk->hash = keyhash(key, ksz);
+}
+
+static bool check_bucket(HTree *tree, const HKey *hk)
 {
-    uint32_t h = keyhash(key, len);
+    uint32_t h = hk->hash;
     if (tree->depth > 0 && h >> ((8-tree->depth) * 4) != (unsigned int)(tree->pos))
     {
-        log_error("key %s (#%x) should not in this tree (%d:%0x)", key, h >> ((8-tree->depth) * 4), tree->depth, tree->pos);
+        log_error("key %s (#%x) should not in this tree (%d:%0x)", hk->key, h >> ((8-tree->depth) * 4), tree->depth, tree->pos);
         return false;
     }
 
     return true;
 }
 
+static void add_key(HTree *tree, const HKey *hk, uint32_t pos, uint16_t hash, int32_t ver)
+{
+    if (!check_bucket(tree, hk)) return;
+    Item *it = create_item(tree, hk->key, hk->ksz, pos, hash, ver);
+    add_item(tree, tree->root, it, hk->hash, true);
+}
+
+static void remove_key(HTree *tree, const HKey *hk)
+{
+    if (!check_bucket(tree, hk)) return;
+    Item *it = create_item(tree, hk->key, hk->ksz, 0, 0, 0);
+    remove_item(tree, tree->root, it, hk->hash);
+}
+
 void ht_add2(HTree *tree, const char *key, int len, uint32_t pos, uint16_t hash, int32_t ver)
 {
-    if (!check_bucket(tree, key, len)) return;
-    Item *it = create_item(tree, key, len, pos, hash, ver);
-    add_item(tree, tree->root, it, keyhash(key, len), true);
+    HKey hk;
+    hk_init(&hk, key, len);
+    add_key(tree, &hk, pos, hash, ver);
 }
 
 void ht_add(HTree *tree, const char *key, uint32_t pos, uint16_t hash, int32_t ver)
@@ -991,11 +1036,18 @@ void ht_add(HTree *tree, const char *key, uint32_t pos, uint16_t hash, int32_t v
     pthread_mutex_unlock(&tree->lock);
 }
 
+void ht_add_key(HTree *tree, const HKey *hk, uint32_t pos, uint16_t hash, int32_t ver)
+{
+    pthread_mutex_lock(&tree->lock);
+    add_key(tree, hk, pos, hash, ver);
+    pthread_mutex_unlock(&tree->lock);
+}
+
 void ht_remove2(HTree *tree, const char *key, int len)
 {
-    if (!check_bucket(tree, key, len)) return;
-    Item *it = create_item(tree, key, len, 0, 0, 0);
-    remove_item(tree, tree->root, it, keyhash(key, len));
+    HKey hk;
+    hk_init(&hk, key, len);
+    remove_key(tree, &hk);
 }
 
 void ht_remove(HTree *tree, const char *key)
@@ -1005,18 +1057,26 @@ void ht_remove(HTree *tree, const char *key)
     pthread_mutex_unlock(&tree->lock);
 }
 
-Item *ht_get2(HTree *tree, const char *key, int len)
+void ht_remove_key(HTree *tree, const HKey *hk)
+{
+    pthread_mutex_lock(&tree->lock);
+    remove_key(tree, hk);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+Item *ht_get_key(HTree *tree, const HKey *hk)
 {
-    if (!check_bucket(tree, key, len)) return NULL;
+    if (!check_bucket(tree, hk)) return NULL;
 
+    int len = hk->ksz;
     pthread_mutex_lock(&tree->lock);
-    Item *it = create_item(tree, key, len, 0, 0, 0);
-    Item *r = get_item_hash(tree, tree->root, it, keyhash(key, len));
+    Item *it = create_item(tree, hk->key, len, 0, 0, 0);
+    Item *r = get_item_hash(tree, tree->root, it, hk->hash);
     if (r != NULL)
     {
         Item *rr = (Item*)safe_malloc(sizeof(Item) + len);
         memcpy(rr, r, sizeof(Item)); // safe
-        memcpy(rr->key, key, len);  // safe
+        memcpy(rr->key, hk->key, len);  // safe
         rr->key[len] = 0; // c-str
         r = rr; // r is in node->Data block
     }
@@ -1024,6 +1084,13 @@ Item *ht_get2(HTree *tree, const char *key, int len)
     return r;
 }
 
+Item *ht_get2(HTree *tree, const char *key, int len)
+{
+    HKey hk;
+    hk_init(&hk, key, len);
+    return ht_get_key(tree, &hk);
+}
+
 Item *ht_get(HTree *tree, const char *key)
 {
     return ht_get2(tree, key, strlen(key));
@@ -1078,16 +1145,16 @@ void ht_set_updating_bucket(HTree *tree, int bucket, HTree *updating_tree)
     pthread_mutex_unlock(&tree->lock);
 }
 
-Item *ht_get_withbuf(HTree *tree, const char *key, int len, char *buf, bool lock)
+Item *ht_get_withbuf(HTree *tree, const HKey *hk, char *buf, bool lock)
 {
-    if (!check_bucket(tree, key, len)) return NULL;
+    if (!check_bucket(tree, hk)) return NULL;
 
     Item *it = (Item*)buf;
-    it->ksz = dc_encode(tree->dc, it->key, TREE_BUF_SIZE - (sizeof(Item) - ITEM_PADDING), key, len);
+    it->ksz = dc_encode(tree->dc, it->key, TREE_BUF_SIZE - (sizeof(Item) - ITEM_PADDING), hk->key, hk->ksz);
 
     if (lock)
         pthread_mutex_lock(&tree->lock);
-    Item *r = get_item_hash(tree, tree->root, it, keyhash(key, len));
+    Item *r = get_item_hash(tree, tree->root, it, hk->hash);
     if (r != NULL)
     {
         int l = ITEM_LENGTH(it);
@@ -1101,10 +1168,10 @@ Item *ht_get_withbuf(HTree *tree, const char *key, int len, char *buf, bool lock
 }
 
 
-Item *ht_get_maybe_tmp(HTree *tree, const char *key, int *is_tmp, char *buf)
+Item *ht_get_maybe_tmp(HTree *tree, const HKey *hk, int *is_tmp, char *buf)
 {
     *is_tmp = 0;
-    Item *item = ht_get_withbuf(tree, key, strlen(key), buf, true);
+    Item *item = ht_get_withbuf(tree, hk, buf, true);
     if (NULL != item)
     {
         uint32_t bucket = item->pos & 0xff;
@@ -1113,14 +1180,14 @@ Item *ht_get_maybe_tmp(HTree *tree, const char *key, int *is_tmp, char *buf)
             pthread_mutex_lock(&tree->lock);
             if (tree->updating_bucket == bucket)
             {
-                log_debug("get tmp for %s", key);
+                log_debug("get tmp for %s", hk->key);
                 *is_tmp = 1;
-                item = ht_get_withbuf(tree->updating_tree, key, strlen(key), buf, false);
+                item = ht_get_withbuf(tree->updating_tree, hk, buf, false);
             }
             else
             {
-                log_notice("get again for %s", key);
-                item = ht_get_withbuf(tree, key, strlen(key), buf, false);
+                log_notice("get again for %s", hk->key);
+                item = ht_get_withbuf(tree, hk, buf, false);
             }
             pthread_mutex_unlock(&tree->lock);
         }
@@ -34,6 +34,21 @@ struct t_item
 
 #define ITEM_PADDING 1
 
+/*
+ * A key with its length and fnv1a hash. It is built once per request and
+ * passed down through hstore, bitcask and htree, so that every layer uses
+ * the same hash instead of computing it again.
+ */
+typedef struct t_hkey HKey;
+struct t_hkey
+{
+    const char *key;
+    int         ksz;
+    uint32_t    hash;
+};
+
+void     hk_init(HKey *hk, const char *key, int ksz);
+
 typedef struct t_hash_tree HTree;
 typedef void (*fun_visitor) (Item *it, void *param);
 
@@ -43,6 +58,9 @@ void     ht_add(HTree *tree, const char *key, uint32_t pos, uint16_t hash, int32
 void     ht_remove(HTree *tree, const char *key);
 Item*    ht_get(HTree *tree, const char *key);
 Item*    ht_get2(HTree *tree, const char *key, int ksz);
+void     ht_add_key(HTree *tree, const HKey *hk, uint32_t pos, uint16_t hash, int32_t ver);
+void     ht_remove_key(HTree *tree, const HKey *hk);
+Item*    ht_get_key(HTree *tree, const HKey *hk);
 uint32_t ht_get_hash(HTree *tree, const char *key, unsigned int *count);
 char*    ht_list(HTree *tree, const char *dir, const char *prefix);
 void     ht_visit(HTree *tree, fun_visitor visitor, void *param);
@@ -51,8 +69,8 @@ HTree*   ht_open(int depth, int pos, const char *path);
 int      ht_save(HTree *tree, const char *path);
 
 void     ht_set_updating_bucket(HTree *tree, int bucket, HTree *updating_tree);
-Item*    ht_get_maybe_tmp(HTree *tree, const char *key, int *is_tmp, char *buf);
-Item*    ht_get_withbuf(HTree *tree, const char *key, int len, char *buf, bool lock);
+Item*    ht_get_maybe_tmp(HTree *tree, const HKey *hk, int *is_tmp, char *buf);
+Item*    ht_get_withbuf(HTree *tree, const HKey *hk, char *buf, bool lock);
 
 // not thread safe
 void     ht_add2(HTree *tree, const char *key, int ksz, uint32_t pos, uint16_t hash, int32_t ver);
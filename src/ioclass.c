@@ -0,0 +1,141 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "ioclass.h"
+#include "util.h"
+#include "log.h"
+#include "diskmgr.h"
+
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+
+#define THROTTLE_STEP  10000    /* in us */
+#define THROTTLE_MAX   100      /* steps in one call */
+
+typedef struct
+{
+    uint64_t read_ops, read_bytes, write_ops, write_bytes;
+    uint64_t usecs;
+} IOStat;
+
+static const char *class_names[IO_CLASSES] = {"read", "flush", "hint", "gc"};
+
+/* best effort level of each class, 0 is the highest; the background
+ * classes are not idle class, or they may never finish on a busy disk */
+static const int class_prio[IO_CLASSES] = {0, 4, 7, 7};
+
+static __thread int curr_class = IO_READ;
+static IOStat io_stats[IO_CLASSES];
+
+/* moving average of user read latency, in us */
+static volatile uint32_t read_latency = 0;
+static volatile time_t last_read = 0;
+static uint64_t throttled_usecs = 0;
+
+void io_set_class(int cls)
+{
+    if (cls < 0 || cls >= IO_CLASSES) return;
+    curr_class = cls;
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, class_prio[cls])) != 0)
+    {
+        log_warn("ioprio_set for %s failed", class_names[cls]);
+    }
+#endif
+}
+
+int io_get_class(void)
+{
+    return curr_class;
+}
+
+double io_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the disk, if known, is charged too */
+void io_account(int disk, bool write, size_t bytes, double secs)
+{
+    IOStat *s = &io_stats[curr_class];
+    uint32_t us = secs * 1e6;
+    if (write)
+    {
+        __sync_add_and_fetch(&s->write_ops, 1);
+        __sync_add_and_fetch(&s->write_bytes, bytes);
+    }
+    else
+    {
+        __sync_add_and_fetch(&s->read_ops, 1);
+        __sync_add_and_fetch(&s->read_bytes, bytes);
+    }
+    __sync_add_and_fetch(&s->usecs, us);
+
+    if (curr_class == IO_READ && !write)
+    {
+        // racy but good enough for an average
+        read_latency = (read_latency * 7 + us) / 8;
+        last_read = time(NULL);
+    }
+    mgr_account(disk, write, bytes, secs);
+}
+
+/*
+ * Called by background threads between I/O: wait while the user reads
+ * are slower than settings.io_read_latency.
+ */
+void io_throttle(void)
+{
+    if (curr_class == IO_READ || settings.io_read_latency == 0)
+        return;
+
+    int i;
+    uint32_t limit = settings.io_read_latency * 1000;
+    for (i = 0; i < THROTTLE_MAX && read_latency > limit
+            && last_read + 1 >= time(NULL); i++)
+    {
+        usleep(THROTTLE_STEP);
+    }
+    if (i > 0)
+        __sync_add_and_fetch(&throttled_usecs, (uint64_t)i * THROTTLE_STEP);
+}
+
+int io_stat(char *buf, int size)
+{
+    int i, n = 0;
+    for (i = 0; i < IO_CLASSES; i++)
+    {
+        IOStat *s = &io_stats[i];
+        const char *name = class_names[i];
+        n += safe_snprintf(buf + n, size - n, "STAT io_%s_read_ops %"PRIu64"\r\n", name, s->read_ops);
+        n += safe_snprintf(buf + n, size - n, "STAT io_%s_read_bytes %"PRIu64"\r\n", name, s->read_bytes);
+        n += safe_snprintf(buf + n, size - n, "STAT io_%s_write_ops %"PRIu64"\r\n", name, s->write_ops);
+        n += safe_snprintf(buf + n, size - n, "STAT io_%s_write_bytes %"PRIu64"\r\n", name, s->write_bytes);
+        n += safe_snprintf(buf + n, size - n, "STAT io_%s_usecs %"PRIu64"\r\n", name, s->usecs);
+    }
+    n += safe_snprintf(buf + n, size - n, "STAT io_read_latency_us %u\r\n", read_latency);
+    n += safe_snprintf(buf + n, size - n, "STAT io_throttled_usecs %"PRIu64"\r\n", throttled_usecs);
+    return n;
+}
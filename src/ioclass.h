@@ -0,0 +1,40 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __IOCLASS_H__
+#define __IOCLASS_H__
+
+#include <stddef.h>
+
+#include "common.h"
+
+/*
+ * I/O classes: every thread doing disk I/O belongs to one class, which
+ * sets its kernel I/O priority and the bucket its I/O is accounted in.
+ * Threads are in IO_READ (user requests) unless set otherwise.
+ */
+
+#define IO_READ     0   /* user requests, never throttled */
+#define IO_FLUSH    1   /* write buffer flushing */
+#define IO_HINT     2   /* building hint files */
+#define IO_GC       3   /* optimizing data files */
+#define IO_CLASSES  4
+
+void   io_set_class(int cls);
+int    io_get_class(void);
+double io_time(void);
+/* disk is from mgr_disk_of() of the file, -1 if unknown */
+void   io_account(int disk, bool write, size_t bytes, double secs);
+void   io_throttle(void);
+int    io_stat(char *buf, int size);
+
+#endif
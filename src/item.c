@@ -16,10 +16,12 @@
 
 #include "beansdb.h"
 #include "hstore.h"
+#include "hotkeys.h"
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -32,24 +34,34 @@
 
 #include "util.h"
 #include "log.h"
+#include "memgov.h"
 
 #define MAX_ITEM_FREELIST_LENGTH 4000
 #define INIT_ITEM_FREELIST_LENGTH 500
 
-static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes, char *suffix, uint8_t *nsuffix);
+static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes, const int64_t total, char *suffix, uint8_t *nsuffix);
 
 static item **freeitem;
 static int freeitemtotal;
 static int freeitemcurr;
+static int mg_items = -1;
+static int mg_large = -1;
 
 extern HStore *store;
 
+static size_t item_shrink(size_t goal, void *arg)
+{
+    return item_trim_freelist(goal);
+}
+
 void item_init(void)
 {
     freeitemtotal = INIT_ITEM_FREELIST_LENGTH;
     freeitemcurr  = 0;
 
     freeitem = (item **)safe_malloc(sizeof(item *) * freeitemtotal);
+    mg_items = mg_register("item_freelist", MG_PRIO_CACHE, item_shrink, NULL);
+    mg_large = mg_register("large_items", MG_PRIO_BUFFER, NULL, NULL);
     return;
 }
 
@@ -64,6 +76,7 @@ item *do_item_from_freelist(void)
     if (freeitemcurr > 0)
     {
         s = freeitem[--freeitemcurr];
+        mg_charge(mg_items, -(int64_t)settings.item_buf_size);
     }
     else
     {
@@ -85,6 +98,7 @@ int do_item_add_to_freelist(item *it)
     if (freeitemcurr < freeitemtotal)
     {
         freeitem[freeitemcurr++] = it;
+        mg_charge(mg_items, settings.item_buf_size);
         return 0;
     }
     else
@@ -101,12 +115,29 @@ int do_item_add_to_freelist(item *it)
             log_notice("freeitemtotal doubled to %d", freeitemtotal);
             freeitem = new_freeitem;
             freeitem[freeitemcurr++] = it;
+            mg_charge(mg_items, settings.item_buf_size);
             return 0;
         }
     }
     return 1;
 }
 
+/*
+ * Frees item buffers in the freelist until goal bytes released. Should call
+ * item_trim_freelist for thread safty.
+ */
+size_t do_item_trim_freelist(size_t goal)
+{
+    size_t released = 0;
+    while (freeitemcurr > 0 && released < goal)
+    {
+        free(freeitem[--freeitemcurr]);
+        mg_charge(mg_items, -(int64_t)settings.item_buf_size);
+        released += settings.item_buf_size;
+    }
+    return released;
+}
+
 /**
  * Generates the variable-sized part of the header for an object.
  *
@@ -114,34 +145,47 @@ int do_item_add_to_freelist(item *it)
  * nkey    - The length of the key
  * flags   - key flags
  * nbytes  - Number of bytes to hold value and addition CRLF terminator
- * suffix  - Buffer for the "VALUE" line suffix (flags, size).
+ * extra   - The size of the whole value for a range of it, or the cas
+ *           unique for gets, -1 for none
+ * suffix  - Buffer for the "VALUE" line suffix (flags, size[, extra]).
  * nsuffix - The length of the suffix is stored here.
  *
  * Returns the total size of the header.
  */
 static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes,
-                               char *suffix, uint8_t *nsuffix)
+                               const int64_t extra, char *suffix, uint8_t *nsuffix)
 {
     /* suffix is defined at 40 chars elsewhere.. */
-    *nsuffix = (uint8_t)safe_snprintf(suffix, 40, " %d %d\r\n", flags, nbytes - 2);
+    if (extra < 0)
+        *nsuffix = (uint8_t)safe_snprintf(suffix, 40, " %d %d\r\n", flags, nbytes - 2);
+    else
+        *nsuffix = (uint8_t)safe_snprintf(suffix, 40, " %d %d %"PRId64"\r\n", flags, nbytes - 2, extra);
     return sizeof(item) + nkey + *nsuffix + nbytes;
 }
 
 /*
- * alloc a item buffer, and init it.
+ * Items larger than item_buf_size are malloc()ed and charged to
+ * large_items until item_free(). With admit, they are refused when
+ * over the memory budget.
  */
-item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes)
+static item *do_item_alloc(char *key, const size_t nkey, const int flags, const int nbytes,
+                           const int64_t extra, bool admit)
 {
     uint8_t nsuffix;
     item *it;
     char suffix[40];
-    size_t ntotal = item_make_header(nkey + 1, flags, nbytes, suffix, &nsuffix);
+    size_t ntotal = item_make_header(nkey + 1, flags, nbytes, extra, suffix, &nsuffix);
 
     if (ntotal > settings.item_buf_size)
     {
+        if (admit && !mg_reserve(mg_large, ntotal))
+            return NULL;
+        if (!admit)
+            mg_charge(mg_large, ntotal);
         it = (item *)try_malloc(ntotal);
         if (it == NULL)
         {
+            mg_charge(mg_large, -(int64_t)ntotal);
             return NULL;
         }
         memset(it, 0, ntotal);
@@ -171,6 +215,22 @@ item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbyte
     return it;
 }
 
+/*
+ * alloc a item buffer for a value from client, and init it.
+ */
+item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes)
+{
+    return do_item_alloc(key, nkey, flags, nbytes, -1, true);
+}
+
+/*
+ * alloc a item buffer with a number more in the VALUE line.
+ */
+item *item_alloc2(char *key, const size_t nkey, const int flags, const int nbytes, const int64_t extra)
+{
+    return do_item_alloc(key, nkey, flags, nbytes, extra, false);
+}
+
 /*
  * free a item buffer. here 'it' must be a full item.
  */
@@ -190,6 +250,7 @@ int item_free(item *it)
             log_error("ntotal: %"PRIuS", use free() directly.", ntotal);
         }
         free(it);
+        mg_charge(mg_large, -(int64_t)ntotal);
     }
     else
     {
@@ -212,22 +273,99 @@ int item_free(item *it)
     return 0;
 }
 
+struct get_args
+{
+    HKey hk;
+    bool raw;
+    char *value;
+    unsigned int vlen;
+    uint32_t flag;
+    int ver;
+    RecordStream **stream;
+};
+
+static void do_item_get(void *arg)
+{
+    struct get_args *a = (struct get_args*)arg;
+    a->value = hs_get_stream(store, &a->hk, &a->vlen, &a->flag, &a->ver, a->raw, STREAM_CHUNK_SIZE, a->stream);
+}
+
 /* if return item is not NULL, free by caller */
-item *item_get(char *key, unsigned int nkey)
+item *item_get(char *key, unsigned int nkey, bool raw)
+{
+    return item_get_stream(key, nkey, raw, false, NULL, NULL, NULL);
+}
+
+/*
+ * With cas, the version of the key is sent as the cas unique. With stream,
+ * a value of STREAM_CHUNK_SIZE or more in a data file is not read, *stream
+ * is set to send it a chunk at a time, with its size and flag.
+ */
+item *item_get_stream(char *key, unsigned int nkey, bool raw, bool cas, RecordStream **stream,
+        unsigned int *vlen, uint32_t *flag)
 {
     item *it = NULL;
-    unsigned int vlen;
+    struct get_args a;
+    hk_init(&a.hk, key, nkey);
+    a.raw = raw;
+    a.stream = stream;
+    mt_storage_run(&a.hk, do_item_get, &a);
+    hot_record(&a.hk, hs_index(store, &a.hk), a.value || (stream && *stream) ? a.vlen : 0);
+    if (stream && *stream)
+    {
+        *vlen = a.vlen;
+        *flag = a.flag;
+        return NULL;
+    }
+    if (a.value)
+    {
+        it = item_alloc2(key, nkey, a.flag, a.vlen + 2, cas ? a.ver : -1);
+        if (it)
+        {
+            it->ver = a.ver;
+            memcpy(ITEM_data(it), a.value, a.vlen); // safe
+            memcpy(ITEM_data(it) + a.vlen, "\r\n", 2); // safe
+        }
+        free(a.value);
+    }
+    return it;
+}
+
+struct get_range_args
+{
+    HKey hk;
+    uint32_t from;
+    unsigned int len;
+    uint32_t total;
     uint32_t flag;
-    char *value = hs_get(store, key, &vlen, &flag);
-    if (value)
+    char *value;
+};
+
+static void do_item_get_range(void *arg)
+{
+    struct get_range_args *a = (struct get_range_args*)arg;
+    a->value = hs_get_range(store, &a->hk, a->from, &a->len, &a->total, &a->flag);
+}
+
+/* len bytes of the value from from on, 0 for all the rest of it */
+item *item_get_range(char *key, unsigned int nkey, uint32_t from, unsigned int len)
+{
+    item *it = NULL;
+    struct get_range_args a;
+    hk_init(&a.hk, key, nkey);
+    a.from = from;
+    a.len = len;
+    mt_storage_run(&a.hk, do_item_get_range, &a);
+    hot_record(&a.hk, hs_index(store, &a.hk), a.value ? a.len : 0);
+    if (a.value)
     {
-        it = item_alloc1(key, nkey, flag, vlen + 2);
+        it = item_alloc2(key, nkey, a.flag, a.len + 2, a.total);
         if (it)
         {
-            memcpy(ITEM_data(it), value, vlen); // safe
-            memcpy(ITEM_data(it) + vlen, "\r\n", 2); // safe
+            memcpy(ITEM_data(it), a.value, a.len); // safe
+            memcpy(ITEM_data(it) + a.len, "\r\n", 2); // safe
         }
-        free(value);
+        free(a.value);
     }
     return it;
 }
@@ -0,0 +1,166 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libbeansdb.h"
+#include "common.h"
+#include "hstore.h"
+#include "log.h"
+
+struct beansdb_t
+{
+    HStore *store;
+    bool read_only;
+};
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int opened = 0;
+static bool logging = false;
+
+void beansdb_options_init(beansdb_options *opt)
+{
+    memset(opt, 0, sizeof(beansdb_options));
+    opt->height = 1;
+    opt->threads = 4;
+    opt->max_bucket_size = 4000;
+}
+
+/* the engine reads settings, fill it as main() does for the server */
+static bool init_settings(const beansdb_options *opt)
+{
+    bool ok = true;
+    pthread_mutex_lock(&init_lock);
+    if (opened++ == 0)
+    {
+        settings_init();
+        if (opt->max_bucket_size >= 5 && opt->max_bucket_size <= 4000)
+            settings.max_bucket_size = opt->max_bucket_size << 20;
+        settings.max_memory = opt->max_memory << 20;
+        if (opt->log_conf != NULL)
+        {
+            logging = log_init(opt->log_conf) == 0;
+            if (!logging)
+            {
+                opened--;
+                ok = false;
+            }
+        }
+    }
+    pthread_mutex_unlock(&init_lock);
+    return ok;
+}
+
+static void finish_settings(void)
+{
+    pthread_mutex_lock(&init_lock);
+    if (--opened == 0 && logging)
+    {
+        log_finish();
+        logging = false;
+    }
+    pthread_mutex_unlock(&init_lock);
+}
+
+beansdb *beansdb_open(const char *path, const beansdb_options *opt)
+{
+    beansdb_options defaults;
+    if (opt == NULL)
+    {
+        beansdb_options_init(&defaults);
+        opt = &defaults;
+    }
+    if (path == NULL || !init_settings(opt))
+        return NULL;
+
+    char *p = strdup(path); // hs_open splits it in place
+    HStore *store = hs_open2(p, opt->height, opt->before, opt->threads, opt->read_only);
+    free(p);
+    if (store == NULL)
+    {
+        finish_settings();
+        return NULL;
+    }
+
+    beansdb *db = (beansdb*)safe_malloc(sizeof(beansdb));
+    db->store = store;
+    db->read_only = opt->read_only;
+    return db;
+}
+
+void beansdb_close(beansdb *db)
+{
+    if (db == NULL) return;
+    hs_close(db->store);
+    free(db);
+    finish_settings();
+}
+
+char *beansdb_get(beansdb *db, const char *key, int ksz, unsigned int *vlen, uint32_t *flag)
+{
+    HKey hk;
+    uint32_t f = 0;
+    hk_init(&hk, key, ksz);
+    char *value = hs_get(db->store, &hk, vlen, &f);
+    if (flag != NULL) *flag = f;
+    return value;
+}
+
+bool beansdb_set(beansdb *db, const char *key, int ksz, const char *value, unsigned int vlen,
+                 uint32_t flag)
+{
+    HKey hk;
+    if (db->read_only) return false;
+    hk_init(&hk, key, ksz);
+    return hs_set(db->store, &hk, (char*)value, vlen, flag, 0);
+}
+
+bool beansdb_delete(beansdb *db, const char *key, int ksz)
+{
+    HKey hk;
+    if (db->read_only) return false;
+    hk_init(&hk, key, ksz);
+    return hs_delete(db->store, &hk);
+}
+
+uint64_t beansdb_count(beansdb *db)
+{
+    return hs_count(db->store, NULL);
+}
+
+void beansdb_flush(beansdb *db)
+{
+    if (!db->read_only)
+        hs_flush(db->store, 0, 0);
+}
+
+struct visit_args
+{
+    beansdb_visitor visitor;
+    void *arg;
+    bool stop;
+};
+
+static void visit_item(Item *it, void *param)
+{
+    struct visit_args *args = (struct visit_args*)param;
+    if (!args->stop && !args->visitor(it->key, it->ksz, it->ver, args->arg))
+        args->stop = true;
+}
+
+void beansdb_visit(beansdb *db, beansdb_visitor visitor, void *arg)
+{
+    struct visit_args args = {visitor, arg, false};
+    hs_visit(db->store, visit_item, &args);
+}
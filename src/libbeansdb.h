@@ -0,0 +1,81 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __LIBBEANSDB_H__
+#define __LIBBEANSDB_H__
+
+/*
+ * libbeansdb: the storage engine of beansdb, embedded in a process.
+ *
+ * Only this header is public, the layout of the structures behind it
+ * may change between versions. Link with -lbeansdb -lzlog -lpthread.
+ * The library exports the beansdb_* functions alone, the symbols of the
+ * engine are local to it.
+ *
+ * The engine keeps some process wide state (memory budget, bucket size,
+ * logging), so all the databases opened in a process share the options
+ * of the first one: max_bucket_size, max_memory and log_conf of the
+ * later ones are ignored while it is open.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BEANSDB_API_VERSION 1
+
+typedef struct beansdb_t beansdb;
+
+typedef struct
+{
+    int height;                 /* log16 of the number of db files, as -T */
+    int threads;                /* threads scanning the db files at open */
+    bool read_only;             /* never change the files, see below */
+    time_t before;              /* only the data written before it, 0 for all */
+    uint32_t max_bucket_size;   /* max size of a data file in MB, as -F */
+    uint64_t max_memory;        /* memory limit in MB, as -M, 0 means unlimited */
+    const char *log_conf;       /* zlog config file, NULL to not log */
+} beansdb_options;
+
+/* callback of beansdb_visit, return false to stop */
+typedef bool (*beansdb_visitor)(const char *key, int ksz, int version, void *arg);
+
+void     beansdb_options_init(beansdb_options *opt);
+
+/*
+ * path may be several directories separated by ',' or ':', the same as
+ * -H. A read only database can be opened beside a server running on the
+ * same path, it sees the data as of the time it was opened.
+ */
+beansdb *beansdb_open(const char *path, const beansdb_options *opt);
+void     beansdb_close(beansdb *db);
+
+/* the value should be released by free() */
+char    *beansdb_get(beansdb *db, const char *key, int ksz, unsigned int *vlen, uint32_t *flag);
+bool     beansdb_set(beansdb *db, const char *key, int ksz, const char *value, unsigned int vlen,
+                     uint32_t flag);
+bool     beansdb_delete(beansdb *db, const char *key, int ksz);
+uint64_t beansdb_count(beansdb *db);
+void     beansdb_flush(beansdb *db);
+
+/* visit the live keys, the visitor may call the other functions */
+void     beansdb_visit(beansdb *db, beansdb_visitor visitor, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
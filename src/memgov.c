@@ -0,0 +1,175 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "memgov.h"
+#include "util.h"
+#include "log.h"
+
+#define HIGH_WATERMARK(limit) ((limit) / 10 * 9)
+#define LOW_WATERMARK(limit)  ((limit) / 10 * 8)
+
+typedef struct
+{
+    char name[16];
+    int priority;
+    mg_shrink_func shrink;
+    void *arg;
+    int64_t used;
+    uint64_t released;
+} Consumer;
+
+static Consumer consumers[MG_MAX_CONSUMERS];
+static int nconsumers = 0;
+static int64_t total_used = 0;
+static uint64_t rejected = 0;
+static pthread_mutex_t mg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Register a consumer, or return the existing one with the same name.
+ * shrink may be NULL if the memory can not be released on demand, a
+ * later registration with a shrink function replaces it.
+ */
+int mg_register(const char *name, int priority, mg_shrink_func shrink, void *arg)
+{
+    int i;
+    pthread_mutex_lock(&mg_lock);
+    for (i = 0; i < nconsumers; i++)
+    {
+        if (strcmp(consumers[i].name, name) == 0)
+            break;
+    }
+    if (i == nconsumers)
+    {
+        if (nconsumers == MG_MAX_CONSUMERS)
+        {
+            pthread_mutex_unlock(&mg_lock);
+            log_error("too many memory consumers, %s not registered", name);
+            return -1;
+        }
+        memset(&consumers[i], 0, sizeof(Consumer));
+        safe_snprintf(consumers[i].name, sizeof(consumers[i].name), "%s", name);
+        consumers[i].priority = priority;
+        nconsumers++;
+    }
+    if (shrink != NULL || consumers[i].arg == arg)
+    {
+        consumers[i].shrink = shrink;
+        consumers[i].arg = arg;
+    }
+    pthread_mutex_unlock(&mg_lock);
+    return i;
+}
+
+void mg_charge(int id, int64_t bytes)
+{
+    if (id < 0 || id >= nconsumers) return;
+    __sync_add_and_fetch(&consumers[id].used, bytes);
+    __sync_add_and_fetch(&total_used, bytes);
+}
+
+uint64_t mg_used(void)
+{
+    int64_t used = total_used;
+    return used > 0 ? used : 0;
+}
+
+/*
+ * Backpressure for large allocations: refuse them when they would push
+ * the usage over the limit, the flush thread will reclaim soon.
+ */
+bool mg_admit(size_t bytes)
+{
+    if (settings.max_memory == 0)
+        return true;
+    if (mg_used() + bytes <= settings.max_memory)
+        return true;
+    __sync_add_and_fetch(&rejected, 1);
+    return false;
+}
+
+/*
+ * mg_admit() and mg_charge() in one step, so that concurrent large
+ * allocations can not all pass against the same headroom.
+ */
+bool mg_reserve(int id, size_t bytes)
+{
+    if (id < 0 || id >= nconsumers)
+        return mg_admit(bytes);
+    int64_t used = __sync_add_and_fetch(&total_used, (int64_t)bytes);
+    if (settings.max_memory > 0 && (uint64_t)used > settings.max_memory)
+    {
+        __sync_sub_and_fetch(&total_used, (int64_t)bytes);
+        __sync_add_and_fetch(&rejected, 1);
+        return false;
+    }
+    __sync_add_and_fetch(&consumers[id].used, (int64_t)bytes);
+    return true;
+}
+
+/*
+ * Called periodically from the flush thread. Once the usage goes over
+ * the high watermark, shrink consumers in priority order until it gets
+ * under the low watermark.
+ */
+void mg_reclaim(void)
+{
+    uint64_t limit = settings.max_memory;
+    if (limit == 0 || mg_used() <= HIGH_WATERMARK(limit))
+        return;
+
+    pthread_mutex_lock(&mg_lock);
+    int prio, i;
+    uint64_t before = mg_used();
+    for (prio = MG_PRIO_CACHE; prio <= MG_PRIO_INDEX; prio++)
+    {
+        for (i = 0; i < nconsumers; i++)
+        {
+            uint64_t used = mg_used();
+            if (used <= LOW_WATERMARK(limit))
+                goto RECLAIM_END;
+            Consumer *c = &consumers[i];
+            if (c->priority != prio || c->shrink == NULL || c->used <= 0)
+                continue;
+            size_t n = c->shrink(used - LOW_WATERMARK(limit), c->arg);
+            c->released += n;
+        }
+    }
+
+RECLAIM_END:
+    pthread_mutex_unlock(&mg_lock);
+    log_notice("memory reclaimed: %"PRIu64" -> %"PRIu64", limit %"PRIu64"",
+            before, mg_used(), limit);
+}
+
+int mg_stat(char *buf, int size)
+{
+    int i, n = 0;
+    n += safe_snprintf(buf + n, size - n, "STAT mem_limit %"PRIu64"\r\n", settings.max_memory);
+    n += safe_snprintf(buf + n, size - n, "STAT mem_used %"PRIu64"\r\n", mg_used());
+    n += safe_snprintf(buf + n, size - n, "STAT mem_rejected %"PRIu64"\r\n", rejected);
+    pthread_mutex_lock(&mg_lock);
+    for (i = 0; i < nconsumers; i++)
+    {
+        n += safe_snprintf(buf + n, size - n, "STAT mem_%s %"PRId64"\r\n",
+                consumers[i].name, consumers[i].used);
+        n += safe_snprintf(buf + n, size - n, "STAT mem_%s_released %"PRIu64"\r\n",
+                consumers[i].name, consumers[i].released);
+    }
+    pthread_mutex_unlock(&mg_lock);
+    return n;
+}
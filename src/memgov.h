@@ -0,0 +1,46 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __MEMGOV_H__
+#define __MEMGOV_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+/*
+ * Memory governor: a single budget (settings.max_memory) shared by all
+ * the big memory consumers. Consumers charge their allocations, and
+ * register a shrink function which is called under pressure, lowest
+ * priority first.
+ */
+
+#define MG_MAX_CONSUMERS 16
+
+#define MG_PRIO_CACHE  0    /* free lists, can be dropped at any time */
+#define MG_PRIO_BUFFER 1    /* write buffers, shrunk by forcing flush */
+#define MG_PRIO_INDEX  2    /* hash trees, never shrunk */
+
+/* try to release at least goal bytes, return the bytes released */
+typedef size_t (*mg_shrink_func)(size_t goal, void *arg);
+
+int      mg_register(const char *name, int priority, mg_shrink_func shrink, void *arg);
+void     mg_charge(int id, int64_t bytes);
+uint64_t mg_used(void);
+bool     mg_admit(size_t bytes);
+/* charge bytes only if they fit in the budget */
+bool     mg_reserve(int id, size_t bytes);
+void     mg_reclaim(void);
+int      mg_stat(char *buf, int size);
+
+#endif
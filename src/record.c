@@ -30,6 +30,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <inttypes.h>
 
 #include "record.h"
 #include "hint.h"
@@ -37,16 +40,21 @@
 #include "diskmgr.h"
 #include "quicklz.h"
 #include "fnv1a.h"
+#include "dict.h"
+#include "blob.h"
 
 #include "mfile.h"
 #include "util.h"
 #include "const.h"
 #include "log.h"
+#include "ioclass.h"
 
 
 const int PADDING = 256;
 const int32_t COMPRESS_FLAG = 0x00010000;
 const int32_t CLIENT_COMPRESS_FLAG = 0x00000010;
+const int32_t DICT_FLAG = 0x00020000;
+const int32_t DEDUP_FLAG = 0x00040000;
 const float COMPRESS_RATIO_LIMIT = 0.7;
 const int TRY_COMPRESS_SIZE = 1024 * 10;
 
@@ -71,6 +79,14 @@ uint32_t gen_hash(char *buf, int len)
     return hash;
 }
 
+/* the hash of the value, which a reference to a blob keeps */
+uint16_t record_hash(DataRecord *r)
+{
+    if (r->flag & DEDUP_FLAG)
+        return blob_hash(r->value);
+    return gen_hash(r->value, r->vsz);
+}
+
 int record_length(DataRecord *r)
 {
     size_t n = sizeof(DataRecord) - sizeof(char*) + r->ksz + r->vsz;
@@ -103,16 +119,105 @@ void free_record(DataRecord **r)
     *r = NULL;
 }
 
+/*
+ * Values of some kinds (JPEG, MP3) never compress, so the outcomes of the
+ * trials are kept by the flag and the size of the values, and a class
+ * whose values hardly compress is only tried once in COMPRESS_PROBE,
+ * in case its values change. The first FLAG_CLASSES flags seen get
+ * classes of their own, the later ones share an overflow class.
+ */
+#define FLAG_CLASSES        64
+#define SIZE_CLASSES        32      /* by log2 of the size */
+#define COMPRESS_MIN_TRIES  16      /* before a class can be skipped */
+#define COMPRESS_MIN_WINS   0.05    /* of the tries, or the class is skipped */
+#define COMPRESS_PROBE      256
+#define COMPRESS_HISTORY    1024    /* tries and wins are halved beyond it */
+
+#define IO_CHUNK            (1 << 20)   /* of optimizing, accounted and throttled at once */
+
+#define SLOT_FREE           0
+#define SLOT_TAKEN          1       /* its flag is being set */
+#define SLOT_READY          2
+
+typedef struct
+{
+    uint32_t tries, wins, skips;
+    uint64_t saved, nsecs;
+} CompressClass;
+
+// updated without locking, good enough for a heuristic and the stats
+static CompressClass classes[FLAG_CLASSES + 1][SIZE_CLASSES];
+// the flags of the classes, open addressed, taken once and for all
+static int32_t class_flags[FLAG_CLASSES];
+static volatile int class_slots[FLAG_CLASSES];
+
+static int flag_class(int32_t flag)
+{
+    uint32_t f = flag, h = (f ^ (f >> 6) ^ (f >> 12) ^ (f >> 18)) % FLAG_CLASSES;
+    int i;
+    for (i = 0; i < FLAG_CLASSES; i++)
+    {
+        int s = (h + i) % FLAG_CLASSES;
+        if (class_slots[s] == SLOT_FREE && __sync_bool_compare_and_swap(&class_slots[s], SLOT_FREE, SLOT_TAKEN))
+        {
+            class_flags[s] = flag;
+            __sync_synchronize();
+            class_slots[s] = SLOT_READY;
+            return s;
+        }
+        while (class_slots[s] == SLOT_TAKEN)
+            sched_yield();
+        __sync_synchronize();
+        if (class_flags[s] == flag)
+            return s;
+    }
+    return FLAG_CLASSES;
+}
+
+static inline CompressClass *compress_class(int32_t flag, int vsz, int *size_class)
+{
+    int k = 0;
+    while (k < SIZE_CLASSES - 1 && (vsz >> (k + 1)) > 0)
+        k++;
+    *size_class = k;
+    return &classes[flag_class(flag)][k];
+}
+
+static inline uint64_t cpu_nsecs(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
 void compress_record(DataRecord *r)
 {
-    if (r->flag & COMPRESS_FLAG) return;
+    if (r->flag & (COMPRESS_FLAG|DICT_FLAG|DEDUP_FLAG)) return;
     int ksz = r->ksz, vsz = r->vsz;
     int n = sizeof(DataRecord) - sizeof(char*) + ksz + vsz;
     if (n > PADDING && (r->flag & (COMPRESS_FLAG|CLIENT_COMPRESS_FLAG)) == 0)
     {
+        int k;
+        CompressClass *cc = compress_class(r->flag, vsz, &k);
+        if (cc->tries >= COMPRESS_MIN_TRIES && cc->wins < cc->tries * COMPRESS_MIN_WINS
+                && ++cc->skips % COMPRESS_PROBE != 0)
+            return;
+
         char *wbuf = (char*)try_malloc(QLZ_SCRATCH_COMPRESS);
         char *v = (char*)try_malloc(vsz + 400);
-        if (wbuf == NULL || v == NULL) return ;
+        if (wbuf == NULL || v == NULL)
+        {
+            free(wbuf);
+            free(v);
+            return;
+        }
+        uint64_t start = cpu_nsecs();
         int try_size = vsz > TRY_COMPRESS_SIZE ? TRY_COMPRESS_SIZE : vsz;
         int vsize = qlz_compress(r->value, v, try_size, wbuf);
         if (try_size < vsz && vsize < try_size * COMPRESS_RATIO_LIMIT)
@@ -122,11 +227,20 @@ void compress_record(DataRecord *r)
         }
         free(wbuf);
 
+        if (cc->tries >= COMPRESS_HISTORY)
+        {
+            cc->tries /= 2;
+            cc->wins /= 2;
+        }
+        cc->tries++;
+        cc->nsecs += cpu_nsecs() - start;
         if (vsize > try_size * COMPRESS_RATIO_LIMIT || try_size < vsz)
         {
             free(v);
             return;
         }
+        cc->wins++;
+        cc->saved += vsz - vsize;
 
         if (r->free_value)
         {
@@ -139,8 +253,107 @@ void compress_record(DataRecord *r)
     }
 }
 
+/* the totals, and every class seen with detail */
+int compress_stat(char *buf, int size, bool detail)
+{
+    uint64_t tries = 0, wins = 0, skips = 0, saved = 0, nsecs = 0;
+    int i, k, n = 0;
+    char name[16];
+    for (i = 0; i <= FLAG_CLASSES; i++)
+    {
+        if (i < FLAG_CLASSES)
+            safe_snprintf(name, sizeof(name), "%x", class_flags[i]);
+        else
+            safe_snprintf(name, sizeof(name), "other");
+        for (k = 0; k < SIZE_CLASSES; k++)
+        {
+            CompressClass *cc = &classes[i][k];
+            if (cc->tries == 0 && cc->skips == 0)
+                continue;
+            tries += cc->tries;
+            wins += cc->wins;
+            skips += cc->skips;
+            saved += cc->saved;
+            nsecs += cc->nsecs;
+            if (!detail || size - n < 512) // leave room for the totals
+                continue;
+            n += safe_snprintf(buf + n, size - n, "STAT %s_%u:tries %u\r\n", name, 1U << k, cc->tries);
+            n += safe_snprintf(buf + n, size - n, "STAT %s_%u:wins %u\r\n", name, 1U << k, cc->wins);
+            n += safe_snprintf(buf + n, size - n, "STAT %s_%u:skips %u\r\n", name, 1U << k, cc->skips);
+            n += safe_snprintf(buf + n, size - n, "STAT %s_%u:bytes_saved %"PRIu64"\r\n", name, 1U << k, cc->saved);
+            n += safe_snprintf(buf + n, size - n, "STAT %s_%u:cpu_usec %"PRIu64"\r\n", name, 1U << k, cc->nsecs / 1000);
+        }
+    }
+    n += safe_snprintf(buf + n, size - n, "STAT compress_tries %"PRIu64"\r\n", tries);
+    n += safe_snprintf(buf + n, size - n, "STAT compress_wins %"PRIu64"\r\n", wins);
+    n += safe_snprintf(buf + n, size - n, "STAT compress_skips %"PRIu64"\r\n", skips);
+    n += safe_snprintf(buf + n, size - n, "STAT compress_bytes_saved %"PRIu64"\r\n", saved);
+    n += safe_snprintf(buf + n, size - n, "STAT compress_cpu_usec %"PRIu64"\r\n", nsecs / 1000);
+    return n;
+}
+
+/*
+ * Compress a small value with the dictionary of its bitcask, only when
+ * it makes the record take less room: a record is padded to PADDING.
+ */
+void compress_record_dict(DataRecord *r, const Dict *d)
+{
+    if (d == NULL || (r->flag & (COMPRESS_FLAG|CLIENT_COMPRESS_FLAG|DICT_FLAG|DEDUP_FLAG))
+            || r->vsz < DICT_MIN_VALUE || r->vsz > DICT_MAX_VALUE)
+        return;
+
+    char *v = (char*)try_malloc(r->vsz);
+    if (v == NULL) return;
+    int vsize = dict_compress(d, r->value, r->vsz, v, r->vsz);
+    int before = record_length(r);
+    int vsz = r->vsz;
+    r->vsz = vsize;
+    if (vsize < 0 || record_length(r) >= before)
+    {
+        r->vsz = vsz;
+        free(v);
+        return;
+    }
+
+    if (r->free_value)
+    {
+        free(r->value);
+    }
+    r->value = v;
+    r->free_value = true;
+    r->flag |= DICT_FLAG;
+}
+
+DataRecord *decompress_dict_record(DataRecord *r)
+{
+    if (r->flag & DICT_FLAG)
+    {
+        unsigned int size = 0;
+        char *v = dict_decompress(r->value, r->vsz, &size);
+        if (v == NULL)
+        {
+            log_error("decompress %s with dictionary failed, flag=%x", r->key, r->flag);
+            free_record(&r);
+            return NULL;
+        }
+        if (r->free_value)
+        {
+            free(r->value);
+        }
+        r->value = v;
+        r->free_value = true;
+        r->vsz = size;
+        r->flag &= ~DICT_FLAG;
+    }
+    return r;
+}
+
 DataRecord *decompress_record(DataRecord *r)
 {
+    if (r->flag & DICT_FLAG)
+    {
+        return decompress_dict_record(r);
+    }
     if (r->flag & COMPRESS_FLAG)
     {
         char scratch[QLZ_SCRATCH_DECOMPRESS];
@@ -369,10 +582,97 @@ READ_END:
     return NULL;
 }
 
-DataRecord *fast_read_record(int fd, off_t offset, bool decomp, const char *path, const char *key)
+struct record_stream
+{
+    int fd, disk;
+    off_t pos;          // of the next chunk
+    uint32_t left;      // bytes of the value not read yet
+    uint32_t crc;       // of the record read so far
+    uint32_t stored;    // the checksum in the record
+    int32_t flag;
+    uint32_t vsz;
+    char path[MAX_PATH_LEN];
+};
+
+static RecordStream *open_record_stream(int fd, int disk, off_t offset, const DataRecord *r, const char *path)
+{
+    int hsz = sizeof(DataRecord) - sizeof(char*);
+    RecordStream *s = (RecordStream*)safe_malloc(sizeof(RecordStream));
+    s->fd = fd;
+    s->disk = disk;
+    s->pos = offset + hsz + r->ksz;
+    s->left = r->vsz;
+    s->crc = crc32(0, (unsigned char*)&r->tstamp, hsz - sizeof(uint32_t) + r->ksz);
+    s->stored = r->crc;
+    s->flag = r->flag;
+    s->vsz = r->vsz;
+    safe_snprintf(s->path, MAX_PATH_LEN, "%s", path);
+    return s;
+}
+
+/*
+ * Read the next chunk of the value into buf, return its size, 0 at the end
+ * or -1 on failure. The checksum is verified before the last chunk is
+ * returned.
+ */
+int read_record_stream(RecordStream *s, char *buf, int size)
+{
+    if (s->left == 0)
+        return 0;
+    int n = min((uint32_t)size, s->left);
+    double start = io_time();
+    ssize_t ret = pread(s->fd, buf, n, s->pos);
+    io_account(s->disk, false, max(ret, 0), io_time() - start);
+    if (ret != n)
+    {
+        log_error("PREAD %zd < %d, %s @%lld", ret, n, s->path, (long long)s->pos);
+        return -1;
+    }
+    s->crc = crc32(s->crc, (unsigned char*)buf, n);
+    s->pos += n;
+    s->left -= n;
+    if (s->left == 0 && s->crc != s->stored)
+    {
+        log_error("CHECKSUM %u != %u, %s @%lld", s->crc, s->stored, s->path,
+                (long long)(s->pos - s->vsz));
+        return -1;
+    }
+    return n;
+}
+
+uint32_t record_stream_size(const RecordStream *s)
+{
+    return s->vsz;
+}
+
+int32_t record_stream_flag(const RecordStream *s)
+{
+    return s->flag;
+}
+
+void close_record_stream(RecordStream *s)
+{
+    if (s == NULL) return;
+    close(s->fd);
+    free(s);
+}
+
+DataRecord *fast_read_record(int fd, int disk, off_t offset, bool decomp, const char *path, const char *key)
+{
+    return fast_read_record2(fd, disk, offset, decomp, path, key, 0, NULL);
+}
+
+/*
+ * As fast_read_record(), but the uncompressed value of stream_size bytes or
+ * more of the key is not read: *stream is set to read it a chunk at a time,
+ * taking fd, and NULL is returned.
+ */
+DataRecord *fast_read_record2(int fd, int disk, off_t offset, bool decomp, const char *path, const char *key,
+        uint32_t stream_size, RecordStream **stream)
 {
     DataRecord *r = (DataRecord*) safe_malloc(max(sizeof(DataRecord) + MAX_KEY_LEN, PADDING + sizeof(char*)) + 1);
     r->value = NULL;
+    double start = io_time();
 
     if (pread(fd, &r->crc, PADDING, offset) != PADDING)
     {
@@ -387,6 +687,16 @@ DataRecord *fast_read_record(int fd, off_t offset, bool decomp, const char *path
                 r->ksz, r->vsz, path, (long long)offset, key);
         goto READ_END;
     }
+    if (stream != NULL && r->vsz >= stream_size
+            && sizeof(DataRecord) - sizeof(char*) + r->ksz <= (size_t)PADDING
+            && (r->flag & (COMPRESS_FLAG | DICT_FLAG | DEDUP_FLAG)) == 0
+            && strncmp(key, r->key, r->ksz) == 0 && key[r->ksz] == 0)
+    {
+        io_account(disk, false, PADDING, io_time() - start);
+        *stream = open_record_stream(fd, disk, offset, r, path);
+        free(r);
+        return NULL;
+    }
     int ksz = r->ksz, vsz = r->vsz;
     uint32_t crc_old = r->crc;
     int read_more = (sizeof(DataRecord) - sizeof(char*)) + ksz + vsz - PADDING;
@@ -428,6 +738,7 @@ DataRecord *fast_read_record(int fd, off_t offset, bool decomp, const char *path
         }
     }
     r->key[ksz] = 0; // c str
+    io_account(disk, false, PADDING + max(read_more, 0), io_time() - start);
 
     uint32_t crc = crc32(0, (unsigned char*)(&r->tstamp),
                          sizeof(DataRecord) - sizeof(char*) - sizeof(uint32_t) + ksz);
@@ -449,6 +760,51 @@ READ_END:
     return NULL;
 }
 
+/*
+ * Read only the header and the key of the record at offset, value is NULL.
+ * The checksum covers the whole record, so it is not verified.
+ */
+DataRecord *fast_read_header(int fd, int disk, off_t offset, const char *path, const char *key)
+{
+    DataRecord *r = (DataRecord*) safe_malloc(sizeof(DataRecord) + MAX_KEY_LEN + 1);
+    int hsz = sizeof(DataRecord) - sizeof(char*);
+    r->value = NULL;
+    double start = io_time();
+
+    ssize_t n = pread(fd, &r->crc, hsz + MAX_KEY_LEN, offset);
+    io_account(disk, false, max(n, 0), io_time() - start);
+    if (n < hsz || bad_kv_size(r->ksz, r->vsz) || n < hsz + (ssize_t)r->ksz)
+    {
+        log_error("read header fail, %s @%lld, key = %s", path, (long long)offset, key);
+        free(r);
+        return NULL;
+    }
+    r->key[r->ksz] = 0; // c str
+    return r;
+}
+
+/*
+ * Read len bytes of the value of the record r at offset, from byte from on,
+ * the caller makes sure they are in the value.
+ */
+char *fast_read_value(int fd, int disk, off_t offset, const DataRecord *r, uint32_t from, uint32_t len, const char *path)
+{
+    char *value = (char*)try_malloc(max(len, 1));
+    if (value == NULL)
+        return NULL;
+    off_t pos = offset + sizeof(DataRecord) - sizeof(char*) + r->ksz + from;
+    double start = io_time();
+    ssize_t n = pread(fd, value, len, pos);
+    io_account(disk, false, max(n, 0), io_time() - start);
+    if (n != (ssize_t)len)
+    {
+        log_error("PREAD %zd < %u, %s @%lld, key = %s", n, len, path, (long long)pos, r->key);
+        free(value);
+        return NULL;
+    }
+    return value;
+}
+
 char *encode_record(DataRecord *r, unsigned int *size)
 {
     compress_record(r);
@@ -515,7 +871,7 @@ void scanDataFile(HTree *tree, int bucket, const char *path, const char *hintpat
             log_error("decompress_record fail, %s @%u size = %ld", path, pos, p - (pos + f->addr));
             continue;
         }
-        uint16_t hash = gen_hash(r->value, r->vsz);
+        uint16_t hash = record_hash(r);
         if (check_key(r->key, r->ksz))
         {
             if (r->version > 0)
@@ -564,7 +920,7 @@ void scanDataFileBefore(HTree *tree, int bucket, const char *path, time_t before
         {
             if (r->version > 0)
             {
-                uint16_t hash = gen_hash(r->value, r->vsz);
+                uint16_t hash = record_hash(r);
                 ht_add2(tree, r->key, r->ksz, pos | bucket, hash, r->version);
             }
             else
@@ -578,6 +934,35 @@ void scanDataFileBefore(HTree *tree, int bucket, const char *path, time_t before
     close_mfile(f);
 }
 
+/* visit the good records of a data file in order, until the visitor returns false */
+void visit_record(const char *path, RecordVisitor visitor, void *arg1, void *arg2, bool decomp)
+{
+    MFile *f = open_mfile(path);
+    if (f == NULL) return;
+
+    char *p = f->addr, *end = f->addr + f->size;
+    size_t last_advise = 0;
+    while (p < end)
+    {
+        DataRecord *r = decode_record(p, end - p, false, path, p - f->addr, "nokey", false, NULL);
+        if (r == NULL)
+        {
+            p += PADDING;
+            continue;
+        }
+        p += record_length(r);
+        if (decomp && (r = decompress_record(r)) == NULL)
+            continue;
+        bool more = visitor(r, arg1, arg2);
+        free_record(&r);
+        if (!more)
+            break;
+        mfile_dontneed(f, p - f->addr, &last_advise);
+    }
+    io_account(mgr_disk_of(f->fd), false, p - f->addr, 0); // mmaped, latency unknown
+    close_mfile(f);
+}
+
 // update pos in HTree
 void update_items(Item *it, void *args)
 {
@@ -603,9 +988,14 @@ void update_items(Item *it, void *args)
         ht_add(tree, it->key, it->pos, it->hash, it->ver);
     }
 }
+
+/*
+ * on_drop, if not NULL, is called for every record dropped, which only
+ * counts if it returns 0.
+ */
 int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const char *hintpath,
         int last_bucket, const char *lastdata, const char *lasthint_real, uint32_t max_data_size,
-        bool skipped, bool use_tmp, uint32_t *deleted_bytes)
+        bool skipped, bool use_tmp, uint32_t *deleted_bytes, RecordVisitor on_drop, void *arg)
 {
 
     struct timeval opt_start, opt_end, update_start, update_end;
@@ -688,9 +1078,21 @@ int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const
     int nrecord = 0, deleted = 0, broken = 0, released = 0;
     char *p = f->addr, *end = f->addr + f->size;
     char *newp = p;
-    size_t last_advise = 0;
+    size_t last_advise = 0, last_io = 0, written = 0;
+    double write_secs = 0;
+    int src_disk = mgr_disk_of(f->fd), dst_disk = mgr_disk_of(fileno(new_df));
     while (p < end)
     {
+        if ((size_t)(p - f->addr) - last_io >= IO_CHUNK)
+        {
+            io_account(src_disk, false, (p - f->addr) - last_io, 0); // mmaped, latency unknown
+            if (written > 0)
+                io_account(dst_disk, true, written, write_secs);
+            last_io = p - f->addr;
+            written = 0;
+            write_secs = 0;
+            io_throttle();
+        }
         DataRecord *r = scan_record(f->addr, end, &p, path, &broken, tree, bucket);
         if (r == NULL)
         {
@@ -745,7 +1147,11 @@ int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const
             hint_used += hsize;
 
             r->version = it->ver;
-            if (write_record(new_df, r) != 0)
+            double start = io_time();
+            int ret = write_record(new_df, r);
+            written += record_length(r);
+            write_secs += io_time() - start;
+            if (ret != 0)
             {
                 log_error("write error: %s -> %d", path, last_bucket);
                 free(it);
@@ -760,6 +1166,8 @@ int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const
                 deleted++;
                 ht_add2(cur_tree, r->key, r->ksz, 0, it->hash, it->ver);
             }
+            if (on_drop != NULL)
+                on_drop(r, arg, NULL);
             released++;
         }
         if (it) free(it);
@@ -770,6 +1178,9 @@ int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const
     }
     fseeko(new_df, 0L, SEEK_END);
     *deleted_bytes = f->size - (ftello(new_df) - new_df_orig_size);
+    io_account(src_disk, false, f->size - last_io, 0); // mmaped, latency unknown
+    if (written > 0)
+        io_account(dst_disk, true, written, write_secs);
 
     close_mfile(f);
     fclose(new_df);
@@ -23,6 +23,7 @@
 #include "htree.h"
 #include "util.h"
 #include "diskmgr.h"
+#include "dict.h"
 
 
 typedef struct data_record
@@ -41,9 +42,15 @@ typedef struct data_record
     char key[0];
 } DataRecord;
 
+extern const int32_t COMPRESS_FLAG, CLIENT_COMPRESS_FLAG, DICT_FLAG, DEDUP_FLAG;
+
 typedef bool (*RecordVisitor)(DataRecord *r, void *arg1, void *arg2);
 
+// the value of a record read from its data file a chunk at a time
+typedef struct record_stream RecordStream;
+
 uint32_t gen_hash(char *buf, int size);
+uint16_t record_hash(DataRecord *r);
 
 char* record_value(DataRecord *r);
 void free_record(DataRecord **r);
@@ -55,15 +62,27 @@ void free_record(DataRecord **r);
 #define BAD_REC_DECOMPRESS 4
 DataRecord* decode_record(char *buf, uint32_t size, bool decomp, const char *path, uint32_t pos, const char *key, bool do_logging, int *fail_reason);
 
+void compress_record_dict(DataRecord *r, const Dict *d);
+int compress_stat(char *buf, int size, bool detail);
+DataRecord* decompress_dict_record(DataRecord *r);
 char* encode_record(DataRecord *r, unsigned int *size);
 DataRecord* read_record(FILE *f, bool decomp, const char *path, const char *key);
-DataRecord* fast_read_record(int fd, off_t offset, bool decomp, const char *path, const char *key);
+// disk is from mgr_disk_of(fd), for io_account()
+DataRecord* fast_read_record(int fd, int disk, off_t offset, bool decomp, const char *path, const char *key);
+DataRecord* fast_read_record2(int fd, int disk, off_t offset, bool decomp, const char *path, const char *key,
+        uint32_t stream_size, RecordStream **stream);
+DataRecord* fast_read_header(int fd, int disk, off_t offset, const char *path, const char *key);
+char* fast_read_value(int fd, int disk, off_t offset, const DataRecord *r, uint32_t from, uint32_t len, const char *path);
+int read_record_stream(RecordStream *s, char *buf, int size);
+uint32_t record_stream_size(const RecordStream *s);
+int32_t record_stream_flag(const RecordStream *s);
+void close_record_stream(RecordStream *s);
 
 void scanDataFile(HTree *tree, int bucket, const char *path, const char *hintpath);
 void scanDataFileBefore(HTree *tree, int bucket, const char *path, time_t before);
 int optimizeDataFile(HTree *tree, Mgr *mgr, int bucket, const char *path, const char *hintpath,
         int last_bucket, const char *lastdata, const char *lasthint_real, uint32_t max_data_size,
-        bool skipped, bool isnewfile, uint32_t *deleted_bytes);
+        bool skipped, bool isnewfile, uint32_t *deleted_bytes, RecordVisitor on_drop, void *arg);
 void visit_record(const char *path, RecordVisitor visitor, void *arg1, void *arg2, bool decomp);
 
 #endif
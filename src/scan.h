@@ -0,0 +1,89 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Byte scanners for the hot paths of the text protocol, 16 bytes at a
+ * time with SSE2 (always there on x86_64), byte by byte elsewhere.
+ */
+
+/*
+ * Returns the first ' ' or '\0' at or after s. The loads are aligned, so
+ * they never cross into the next page even when they read past the end
+ * of the string.
+ */
+static inline char *scan_separator(char *s)
+{
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int off = (uintptr_t)s & 15;
+    const __m128i *p = (const __m128i *)(s - off);
+    __m128i v = _mm_load_si128(p);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                          _mm_cmpeq_epi8(v, zero))) >> off;
+    if (mask)
+        return s + __builtin_ctz(mask);
+    for (;;)
+    {
+        v = _mm_load_si128(++p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                 _mm_cmpeq_epi8(v, zero)));
+        if (mask)
+            return (char *)p + __builtin_ctz(mask);
+    }
+#else
+    while (*s != ' ' && *s != '\0')
+        s++;
+    return s;
+#endif
+}
+
+/*
+ * Whether all the len bytes are allowed in a key: no spaces and no
+ * control characters, the same as isspace() || iscntrl() in the C locale.
+ */
+static inline bool scan_key_bytes(const char *key, int len)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(key + i));
+        /* unsigned v <= ' ' iff max(v, ' ') == ' ' */
+        __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space),
+                                   _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(bad))
+            return false;
+    }
+#endif
+    for (; i < len; i++)
+    {
+        unsigned char c = key[i];
+        if (c <= ' ' || c == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-256 as in FIPS 180-4 */
+
+#define SHA256_SIZE 32
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_SIZE]);
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "taskpool.h"
+#include "ioclass.h"
+#include "affinity.h"
+#include "util.h"
+#include "log.h"
+
+#define DEFAULT_THREADS 4
+
+typedef struct task
+{
+    int prio;
+    tp_func func;
+    void *arg;
+    TaskGroup *group;
+    struct task *next;
+} Task;
+
+static const char *prio_names[TP_PRIOS] = {"high", "hint", "gc"};
+
+static Task *heads[TP_PRIOS], *tails[TP_PRIOS];
+static int queued[TP_PRIOS], running[TP_PRIOS];
+static uint64_t completed[TP_PRIOS];
+static int nthreads = 0;
+static pthread_mutex_t tp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tp_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tp_done = PTHREAD_COND_INITIALIZER;
+
+static int prio_limit(int prio)
+{
+    switch (prio)
+    {
+    case TP_PRIO_HINT:
+        return settings.bg_threads > 0 ? settings.bg_threads : 1;
+    case TP_PRIO_GC:
+        return 1;
+    default:
+        return nthreads;
+    }
+}
+
+// should be called with tp_lock held
+static Task *next_task(void)
+{
+    int prio;
+    for (prio = 0; prio < TP_PRIOS; prio++)
+    {
+        Task *t = heads[prio];
+        if (t == NULL || running[prio] >= prio_limit(prio))
+            continue;
+        heads[prio] = t->next;
+        if (heads[prio] == NULL)
+            tails[prio] = NULL;
+        queued[prio]--;
+        running[prio]++;
+        return t;
+    }
+    return NULL;
+}
+
+static void *worker(void *arg)
+{
+    pthread_mutex_lock(&tp_lock);
+    for (;;)
+    {
+        Task *t = next_task();
+        if (t == NULL)
+        {
+            pthread_cond_wait(&tp_ready, &tp_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&tp_lock);
+
+        aff_set_class(t->prio == TP_PRIO_HIGH ? AFF_SCAN : AFF_GC, 0);
+        t->func(t->arg);
+        if (io_get_class() != IO_READ)
+            io_set_class(IO_READ);
+
+        pthread_mutex_lock(&tp_lock);
+        running[t->prio]--;
+        completed[t->prio]++;
+        if (t->group != NULL)
+            t->group->pending--;
+        free(t);
+        pthread_cond_broadcast(&tp_done);
+    }
+    return NULL;
+}
+
+/*
+ * Make sure there are at least n workers, the pool never shrinks.
+ */
+void tp_start(int n)
+{
+    pthread_mutex_lock(&tp_lock);
+    for (; nthreads < n; nthreads++)
+    {
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, worker, NULL);
+        if (ret != 0)
+        {
+            log_fatal("Can't create thread: %s", strerror(ret));
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    pthread_mutex_unlock(&tp_lock);
+}
+
+void tp_submit(int prio, tp_func func, void *arg, TaskGroup *group)
+{
+    if (nthreads == 0)
+        tp_start(DEFAULT_THREADS);
+    if (prio < 0 || prio >= TP_PRIOS)
+        prio = TP_PRIO_HIGH;
+
+    Task *t = (Task*)safe_malloc(sizeof(Task));
+    t->prio = prio;
+    t->func = func;
+    t->arg = arg;
+    t->group = group;
+    t->next = NULL;
+
+    pthread_mutex_lock(&tp_lock);
+    if (tails[prio] != NULL)
+        tails[prio]->next = t;
+    else
+        heads[prio] = t;
+    tails[prio] = t;
+    queued[prio]++;
+    if (group != NULL)
+        group->pending++;
+    pthread_cond_signal(&tp_ready);
+    pthread_mutex_unlock(&tp_lock);
+}
+
+void tp_wait(TaskGroup *group)
+{
+    pthread_mutex_lock(&tp_lock);
+    while (group->pending > 0)
+        pthread_cond_wait(&tp_done, &tp_lock);
+    pthread_mutex_unlock(&tp_lock);
+}
+
+/*
+ * Wait for all the queued and running tasks, should not be called
+ * from a task.
+ */
+void tp_drain(void)
+{
+    int prio;
+    pthread_mutex_lock(&tp_lock);
+    for (prio = 0; prio < TP_PRIOS; prio++)
+    {
+        if (queued[prio] > 0 || running[prio] > 0)
+        {
+            pthread_cond_wait(&tp_done, &tp_lock);
+            prio = -1; // check all of them again
+        }
+    }
+    pthread_mutex_unlock(&tp_lock);
+}
+
+int tp_queued(void)
+{
+    int prio, n = 0;
+    pthread_mutex_lock(&tp_lock);
+    for (prio = 0; prio < TP_PRIOS; prio++)
+        n += queued[prio];
+    pthread_mutex_unlock(&tp_lock);
+    return n;
+}
+
+int tp_stat(char *buf, int size)
+{
+    int prio, n = 0;
+    pthread_mutex_lock(&tp_lock);
+    n += safe_snprintf(buf + n, size - n, "STAT task_threads %d\r\n", nthreads);
+    for (prio = 0; prio < TP_PRIOS; prio++)
+    {
+        n += safe_snprintf(buf + n, size - n, "STAT task_%s_queued %d\r\n", prio_names[prio], queued[prio]);
+        n += safe_snprintf(buf + n, size - n, "STAT task_%s_running %d\r\n", prio_names[prio], running[prio]);
+        n += safe_snprintf(buf + n, size - n, "STAT task_%s_completed %"PRIu64"\r\n",
+                prio_names[prio], completed[prio]);
+    }
+    pthread_mutex_unlock(&tp_lock);
+    return n;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *      http://beansdb.googlecode.com
+ *
+ *  Copyright 2009 Douban Inc.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+#ifndef __TASKPOOL_H__
+#define __TASKPOOL_H__
+
+#include "common.h"
+
+/*
+ * Task pool: a fixed set of worker threads shared by all background
+ * work, instead of a new thread per job. Queued tasks run in priority
+ * order, and each priority can only take a limited number of workers,
+ * so a burst of rotations can not starve opening or closing the store.
+ */
+
+#define TP_PRIO_HIGH   0    /* somebody is waiting for it: scan, close */
+#define TP_PRIO_HINT   1    /* building hint files, at most settings.bg_threads */
+#define TP_PRIO_GC     2    /* optimizing, at most one */
+#define TP_PRIOS       3
+
+typedef void (*tp_func)(void *arg);
+
+/* a set of tasks to wait for, zero it before the first submit */
+typedef struct
+{
+    int pending;
+} TaskGroup;
+
+void tp_start(int nthreads);
+void tp_submit(int prio, tp_func func, void *arg, TaskGroup *group);
+void tp_wait(TaskGroup *group);
+void tp_drain(void);
+int  tp_queued(void);
+int  tp_stat(char *buf, int size);
+
+#endif
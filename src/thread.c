@@ -25,15 +25,24 @@
 #endif
 
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "hstore.h"
+#include "affinity.h"
 #include "util.h"
 #include "log.h"
 
+extern HStore *store;
+
 typedef struct EventLoop
 {
     conn* conns[AE_SETSIZE];
     int   fired[AE_SETSIZE];
     int   nready;
+    int   setsize;  /* max events fetched in one poll */
+    struct timespec poll_time;
     void* apidata;
+    int   wakefd;   /* eventfd for forwarded calls, with -O only */
 } EventLoop;
 
 /* Lock for connection freelist */
@@ -42,8 +51,53 @@ static pthread_mutex_t conn_lock;
 /* Lock for item buffer freelist */
 static pthread_mutex_t ibuffer_lock;
 
-static EventLoop loop;
+/*
+ * All workers share loops[0] by default, taking turns to poll it.
+ * With -O every worker has its own loop and owns the bitcasks with
+ * index % nloops == its id, storage calls for the others are forwarded
+ * to their owners. This only routes the calls: the flush and optimizing
+ * threads still share the bitcasks, so they keep all their locks, which
+ * are just not contended by the workers.
+ */
+static EventLoop *loops;
+static int nloops = 1;
+static unsigned short fd_loops[AE_SETSIZE];
+static int next_loop = 0;
 static pthread_mutex_t leader;
+static __thread int worker_id = -1;
+
+/* single producer single consumer queue of forwarded calls */
+#define RING_SIZE 4
+
+typedef struct
+{
+    void *slots[RING_SIZE];
+    volatile uint32_t head;     /* written by the consumer */
+    char pad[64];
+    volatile uint32_t tail;     /* written by the producer */
+} Ring;
+
+typedef struct
+{
+    void (*func)(void *arg);
+    void *arg;
+    volatile int done;
+} Call;
+
+static Ring *rings;     /* nloops * nloops, rings[from * nloops + to] */
+static uint64_t forwarded_calls = 0;
+
+/*
+ * With -O and the workers pinned over several nodes, a connection whose
+ * storage calls mostly go to the workers of another node is moved to a
+ * loop there, so that its lookups stay local.
+ */
+#define STEER_WINDOW 64
+
+static bool steering = false;
+static int *loop_nodes;     /* node of every loop, with steering only */
+static __thread uint32_t node_calls[AFF_MAX_NODES];   /* of the current event */
+static uint64_t steered_conns = 0;
 
 /*
  * Pulls a conn structure from the freelist, if one is available.
@@ -73,6 +127,18 @@ bool mt_conn_add_to_freelist(conn *c)
     return result;
 }
 
+/*
+ * Frees connections in the freelist, returns the bytes released.
+ */
+size_t mt_conn_trim_freelist(size_t goal)
+{
+    size_t released;
+    pthread_mutex_lock(&conn_lock);
+    released = do_conn_trim_freelist(goal);
+    pthread_mutex_unlock(&conn_lock);
+    return released;
+}
+
 /*
  * Pulls a item buffer from the freelist, if one is available.
  */
@@ -102,6 +168,18 @@ int mt_item_add_to_freelist(item *it)
     return result;
 }
 
+/*
+ * Frees item buffers in the freelist, returns the bytes released.
+ */
+size_t mt_item_trim_freelist(size_t goal)
+{
+    size_t released;
+    pthread_mutex_lock(&ibuffer_lock);
+    released = do_item_trim_freelist(goal);
+    pthread_mutex_unlock(&ibuffer_lock);
+    return released;
+}
+
 /******************************* GLOBAL STATS ******************************/
 
 void mt_stats_lock()
@@ -136,13 +214,55 @@ void thread_init(int nthreads)
     pthread_mutex_init(&conn_lock, NULL);
     pthread_mutex_init(&leader, NULL);
 
-    memset(&loop, 0, sizeof(loop));
-    if (aeApiCreate(&loop) == -1)
+    int per_loop = nthreads;
+    if (settings.shared_nothing)
     {
-        exit(1);
+        nloops = nthreads;
+        per_loop = 1;
+        rings = (Ring*)safe_malloc(sizeof(Ring) * nloops * nloops);
+        memset(rings, 0, sizeof(Ring) * nloops * nloops);
+    }
+    loops = (EventLoop*)safe_malloc(sizeof(EventLoop) * nloops);
+    memset(loops, 0, sizeof(EventLoop) * nloops);
+    for (i = 0; i < nloops; i++)
+    {
+        EventLoop *loop = &loops[i];
+        loop->setsize = AE_SETSIZE;
+        if (settings.max_pending > 0 && settings.max_pending < AE_SETSIZE / per_loop)
+            loop->setsize = settings.max_pending * per_loop;
+        loop->wakefd = -1;
+        if (aeApiCreate(loop) == -1)
+        {
+            exit(1);
+        }
+        if (settings.shared_nothing)
+        {
+            loop->wakefd = eventfd(0, EFD_NONBLOCK);
+            if (loop->wakefd == -1 || aeApiAddEvent(loop, loop->wakefd, AE_READABLE) == -1)
+            {
+                log_fatal("create eventfd failed: %s", strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    if (settings.shared_nothing && aff_nodes() > 1 && aff_worker_node(0) >= 0)
+    {
+        loop_nodes = (int*)safe_malloc(sizeof(int) * nloops);
+        for (i = 0; i < nloops; i++)
+            loop_nodes[i] = aff_worker_node(i);
+        for (i = 1; i < nloops; i++)
+        {
+            if (loop_nodes[i] != loop_nodes[0])
+                steering = true;
+        }
     }
 }
 
+/*
+ * Listening sockets stay in loops[0], accepted connections are spread
+ * round robin over the loops.
+ */
 int add_event(int fd, int mask, conn *c)
 {
     if (fd >= AE_SETSIZE)
@@ -150,15 +270,20 @@ int add_event(int fd, int mask, conn *c)
         log_error("fd is too large: %d", fd);
         return AE_ERR;
     }
-    if (loop.conns[fd] != NULL)
+    int i = 0;
+    if (nloops > 1 && c->state != conn_listening)
+        i = __sync_fetch_and_add(&next_loop, 1) % nloops;
+    EventLoop *loop = &loops[i];
+    if (loop->conns[fd] != NULL)
     {
         log_error("fd is used: %d", fd);
         return AE_ERR;
     }
-    loop.conns[fd] = c;
-    if (aeApiAddEvent(&loop, fd, mask) == -1)
+    loop->conns[fd] = c;
+    fd_loops[fd] = i;
+    if (aeApiAddEvent(loop, fd, mask) == -1)
     {
-        loop.conns[fd] = NULL;
+        loop->conns[fd] = NULL;
         return AE_ERR;
     }
     return AE_OK;
@@ -166,10 +291,11 @@ int add_event(int fd, int mask, conn *c)
 
 int update_event(int fd, int mask, conn *c)
 {
-    loop.conns[fd] = c;
-    if (aeApiUpdateEvent(&loop, fd, mask) == -1)
+    EventLoop *loop = &loops[fd_loops[fd]];
+    loop->conns[fd] = c;
+    if (aeApiUpdateEvent(loop, fd, mask) == -1)
     {
-        loop.conns[fd] = NULL;
+        loop->conns[fd] = NULL;
         return AE_ERR;
     }
     return AE_OK;
@@ -178,15 +304,194 @@ int update_event(int fd, int mask, conn *c)
 int delete_event(int fd)
 {
     if (fd >= AE_SETSIZE) return -1;
-    loop.conns[fd] = NULL;
-    if (aeApiDelEvent(&loop, fd) == -1)
+    EventLoop *loop = &loops[fd_loops[fd]];
+    loop->conns[fd] = NULL;
+    if (aeApiDelEvent(loop, fd) == -1)
         return -1;
     return 0;
 }
 
+/******************************* SHARED NOTHING ******************************/
+
+static inline bool ring_push(Ring *r, void *p)
+{
+    uint32_t tail = r->tail;
+    if (tail - r->head == RING_SIZE)
+        return false;
+    r->slots[tail % RING_SIZE] = p;
+    __sync_synchronize();
+    r->tail = tail + 1;
+    return true;
+}
+
+static inline void *ring_pop(Ring *r)
+{
+    uint32_t head = r->head;
+    if (head == r->tail)
+        return NULL;
+    __sync_synchronize();
+    void *p = r->slots[head % RING_SIZE];
+    __sync_synchronize();
+    r->head = head + 1;
+    return p;
+}
+
+static inline void wake_loop(int i)
+{
+    uint64_t one = 1;
+    if (write(loops[i].wakefd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        log_error("wake up loop %d failed: %s", i, strerror(errno));
+}
+
+/*
+ * Run the calls forwarded to this worker, return how many.
+ */
+static int serve_calls(int self)
+{
+    uint64_t n;
+    int from, served = 0;
+    while (read(loops[self].wakefd, &n, sizeof(n)) > 0)
+        ;
+    for (from = 0; from < nloops; from++)
+    {
+        Ring *r = &rings[from * nloops + self];
+        Call *call;
+        while ((call = (Call*)ring_pop(r)) != NULL)
+        {
+            call->func(call->arg);
+            __sync_synchronize();
+            call->done = 1;
+            wake_loop(from);
+            served++;
+        }
+    }
+    return served;
+}
+
+/*
+ * Run a storage operation on the key. With -O, it is run by the worker
+ * owning the bitcask of the key, and the caller keeps serving the calls
+ * forwarded to it while waiting, so two workers calling each other can
+ * not deadlock.
+ */
+void mt_storage_run(const HKey *hk, void (*func)(void *arg), void *arg)
+{
+    int self = worker_id;
+    int owner = nloops > 1 ? hs_index(store, hk) % nloops : self;
+    if (steering && self >= 0)
+        node_calls[loop_nodes[owner]]++;
+    if (owner == self || self < 0)
+    {
+        func(arg);
+        return;
+    }
+
+    Call call = {func, arg, 0};
+    Ring *r = &rings[self * nloops + owner];
+    while (!ring_push(r, &call))
+        serve_calls(self);
+    wake_loop(owner);
+    __sync_add_and_fetch(&forwarded_calls, 1);
+
+    struct pollfd pfd = {loops[self].wakefd, POLLIN, 0};
+    while (!call.done)
+    {
+        if (serve_calls(self) == 0 && !call.done)
+            poll(&pfd, 1, 100);
+    }
+    __sync_synchronize();
+}
+
+uint64_t mt_forwarded_calls(void)
+{
+    return forwarded_calls;
+}
+
+uint64_t mt_steered_conns(void)
+{
+    return steered_conns;
+}
+
+/*
+ * Add the calls of the last event to the connection, return the loop to
+ * move it to, or -1 to keep it.
+ */
+static int steer(conn *c, int self)
+{
+    int i, best = 0, nnodes = aff_nodes();
+    for (i = 0; i < nnodes; i++)
+    {
+        c->node_calls[i] += node_calls[i];
+        c->ncalls += node_calls[i];
+    }
+    if (c->ncalls < STEER_WINDOW)
+        return -1;
+
+    for (i = 1; i < nnodes; i++)
+    {
+        if (c->node_calls[i] > c->node_calls[best])
+            best = i;
+    }
+    bool move = best != loop_nodes[self] && c->node_calls[best] >= c->ncalls / 4 * 3;
+    memset(c->node_calls, 0, sizeof(c->node_calls));
+    c->ncalls = 0;
+    if (!move)
+        return -1;
+
+    int start = __sync_fetch_and_add(&next_loop, 1);
+    for (i = 0; i < nloops; i++)
+    {
+        int to = (start + i) % nloops;
+        if (loop_nodes[to] == best)
+            return to;
+    }
+    return -1;
+}
+
+/*
+ * The event is one shot, so no other worker can handle the connection
+ * before it is added to the new loop.
+ */
+static void move_conn(EventLoop *from, int fd, conn *c, int to)
+{
+    EventLoop *loop = &loops[to];
+    aeApiDelEvent(from, fd);
+    from->conns[fd] = NULL;
+    loop->conns[fd] = c;
+    fd_loops[fd] = to;
+    __sync_synchronize();
+    if (aeApiAddEvent(loop, fd, c->ev_flags) == -1)
+    {
+        conn_close(c);
+        return;
+    }
+    __sync_add_and_fetch(&steered_conns, 1);
+}
+
+static void handle_event(EventLoop *loop, int fd, conn *c)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    c->queue_wait = (now.tv_sec - loop->poll_time.tv_sec) + (now.tv_nsec - loop->poll_time.tv_nsec) / 1e9;
+
+    if (steering)
+        memset(node_calls, 0, sizeof(node_calls));
+    if (drive_machine(c))
+    {
+        int to = steering ? steer(c, loop - loops) : -1;
+        if (to >= 0)
+            move_conn(loop, fd, c, to);
+        else if (update_event(fd, c->ev_flags, c))
+            conn_close(c);
+    }
+}
+
 static void *worker_main(void *arg)
 {
     pthread_setcanceltype (PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+    worker_id = (int)(intptr_t)arg;
+    aff_set_class(AFF_WORKER, worker_id);
+    EventLoop *loop = &loops[0];
 
     struct timeval tv = {1, 0};
     while (!daemon_quit)
@@ -194,17 +499,21 @@ static void *worker_main(void *arg)
         pthread_mutex_lock(&leader);
 
 AGAIN:
-        while(loop.nready == 0 && daemon_quit == 0)
-            loop.nready = aeApiPoll(&loop, &tv);
+        while(loop->nready == 0 && daemon_quit == 0)
+        {
+            loop->nready = aeApiPoll(loop, &tv);
+            if (loop->nready > 0)
+                clock_gettime(CLOCK_MONOTONIC, &loop->poll_time);
+        }
         if (daemon_quit)
         {
             pthread_mutex_unlock(&leader);
             break;
         }
 
-        loop.nready --;
-        int fd = loop.fired[loop.nready];
-        conn *c = loop.conns[fd];
+        loop->nready --;
+        int fd = loop->fired[loop->nready];
+        conn *c = loop->conns[fd];
         if (c == NULL)
         {
             log_error("Bug: conn %d should not be NULL", fd);
@@ -212,13 +521,52 @@ AGAIN:
             close(fd);
             goto AGAIN;
         }
-        //loop.conns[fd] = NULL;
+        //loop->conns[fd] = NULL;
         pthread_mutex_unlock(&leader);
 
-        if (drive_machine(c))
+        handle_event(loop, fd, c);
+    }
+    return NULL;
+}
+
+/*
+ * With -O, every worker polls its own loop alone.
+ */
+static void *owner_main(void *arg)
+{
+    pthread_setcanceltype (PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+    worker_id = (int)(intptr_t)arg;
+    aff_set_class(AFF_WORKER, worker_id);
+    EventLoop *loop = &loops[worker_id];
+
+    struct timeval tv = {1, 0};
+    while (!daemon_quit)
+    {
+        if (loop->nready == 0)
+        {
+            loop->nready = aeApiPoll(loop, &tv);
+            if (loop->nready > 0)
+                clock_gettime(CLOCK_MONOTONIC, &loop->poll_time);
+            continue;
+        }
+
+        loop->nready --;
+        int fd = loop->fired[loop->nready];
+        if (fd == loop->wakefd)
         {
-            if (update_event(fd, c->ev_flags, c)) conn_close(c);
+            serve_calls(worker_id);
+            aeApiUpdateEvent(loop, fd, AE_READABLE);
+            continue;
         }
+        conn *c = loop->conns[fd];
+        if (c == NULL)
+        {
+            log_error("Bug: conn %d should not be NULL", fd);
+            delete_event(fd);
+            close(fd);
+            continue;
+        }
+        handle_event(loop, fd, c);
     }
     return NULL;
 }
@@ -230,9 +578,10 @@ void loop_run(int nthread)
     pthread_attr_init(&attr);
     pthread_t *tids = (pthread_t*)safe_malloc(sizeof(pthread_t) * nthread);
 
+    void *(*run)(void *) = nloops > 1 ? owner_main : worker_main;
     for (i = 0; i < nthread - 1; i++)
     {
-        if ((ret = pthread_create(tids + i, &attr, worker_main, NULL)) != 0)
+        if ((ret = pthread_create(tids + i, &attr, run, (void*)(intptr_t)(i + 1))) != 0)
         {
             log_fatal("Can't create thread: %s",
                     strerror(ret));
@@ -240,7 +589,7 @@ void loop_run(int nthread)
         }
     }
 
-    worker_main(NULL);
+    run((void*)(intptr_t)0);
 
     // wait workers to stop
     for (i = 0; i < nthread - 1; i++)
@@ -250,5 +599,10 @@ void loop_run(int nthread)
     }
     free(tids);
 
-    aeApiFree(&loop);
+    for (i = 0; i < nloops; i++)
+    {
+        if (loops[i].wakefd >= 0)
+            close(loops[i].wakefd);
+        aeApiFree(&loops[i]);
+    }
 }